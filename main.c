@@ -1,63 +1,118 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200112L  // getaddrinfo
+#endif
 #include "raylib.h"
+#include "rlgl.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// UDP sockets for lockstep play and the shared memory counters. The NO* defines keep windows.h
+// from declaring GDI and USER functions (Rectangle, DrawText, CloseWindow...) that collide with
+// raylib's names.
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOGDI
+#define NOUSER
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#undef near
+#undef far
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #pragma region Types
 
-#define MAX_ENEMIES 5
-#define MAX_BULLETS 10
+// Pool ceilings. GameLimits decides how much of each pool a game actually uses.
+#define MAX_ENEMIES 64
+#define MAX_BULLETS 32  // Per player
 #define MAX_NPCS 3
-#define MAX_PARTICLES 100
+#define MAX_PARTICLES 320  // What the ECS chunks left over from the other archetypes hold
 #define ENEMY_RESPAWN_TIME 2.0f
 #define SWORD_COOLDOWN 0.5f    
 #define SWORD_DURATION 0.2f    
 #define PARTICLE_LIFESPAN 0.5f  
 #define MAP_WIDTH 32
 #define MAP_HEIGHT 18
-#define MAX_CRATES 10
+#define MAX_CRATES 64
 #define MAX_GOLD 10
 #define SWORD_WIDTH 10
 #define SWORD_HEIGHT 30
 #define MAX_DAMAGE_PARTICLES 100
 #define GRAVITY 100.0f 
 #define INITIAL_GOLD_SPEED 200.0f 
+#define MAX_PLAYERS 8
+#define BULLET_POOL (MAX_BULLETS * MAX_PLAYERS)  // Player p owns bullets [p * MAX_BULLETS, (p + 1) * MAX_BULLETS)
 
 
-typedef struct DamageParticle {
-	Vector2 position;
-	Vector2 velocity;
-	float lifetime; 
-	int damageAmount;
-	bool active;
-	Color color;
-} DamageParticle;
+// Size, speed and colour are the same for every entity of a kind, so they live once in
+// GameModel.kinds instead of in each entity. Flags are bitfields packed into one byte.
+typedef enum {
+	KindEnemy,
+	KindBullet,
+	KindCrate,
+	KindCount
+} EntityKind;
 
-typedef struct Particle {
-	Vector2 position;
-	Vector2 velocity;
-	float lifespan;
+typedef struct KindInfo {
+	int size;
+	float speed;
 	Color color;
-	bool active;
-} Particle;
+} KindInfo;
 
+// Live entities a game allows, each at most its pool ceiling. setup() uses the stock values,
+// a soak run raises them while the game is running.
+typedef struct GameLimits {
+	short enemies;
+	short bulletsPerPlayer;
+	short crates;
+	short particles;
+} GameLimits;
 
+const GameLimits defaultLimits = { .enemies = 5, .bulletsPerPlayer = 10, .crates = 10, .particles = 100 };
 
 typedef struct Crate {
 	Vector2 position;
-	int size;
-	int health;
-	bool active;
-	Color color;
-	bool hasGold;
+	short health;
+	unsigned char active : 1;
+	unsigned char hasGold : 1;
+	unsigned char sleeping : 1;  // Linked into its cell's sleeper list instead of the awake list
+	unsigned char idleTicks;  // Ticks awake without being disturbed
 } Crate;
 
-typedef struct Gold {
+typedef struct Sword {
 	Vector2 position;
-	int size;
+	Vector2 size;
+	Color color;
 	bool active;
-	Vector2 velocity;  
-} Gold;
+	float cooldown;
+	float duration;
+} Sword;
 
 typedef struct Player {
 	Vector2 position;
@@ -67,26 +122,43 @@ typedef struct Player {
 	int health;
 	Color color;
 	bool isMoving;
+	Sword sword;
+	const char* activeDialog;  // Dialog of the NPC this player stands on, NULL when none
 } Player;
 
+// Buttons of one player for one tick. The simulation reads input only from these bits, so a
+// lockstep peer needs nothing but this byte per player per tick to reproduce a match.
+typedef enum {
+	InputRight = 1 << 0,
+	InputLeft = 1 << 1,
+	InputUp = 1 << 2,
+	InputDown = 1 << 3,
+	InputFire = 1 << 4,  // Pressed this tick
+	InputSword = 1 << 5,
+	InputInteract = 1 << 6  // Pressed this tick
+} InputButton;
+
+typedef unsigned char PlayerInput;
+
 typedef struct Enemy {
 	Vector2 position;
-	float speed;
-	int size;
-	int health;
-	bool active;
-	Color color;
 	float attackCooldown;
-	float damageTextTimer;
+	short health;
+	unsigned char active : 1;
+	unsigned char chasing : 1;  // Its target player can see it
 } Enemy;
 
+// Pathing and steering state, only read by updateEnemies. Kept out of Enemy so the passes
+// over every enemy (collision, rendering, influence) stay at four enemies a cache line.
+typedef struct EnemySteering {
+	Vector2 searchTarget;  // Where a player was last seen, or heard when none has been seen yet
+	Vector2 velocity;  // Steering velocity of the last tick, neighbours align to it
+} EnemySteering;
+
 typedef struct Bullet {
 	Vector2 position;
-	Vector2 direction;
-	float speed;
-	int size;
-	bool active;
-	Color color;
+	signed char directionX, directionY;  // Bullets only fly along the axes
+	unsigned char active : 1;
 } Bullet;
 
 typedef struct NPC {
@@ -95,19 +167,330 @@ typedef struct NPC {
 	const char* dialog;
 	bool active;
 	Color color;
-	int dialogState;
-	bool interact;
 } NPC;
 
-typedef struct Sword {
-	Vector2 position;
-	Vector2 size;
-	Color color;
-	bool active;
-	float cooldown;
-	float duration;
-} Sword;
 
+#pragma endregion
+
+#pragma region Counters
+
+// Work done per tick, counted by the thread doing it into plain thread-local slots. At the end
+// of each tick update() folds them into that thread's slot of a shared memory segment under a
+// sequence lock, so --watch-counters can read a live process without ever blocking it.
+typedef enum {
+	CounterPathSearches,
+	CounterPathNodes,  // Nodes expanded by findPath
+	CounterPathOpenPeak,  // Longest open list of any one search
+	CounterRectsMovement,  // Rectangle tests per system, batch lanes included
+	CounterRectsEnemies,
+	CounterRectsBullets,
+	CounterRectsSword,
+	CounterRectsCrates,
+	CounterRectsGold,
+	CounterRectsNpcs,
+	CounterSpawnRejects,  // Enemy spawn tiles refused
+	CounterScratchBytes,  // Most scratch arena in use at once
+	CounterInfluenceSplats,  // 3x3 stamps added to or taken off the influence layers
+	CounterParticles,  // Pool occupancy at the end of the tick
+	CounterDamageText,
+	CounterGold,
+	CounterBullets,
+	CounterEventDrops,  // Events raised past MAX_EVENTS_PER_TICK and lost
+	CounterCount
+} CounterId;
+
+const char* counterNames[CounterCount] = {
+	"path searches", "path nodes", "path open peak",
+	"rects movement", "rects enemies", "rects bullets", "rects sword", "rects crates", "rects gold", "rects npcs",
+	"spawn rejects", "scratch bytes", "influence splats", "particles", "damage text", "gold", "bullets",
+	"event drops"
+};
+
+#define COUNTER_MAGIC 0x43505242u  // "BRPC"
+#define COUNTER_VERSION 5
+#define COUNTER_MAX_SLOTS 32  // Live publishing threads; a thread's slot is freed when it exits
+
+typedef struct CounterSlot {
+	_Alignas(64) atomic_uint sequence;  // Odd while the owner writes; a line per thread
+	atomic_int owned;  // A live thread publishes here. A later owner carries on from its totals.
+	uint64_t ticks;
+	uint64_t total[CounterCount];  // Sum of the per-tick values
+	uint64_t peak[CounterCount];  // Largest per-tick value
+} CounterSlot;
+
+typedef struct CounterSegment {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int counterCount;
+	int pid;
+	atomic_int slotCount;  // Slots ever used
+	atomic_int unslotted;  // Live threads that found every slot taken, counted but not published
+	CounterSlot slots[COUNTER_MAX_SLOTS];
+} CounterSegment;
+
+CounterSegment* counterSegment;  // NULL until countersOpen, counts then only reset each tick
+char counterSegmentName[64];
+_Thread_local uint64_t tickCounters[CounterCount];
+_Thread_local CounterSlot* counterSlot;
+_Thread_local bool counterSlotClaimed;
+tss_t counterSlotOwner;  // Gives a thread's slot back when the thread exits
+once_flag counterSlotOwnerOnce = ONCE_FLAG_INIT;
+
+void counterAdd(CounterId id, uint64_t amount) {
+	tickCounters[id] += amount;
+}
+
+void counterMax(CounterId id, uint64_t value) {
+	if (value > tickCounters[id]) tickCounters[id] = value;
+}
+
+int processId(void) {
+#if defined(_WIN32)
+	return (int)GetCurrentProcessId();
+#else
+	return (int)getpid();
+#endif
+}
+
+void counterNameFor(int pid, char* name, size_t size) {
+#if defined(_WIN32)
+	snprintf(name, size, "Local\\barp-counters-%d", pid);
+#else
+	snprintf(name, size, "/barp-counters-%d", pid);
+#endif
+}
+
+// Maps the named segment, creating it for writing or opening an existing one read-only
+void* sharedMap(const char* name, size_t size, bool create) {
+#if defined(_WIN32)
+	HANDLE mapping = create
+		? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name)
+		: OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+	if (mapping == NULL) return NULL;
+	return MapViewOfFile(mapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size);  // The handle lives as long as the process
+#else
+	int fd = create ? shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644) : shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+	if (create && ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	void* base = mmap(NULL, size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return base == MAP_FAILED ? NULL : base;
+#endif
+}
+
+void countersClose(void) {
+	if (counterSegment == NULL) return;
+#if defined(_WIN32)
+	UnmapViewOfFile(counterSegment);
+#else
+	munmap(counterSegment, sizeof(CounterSegment));
+	shm_unlink(counterSegmentName);
+#endif
+	counterSegment = NULL;
+}
+
+// Publishes this process's counters, named after its pid; gone again at exit
+bool countersOpen(void) {
+	counterNameFor(processId(), counterSegmentName, sizeof(counterSegmentName));
+	CounterSegment* segment = sharedMap(counterSegmentName, sizeof(CounterSegment), true);
+	if (segment == NULL) return false;
+	memset(segment, 0, sizeof(*segment));
+	segment->version = COUNTER_VERSION;
+	segment->counterCount = CounterCount;
+	segment->pid = processId();
+	atomic_init(&segment->slotCount, 0);
+	atomic_init(&segment->unslotted, 0);
+	for (int i = 0; i < COUNTER_MAX_SLOTS; i++) {
+		atomic_init(&segment->slots[i].sequence, 0);
+		atomic_init(&segment->slots[i].owned, 0);
+	}
+	atomic_thread_fence(memory_order_release);
+	segment->magic = COUNTER_MAGIC;
+	counterSegment = segment;
+	atexit(countersClose);
+	return true;
+}
+
+// Batch and soak workers come and go, so an exiting thread frees its slot for the next one
+void counterSlotRelease(void* owned) {
+	if (counterSegment == NULL) return;
+	if (owned == &counterSegment->unslotted) atomic_fetch_sub(&counterSegment->unslotted, 1);
+	else atomic_store_explicit(&((CounterSlot*)owned)->owned, 0, memory_order_release);
+}
+
+void counterSlotOwnerInit(void) {
+	tss_create(&counterSlotOwner, counterSlotRelease);
+}
+
+// First free slot, or NULL with the thread counted as unslotted
+CounterSlot* counterSlotClaim(CounterSegment* segment) {
+	call_once(&counterSlotOwnerOnce, counterSlotOwnerInit);
+	for (int s = 0; s < COUNTER_MAX_SLOTS; s++) {
+		int free = 0;
+		if (!atomic_compare_exchange_strong(&segment->slots[s].owned, &free, 1)) continue;
+		int used = atomic_load(&segment->slotCount);
+		while (used < s + 1 && !atomic_compare_exchange_weak(&segment->slotCount, &used, s + 1)) {}
+		tss_set(counterSlotOwner, &segment->slots[s]);
+		return &segment->slots[s];
+	}
+	atomic_fetch_add(&segment->unslotted, 1);
+	tss_set(counterSlotOwner, &segment->unslotted);
+	return NULL;
+}
+
+// Ends the thread's tick: folds its counters into its slot, then starts the next tick from zero
+void countersPublish(void) {
+	if (!counterSlotClaimed && counterSegment != NULL) {
+		counterSlot = counterSlotClaim(counterSegment);
+		counterSlotClaimed = true;
+	}
+	CounterSlot* slot = counterSlot;
+	if (slot != NULL) {
+		unsigned int sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+		atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		slot->ticks++;
+		for (int c = 0; c < CounterCount; c++) {
+			slot->total[c] += tickCounters[c];
+			if (tickCounters[c] > slot->peak[c]) slot->peak[c] = tickCounters[c];
+		}
+		atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+	}
+	memset(tickCounters, 0, sizeof(tickCounters));
+}
+
+// Consistent copy of a slot another process is writing, retried while a write is under way
+void counterSlotRead(const CounterSlot* slot, CounterSlot* out) {
+	for (;;) {
+		unsigned int before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		if (before & 1) continue;
+		out->ticks = slot->ticks;
+		memcpy(out->total, slot->total, sizeof(out->total));
+		memcpy(out->peak, slot->peak, sizeof(out->peak));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before) return;
+	}
+}
+
+#pragma endregion
+
+#pragma region Scratch
+
+// Memory for data that lives at most one tick: path searches, collision grids, event buffers.
+// Each thread has its own arena and update() resets the calling thread's at the start of
+// every tick, so allocating is a pointer bump and nothing is freed piece by piece. What
+// does not fit is malloc'd and freed at the next reset, which also grows the block to that
+// tick's peak, so after the first busy ticks the hot path never touches the heap.
+#define SCRATCH_INITIAL_BYTES (64 * 1024)
+#define SCRATCH_ALIGN 16
+
+typedef struct ScratchSpill {
+	struct ScratchSpill* next;
+	_Alignas(SCRATCH_ALIGN) unsigned char data[];
+} ScratchSpill;
+
+typedef struct ScratchArena {
+	unsigned char* base;
+	size_t used, capacity;
+	size_t spilled;  // Bytes in spills since the last reset
+	size_t peak;  // Most ever in use at once since the last reset
+	ScratchSpill* spills;
+} ScratchArena;
+
+_Thread_local ScratchArena scratch;
+tss_t scratchOwner;  // Frees a thread's arena when the thread exits
+once_flag scratchOwnerOnce = ONCE_FLAG_INIT;
+
+void scratchFreeSpills(ScratchArena* arena) {
+	while (arena->spills != NULL) {
+		ScratchSpill* next = arena->spills->next;
+		free(arena->spills);
+		arena->spills = next;
+	}
+	arena->spilled = 0;
+}
+
+void scratchRelease(void* arg) {
+	ScratchArena* arena = arg;
+	scratchFreeSpills(arena);
+	free(arena->base);
+	*arena = (ScratchArena){ 0 };
+}
+
+void scratchOwnerInit(void) {
+	tss_create(&scratchOwner, scratchRelease);
+}
+
+void* scratchOutOfMemory(size_t bytes) {
+	printf("scratch: cannot allocate %zu bytes\n", bytes);
+	abort();
+}
+
+// The slow path: first use on this thread, or the block is full
+void* scratchSpill(ScratchArena* arena, size_t bytes) {
+	if (arena->base == NULL) {
+		call_once(&scratchOwnerOnce, scratchOwnerInit);
+		arena->base = malloc(SCRATCH_INITIAL_BYTES);
+		if (arena->base == NULL) return scratchOutOfMemory(SCRATCH_INITIAL_BYTES);
+		arena->capacity = SCRATCH_INITIAL_BYTES;
+		tss_set(scratchOwner, arena);
+		if (arena->used + bytes <= arena->capacity) {
+			void* memory = arena->base + arena->used;
+			arena->used += bytes;
+			if (arena->used > arena->peak) arena->peak = arena->used;
+			return memory;
+		}
+	}
+	ScratchSpill* spill = malloc(sizeof(ScratchSpill) + bytes);
+	if (spill == NULL) return scratchOutOfMemory(bytes);
+	spill->next = arena->spills;
+	arena->spills = spill;
+	arena->spilled += bytes;
+	if (arena->used + arena->spilled > arena->peak) arena->peak = arena->used + arena->spilled;
+	return spill->data;
+}
+
+// Uninitialised memory, valid until the next scratchReset or a scratchRewind past it
+void* scratchAlloc(size_t bytes) {
+	ScratchArena* arena = &scratch;
+	bytes = (bytes + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+	if (arena->used + bytes > arena->capacity) return scratchSpill(arena, bytes);
+	void* memory = arena->base + arena->used;
+	arena->used += bytes;
+	if (arena->used + arena->spilled > arena->peak) arena->peak = arena->used + arena->spilled;
+	return memory;
+}
+
+// A call that is done with its scratch by the time it returns gives it back with these
+size_t scratchMark(void) {
+	return scratch.used;
+}
+
+void scratchRewind(size_t mark) {
+	if (mark <= scratch.used) scratch.used = mark;
+}
+
+void scratchReset(void) {
+	ScratchArena* arena = &scratch;
+	counterMax(CounterScratchBytes, arena->peak);
+	if (arena->spills != NULL) {
+		scratchFreeSpills(arena);
+		size_t capacity = arena->capacity;
+		while (capacity < arena->peak) capacity *= 2;
+		unsigned char* base = malloc(capacity);
+		if (base != NULL) {
+			free(arena->base);
+			arena->base = base;
+			arena->capacity = capacity;
+		}
+	}
+	arena->used = 0;
+	arena->peak = 0;
+}
 
 #pragma endregion
 
@@ -204,6 +587,50 @@ const char* playerWalking[2][8] = {
 	}
 };
 
+#define SPRITE_SCALE 8  // Screen pixels per sprite cell
+
+typedef enum {
+	SpritePlayerIdle,
+	SpritePlayerWalking,
+	SpriteEnemy,
+	SpriteNpc,
+	SpriteCount
+} SpriteId;
+
+const char* (*const spriteFrames[SpriteCount])[8] = { playerIdle, playerWalking, enemy, npc };
+
+// The art above packed into one byte per row: bit y * 8 + x is set for an 'X' at column x
+// of row y. Drawing and hit tests read these; spriteMasksMatchArt keeps them honest.
+const uint64_t spriteMasks[SpriteCount][2] = {
+	{ 0x006C181818180000ULL, 0x006C181818181800ULL },
+	{ 0x006C183C3C181800ULL, 0x003C181818181800ULL },
+	{ 0x000024283C240000ULL, 0x00002C2C3C300000ULL },
+	{ 0x0000300C3C181000ULL, 0x00000C303C180800ULL },
+};
+
+bool spriteMasksMatchArt(void) {
+	for (int sprite = 0; sprite < SpriteCount; sprite++) {
+		for (int frame = 0; frame < 2; frame++) {
+			uint64_t packed = 0;
+			for (int y = 0; y < 8; y++) {
+				for (int x = 0; x < 8; x++) {
+					if (spriteFrames[sprite][frame][y][x] == 'X') packed |= (uint64_t)1 << (y * 8 + x);
+				}
+			}
+			if (packed != spriteMasks[sprite][frame]) {
+				printf("sprites: mask of sprite %d frame %d should be 0x%016llX\n", sprite, frame, (unsigned long long)packed);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Cells that can be hit in either animation frame, so hits do not depend on the draw clock
+uint64_t spriteHitMask(SpriteId sprite) {
+	return spriteMasks[sprite][0] | spriteMasks[sprite][1];
+}
+
 char map[MAP_HEIGHT][MAP_WIDTH + 1] = {
 	"################################",
 	"#...........#..................#",
@@ -233,8 +660,6 @@ typedef enum {
 	StageThree
 } GameStage;
 
-#define MAX_NODES 1000 // Max number of nodes the enemy can visit during A*
-
 typedef struct Node {
 	int x, y;  // Position on the grid
 	float gCost, hCost, fCost;  // g = from start, h = to target, f = g + h
@@ -252,19 +677,26 @@ float heuristic(int x1, int y1, int x2, int y2) {
 	return fabsf(x2 - x1) + fabsf(y2 - y1);
 }
 
-// Compare nodes by fCost for the priority queue
+// Compare nodes by fCost for the priority queue, ties broken by grid position so the order
+// never depends on addresses or on how the libc's qsort treats equal keys
 int compareNodes(const void* a, const void* b) {
-	Node* nodeA = (Node*)a;
-	Node* nodeB = (Node*)b;
-	return (nodeA->fCost > nodeB->fCost) - (nodeA->fCost < nodeB->fCost);
+	// The open list holds pointers, qsort hands us pointers to them
+	const Node* nodeA = *(Node* const*)a;
+	const Node* nodeB = *(Node* const*)b;
+	if (nodeA->fCost != nodeB->fCost) return nodeA->fCost < nodeB->fCost ? -1 : 1;
+	int indexA = nodeA->y * MAP_WIDTH + nodeA->x;
+	int indexB = nodeB->y * MAP_WIDTH + nodeB->x;
+	return (indexA > indexB) - (indexA < indexB);
 }
 
+// The nodes live in scratch, so the returned path stays valid until the caller rewinds it
 Node* findPath(Vector2 startPos, Vector2 targetPos, int tileSize) {
-	Node nodes[MAP_HEIGHT][MAP_WIDTH];
-	Node* openList[MAX_NODES];  // Nodes to evaluate
+	Node (*nodes)[MAP_WIDTH] = scratchAlloc(sizeof(Node[MAP_HEIGHT][MAP_WIDTH]));
+	Node** openList = scratchAlloc(sizeof(Node*) * MAP_WIDTH * MAP_HEIGHT);  // Nodes to evaluate, each goes in at most once
 	int openListCount = 0;
 
-	bool closedList[MAP_HEIGHT][MAP_WIDTH] = { false };  // Nodes already evaluated
+	bool (*closedList)[MAP_WIDTH] = scratchAlloc(sizeof(bool[MAP_HEIGHT][MAP_WIDTH]));  // Nodes already evaluated
+	memset(closedList, 0, sizeof(bool[MAP_HEIGHT][MAP_WIDTH]));
 
 	// Initialize nodes
 	for (int y = 0; y < MAP_HEIGHT; y++) {
@@ -278,6 +710,7 @@ Node* findPath(Vector2 startPos, Vector2 targetPos, int tileSize) {
 	Node* targetNode = &nodes[(int)(targetPos.y / tileSize)][(int)(targetPos.x / tileSize)];
 
 	openList[openListCount++] = startNode;
+	counterAdd(CounterPathSearches, 1);
 
 	while (openListCount > 0) {
 		// Sort the open list by fCost (lowest cost first)
@@ -292,6 +725,7 @@ Node* findPath(Vector2 startPos, Vector2 targetPos, int tileSize) {
 
 		// Add current node to the closed list
 		closedList[currentNode->y][currentNode->x] = true;
+		counterAdd(CounterPathNodes, 1);
 
 		// Check if we've reached the target
 		if (currentNode == targetNode) {
@@ -330,6 +764,7 @@ Node* findPath(Vector2 startPos, Vector2 targetPos, int tileSize) {
 
 				if (!isInOpenList) {
 					openList[openListCount++] = neighbor;  // Add to open list if not already present
+					counterMax(CounterPathOpenPeak, openListCount);
 				}
 			}
 		}
@@ -349,961 +784,7186 @@ Vector2 getNextPathPosition(Node* targetNode, Enemy* enemy, int tileSize) {
 	return (Vector2) { currentNode->x* tileSize, currentNode->y* tileSize };
 }
 
+#pragma region Fixed
+
+// Deterministic build, selected with -DGAME_FIXED_POINT. Every length and direction update()
+// takes goes through Q16.16 integers and a sine table filled by integer arithmetic, so they come
+// out bit for bit the same whatever the compiler, flags or libm. What float arithmetic is left is
+// single adds, multiplies and divides, which IEEE pins down as long as nothing fuses or widens them.
+#if defined(GAME_FIXED_POINT)
+#if defined(__FAST_MATH__)
+#error "GAME_FIXED_POINT needs IEEE float arithmetic, build without -ffast-math"
+#endif
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ != 0
+#error "GAME_FIXED_POINT needs floats evaluated as floats (SSE, not x87)"
+#endif
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+#endif
+
+typedef int32_t Fixed;  // Q16.16
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_ANGLE_STEPS 1024  // Sine table entries per turn
+
+typedef struct FixedVector2 {
+	Fixed x, y;
+} FixedVector2;
+
+// Truncates toward zero, saturating outside the Q16.16 range
+Fixed fixedFromFloat(float value) {
+	if (value >= 32767.0f) return INT32_MAX;
+	if (value <= -32768.0f) return INT32_MIN;
+	return (Fixed)(value * FIXED_ONE);
+}
 
-typedef struct GameModel {
-	Player player;
-	Sword sword;
-	Enemy enemies[MAX_ENEMIES];
-	Particle particles[MAX_PARTICLES];
-	Bullet bullets[MAX_BULLETS];
-	Crate crates[MAX_CRATES];
-	Gold gold[MAX_GOLD];
-	float enemySpawnTimer;
-	NPC npcs[MAX_NPCS];
-	const char* activeDialog;
-	int goldCollected;
-	DamageParticle damageParticles[MAX_DAMAGE_PARTICLES];
-	GameStage stage;
-	int killCount;
-} GameModel;
-
-
+float fixedToFloat(Fixed value) {
+	return (float)value / FIXED_ONE;
+}
 
-////////// 
-#pragma region INIT
+FixedVector2 fixedVector(Vector2 v) {
+	return (FixedVector2) { fixedFromFloat(v.x), fixedFromFloat(v.y) };
+}
 
-int animationFrame = 0;
-float animationTimer = 0.0f;
-const float frameDuration = 0.3f;
-
-void spawnDamageParticle(GameModel* model, Vector2 position, int damageAmount, Color color) {
-	for (int i = 0; i < MAX_DAMAGE_PARTICLES; i++) {
-		if (!model->damageParticles[i].active) {
-			model->damageParticles[i].active = true;
-			model->damageParticles[i].position = position;
-			model->damageParticles[i].velocity = (Vector2){ 0, -50 }; // Move the particle upward
-			model->damageParticles[i].lifetime = 1.0f; // Lasts for 1 second
-			model->damageParticles[i].damageAmount = damageAmount;
-			model->damageParticles[i].color = color;
-			break;
-		}
-	}
+Fixed fixedMul(Fixed a, Fixed b) {
+	return (Fixed)(((int64_t)a * b) >> FIXED_SHIFT);
 }
 
-void spawnParticles(Particle particles[], Vector2 position, int count, Color color) {
-	for (int i = 0; i < MAX_PARTICLES && count > 0; i++) {
-		if (!particles[i].active) {
-			particles[i].position = position;
-			// Random velocity
-			float angle = (float)(rand() % 360) * DEG2RAD;
-			float speed = (float)(rand() % 100) / 50.0f;
-			particles[i].velocity = (Vector2){ cosf(angle) * speed, sinf(angle) * speed };
-			particles[i].lifespan = PARTICLE_LIFESPAN;
-			particles[i].color = color;
-			particles[i].active = true;
-			count--;
+// floor(sqrt(value)), one result bit per step
+uint32_t isqrt64(uint64_t value) {
+	uint64_t root = 0;
+	for (uint64_t bit = (uint64_t)1 << 62; bit != 0; bit >>= 2) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else {
+			root >>= 1;
 		}
 	}
+	return (uint32_t)root;
 }
 
-void spawnCrates(Crate crates[], int tileSize) {
-	for (int i = 0; i < MAX_CRATES; i++) {
-		if (!crates[i].active) {
-			crates[i].position = (Vector2){ (rand() % (MAP_WIDTH - 2) + 1) * tileSize, (rand() % (MAP_HEIGHT - 2) + 1) * tileSize };
-			crates[i].size = tileSize;
-			crates[i].health = 2;
-			crates[i].active = true;
-			crates[i].color = BROWN;
-			crates[i].hasGold = true;
-		}
-	}
+// The squares sum in Q32.32, whose root is the length in Q16.16
+Fixed fixedLength(FixedVector2 v) {
+	uint64_t squared = (uint64_t)((int64_t)v.x * v.x) + (uint64_t)((int64_t)v.y * v.y);
+	return (Fixed)isqrt64(squared);
 }
 
-GameModel spawnEnemies(GameModel model, float deltaTime, int tileSize)
-{
-	model.enemySpawnTimer += deltaTime;
-	if (model.enemySpawnTimer >= ENEMY_RESPAWN_TIME) {
-		model.enemySpawnTimer = 0.0f;
-		for (int i = 0; i < MAX_ENEMIES; i++) {
-			if (!model.enemies[i].active) {
-				Vector2 spawnPos;
-				bool validSpawn = false;
-				while (!validSpawn) {
-					spawnPos = (Vector2){ (rand() % MAP_WIDTH) * tileSize, (rand() % MAP_HEIGHT) * tileSize };
-					int spawnMapX = spawnPos.x / tileSize;
-					int spawnMapY = spawnPos.y / tileSize;
-					if (spawnMapY >= 0 && spawnMapY < MAP_HEIGHT && spawnMapX >= 0 && spawnMapX < MAP_WIDTH) {
-						if (map[spawnMapY][spawnMapX] != '#') {
-							validSpawn = true;
-							Rectangle spawnRect = { spawnPos.x, spawnPos.y, model.enemies[i].size, model.enemies[i].size };
-							Rectangle playerRect = { model.player.position.x, model.player.position.y, model.player.size, model.player.size };
-							if (CheckCollisionRecs(spawnRect, playerRect)) {
-								validSpawn = false;
-							}
-						}
-					}
-				}
-				model.enemies[i].position = spawnPos;
-				model.enemies[i].active = true;
-				model.enemies[i].health = 3;
-				break;
-			}
+Fixed fixedSinTable[FIXED_ANGLE_STEPS];
+once_flag fixedSinOnce = ONCE_FLAG_INIT;
+
+// Taylor series in Q2.30 up to x^13 over the first quarter turn, mirrored into the other three
+void fixedSinInit(void) {
+	const int64_t twoPi = 6746518852;  // 2 pi in Q2.30
+	for (int i = 0; i <= FIXED_ANGLE_STEPS / 4; i++) {
+		int64_t x = twoPi * i / FIXED_ANGLE_STEPS;
+		int64_t term = x, sum = x;
+		for (int k = 1; k <= 6; k++) {
+			term = -(((term * x) >> 30) * x >> 30) / ((2 * k) * (2 * k + 1));
+			sum += term;
 		}
+		Fixed value = (Fixed)((sum + (1 << 13)) >> 14);
+		fixedSinTable[i] = value;
+		fixedSinTable[FIXED_ANGLE_STEPS / 2 - i] = value;
+		fixedSinTable[(FIXED_ANGLE_STEPS / 2 + i) % FIXED_ANGLE_STEPS] = -value;
+		fixedSinTable[(FIXED_ANGLE_STEPS - i) % FIXED_ANGLE_STEPS] = -value;
 	}
-	return model;
 }
 
-GameModel spawnGold(GameModel model, Vector2 cratePosition, int tileSize) {
-	for (int g = 0; g < MAX_GOLD; g++) {
-		if (!model.gold[g].active) {
-			float randomOffsetX = (rand() % 20 - 10) * 0.1f; // Random offset between -1.0 and 1.0
-			float randomOffsetY = (rand() % 20 - 10) * 0.1f;
+// Angles count FIXED_ANGLE_STEPS to the turn
+Fixed fixedSin(int angle) {
+	call_once(&fixedSinOnce, fixedSinInit);
+	return fixedSinTable[angle & (FIXED_ANGLE_STEPS - 1)];
+}
 
-			model.gold[g].position = cratePosition;
+Fixed fixedCos(int angle) {
+	return fixedSin(angle + FIXED_ANGLE_STEPS / 4);
+}
 
-			// Set initial velocity to simulate "falling out"
-			model.gold[g].velocity = (Vector2){
-				randomOffsetX * 500.0f, randomOffsetY * 500.0f
-			};
+// Length of v, the only square root the simulation takes
+float simLength(Vector2 v) {
+#if defined(GAME_FIXED_POINT)
+	return fixedToFloat(fixedLength(fixedVector(v)));
+#else
+	return sqrtf(v.x * v.x + v.y * v.y);
+#endif
+}
 
-			model.gold[g].size = tileSize / 2;
-			model.gold[g].active = true;
-			break;
-		}
-	}
-	return model;
+// Unit vector for a random roll: a whole degree, or a table step in the fixed-point build
+Vector2 simDirection(unsigned int roll) {
+#if defined(GAME_FIXED_POINT)
+	int angle = (int)(roll % FIXED_ANGLE_STEPS);
+	return (Vector2) { fixedToFloat(fixedCos(angle)), fixedToFloat(fixedSin(angle)) };
+#else
+	float angle = (float)(roll % 360) * DEG2RAD;
+	return (Vector2) { cosf(angle), sinf(angle) };
+#endif
 }
 
-GameModel setup(int tileSize)
-{
-	GameModel model =
-	{ .player = (Player)
-		 {.position = (Vector2){ 2 * tileSize, 2 * tileSize }
-		 , .direction = (Vector2){ 0, -1 }
-		 , .speed = 200.0f
-		 , .size = 50
-		 , .health = 10
-		 , .color = BLUE
-		}
-	, .sword = (Sword)
-		{.size = (Vector2){40, 10}
-		, .color = DARKBROWN
-		, .active = false
-		, .cooldown = 0.0f
-		, .duration = 0.0f
-		}
-	, .enemies = {0}
-	, .particles = { 0 }
-	, .bullets = { 0 }
-	, .enemySpawnTimer = 0.0f
-	, .npcs = { 0 }
-	, .activeDialog = NULL
-	, .goldCollected = 0
-	, .crates = {0}
-	, .gold = {0}
-	, .stage = StageOne
-	};
+#pragma endregion
 
-	for (int i = 0; i < MAX_NPCS; i++) {
-		model.npcs[i].position = (Vector2){ (4 + i * 2) * tileSize, 2 * tileSize };
-		model.npcs[i].size = tileSize;
-		model.npcs[i].dialog = "";//i == 0 ? "Hello, brave warrior!" : i == 1 ? "Beware of the enemies ahead!" : "You must find the sacred relic.";
-		model.npcs[i].active = false;
-		model.npcs[i].color = GREEN;
-	}
+#pragma region Collision
 
-	for (int i = 0; i < MAX_ENEMIES; i++) {
-		model.enemies[i].speed = 100.0f;
-		model.enemies[i].size = tileSize;
-		model.enemies[i].health = 1;
-		model.enemies[i].active = false;
-		model.enemies[i].color = RED;
-		model.enemies[i].attackCooldown = 0.0f;
-		model.enemies[i].damageTextTimer = 0.0f;
+typedef enum {
+	HitNone,
+	HitWall,
+	HitEnemy,
+	HitCrate
+} HitKind;
+
+// Steps through every tile a segment crosses, in order (Amanatides & Woo grid DDA)
+typedef struct TileWalker {
+	int x, y;  // Current tile
+	int stepX, stepY;
+	float t;  // Fraction of the segment travelled when entering the current tile
+	float tMaxX, tMaxY;  // Fraction at which the next vertical / horizontal tile edge is crossed
+	float tDeltaX, tDeltaY;  // Fraction needed to cross one whole tile
+} TileWalker;
+
+TileWalker beginTileWalk(Vector2 from, Vector2 to, int tileSize) {
+	TileWalker walker = { 0 };
+	Vector2 delta = { to.x - from.x, to.y - from.y };
+
+	walker.x = (int)floorf(from.x / tileSize);
+	walker.y = (int)floorf(from.y / tileSize);
+	walker.stepX = delta.x > 0 ? 1 : -1;
+	walker.stepY = delta.y > 0 ? 1 : -1;
+	walker.t = 0.0f;
+
+	if (delta.x != 0) {
+		float edgeX = (delta.x > 0 ? walker.x + 1 : walker.x) * (float)tileSize;
+		walker.tMaxX = (edgeX - from.x) / delta.x;
+		walker.tDeltaX = tileSize / fabsf(delta.x);
+	}
+	else {
+		walker.tMaxX = INFINITY;
+		walker.tDeltaX = INFINITY;
 	}
 
-	for (int i = 0; i < MAX_BULLETS; i++) {
-		model.bullets[i].speed = 400.0f;
-		model.bullets[i].size = 10;
-		model.bullets[i].active = false;
-		model.bullets[i].color = BLACK;
+	if (delta.y != 0) {
+		float edgeY = (delta.y > 0 ? walker.y + 1 : walker.y) * (float)tileSize;
+		walker.tMaxY = (edgeY - from.y) / delta.y;
+		walker.tDeltaY = tileSize / fabsf(delta.y);
+	}
+	else {
+		walker.tMaxY = INFINITY;
+		walker.tDeltaY = INFINITY;
 	}
+	return walker;
+}
 
-	spawnCrates(model.crates, tileSize);
-	return model;
+// Move to the next tile along the segment, returns false once the segment has ended
+bool nextTile(TileWalker* walker) {
+	if (walker->tMaxX < walker->tMaxY) {
+		walker->t = walker->tMaxX;
+		walker->tMaxX += walker->tDeltaX;
+		walker->x += walker->stepX;
+	}
+	else {
+		walker->t = walker->tMaxY;
+		walker->tMaxY += walker->tDeltaY;
+		walker->y += walker->stepY;
+	}
+	return walker->t <= 1.0f;
 }
-#pragma endregion
 
-#pragma region Update
+#define MASK_ROWS 0x0101010101010101ULL  // Times a byte of columns, the same columns in every row
+
+// Cells of a sprite drawn at origin that rect overlaps, with the same strict edges as
+// CheckCollisionRecs
+uint64_t rectMask(Rectangle rect, Vector2 origin) {
+	int x0 = (int)floorf((rect.x - origin.x) / SPRITE_SCALE);
+	int y0 = (int)floorf((rect.y - origin.y) / SPRITE_SCALE);
+	int x1 = (int)ceilf((rect.x + rect.width - origin.x) / SPRITE_SCALE) - 1;
+	int y1 = (int)ceilf((rect.y + rect.height - origin.y) / SPRITE_SCALE) - 1;
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > 7) x1 = 7;
+	if (y1 > 7) y1 = 7;
+	if (x0 > x1 || y0 > y1) return 0;
+	uint64_t columns = (0xFFu >> (7 - x1)) & (0xFFu << x0);
+	uint64_t rows = (~0ULL >> (8 * (7 - y1))) & (~0ULL << (8 * y0));
+	return columns * MASK_ROWS & rows;
+}
 
-GameModel moveNPCToPlayer(GameModel model, float deltaTime, float npcSpeed, float stoppingDistance) {
-	// Access the NPC and the player's position
-	Vector2 npcPos = model.npcs[0].position; // NPC's current position
-	Vector2 playerPos = model.player.position; // Player's current position
+// Slab test of the segment from + delta * t (t in [0, 1]) against a rectangle
+bool segmentHitsRect(Vector2 from, Vector2 delta, Rectangle rect, float* tEnter, float* tExit) {
+	float tMin = 0.0f;
+	float tMax = 1.0f;
+	float origin[2] = { from.x, from.y };
+	float dir[2] = { delta.x, delta.y };
+	float lo[2] = { rect.x, rect.y };
+	float hi[2] = { rect.x + rect.width, rect.y + rect.height };
+
+	for (int axis = 0; axis < 2; axis++) {
+		if (dir[axis] == 0) {
+			if (origin[axis] <= lo[axis] || origin[axis] >= hi[axis]) return false;
+			continue;
+		}
+		float t1 = (lo[axis] - origin[axis]) / dir[axis];
+		float t2 = (hi[axis] - origin[axis]) / dir[axis];
+		if (t1 > t2) { float tmp = t1; t1 = t2; t2 = tmp; }
+		if (t1 > tMin) tMin = t1;
+		if (t2 < tMax) tMax = t2;
+		if (tMin >= tMax) return false;
+	}
 
-	// Calculate the direction vector from the NPC to the player
-	Vector2 direction = {
-		playerPos.x - npcPos.x,
-		playerPos.y - npcPos.y
-	};
+	*tEnter = tMin;
+	*tExit = tMax;
+	return true;
+}
 
-	// Calculate the distance between the NPC and the player
-	float distance = sqrtf(direction.x * direction.x + direction.y * direction.y);
+// Boxes to test against one query at a time, stored as four separate arrays so that the
+// overlap test runs 8 (AVX) or 4 (SSE) boxes per instruction. Slots past count hold empty
+// boxes, the kernel always runs whole groups of 8 and they never hit.
+#define BOX_BATCH_MAX (((MAX_ENEMIES > MAX_CRATES ? MAX_ENEMIES : MAX_CRATES) + 7) & ~7)
+#define BOX_MASK_WORDS ((BOX_BATCH_MAX + 63) / 64)
+
+// The fixed-point build keeps the edges as Q16.16 and compares them with integer SIMD
+#if defined(GAME_FIXED_POINT)
+typedef Fixed BoxCoord;
+#define BOX_COORD(value) fixedFromFloat(value)
+#define BOX_COORD_MAX INT32_MAX
+#define BOX_COORD_MIN INT32_MIN
+#else
+typedef float BoxCoord;
+#define BOX_COORD(value) (value)
+#define BOX_COORD_MAX INFINITY
+#define BOX_COORD_MIN (-INFINITY)
+#endif
+
+typedef struct BoxBatch {
+	int count;
+	BoxCoord minX[BOX_BATCH_MAX];
+	BoxCoord minY[BOX_BATCH_MAX];
+	BoxCoord maxX[BOX_BATCH_MAX];
+	BoxCoord maxY[BOX_BATCH_MAX];
+} BoxBatch;
+
+void boxBatchSet(BoxBatch* batch, int slot, Rectangle rect) {
+	batch->minX[slot] = BOX_COORD(rect.x);
+	batch->minY[slot] = BOX_COORD(rect.y);
+	batch->maxX[slot] = BOX_COORD(rect.x + rect.width);
+	batch->maxY[slot] = BOX_COORD(rect.y + rect.height);
+}
 
-	// Move the NPC only if it's farther than the stopping distance
-	if (distance > stoppingDistance) {
-		// Normalize the direction vector
-		direction.x /= distance;
-		direction.y /= distance;
+// A box nothing overlaps, for dead entities that keep their slot
+void boxBatchClearSlot(BoxBatch* batch, int slot) {
+	batch->minX[slot] = batch->minY[slot] = BOX_COORD_MAX;
+	batch->maxX[slot] = batch->maxY[slot] = BOX_COORD_MIN;
+}
 
-		// Update the NPC's position by moving it towards the player
-		npcPos.x += direction.x * npcSpeed * deltaTime;
-		npcPos.y += direction.y * npcSpeed * deltaTime;
+void boxBatchReset(BoxBatch* batch, int count) {
+	batch->count = count;
+	for (int slot = 0; slot < BOX_BATCH_MAX; slot++) boxBatchClearSlot(batch, slot);
+}
 
-		// Assign the updated position back to the NPC in the model
-		model.npcs[0].position = npcPos;
+// Bit i of mask is set when slot i overlaps query, with CheckCollisionRecs' strict edges:
+// boxes that only touch do not overlap.
+void boxBatchOverlaps(const BoxBatch* batch, Rectangle query, uint64_t mask[BOX_MASK_WORDS]) {
+	BoxCoord queryMinX = BOX_COORD(query.x);
+	BoxCoord queryMinY = BOX_COORD(query.y);
+	BoxCoord queryMaxX = BOX_COORD(query.x + query.width);
+	BoxCoord queryMaxY = BOX_COORD(query.y + query.height);
+	memset(mask, 0, sizeof(uint64_t) * BOX_MASK_WORDS);
+	int count = (batch->count + 7) & ~7;
+	for (int i = 0; i < count; i += 8) {
+#if defined(GAME_FIXED_POINT) && defined(__AVX2__)
+		__m256i hit = _mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(batch->maxX + i)), _mm256_set1_epi32(queryMinX)),
+				_mm256_cmpgt_epi32(_mm256_set1_epi32(queryMaxX), _mm256_loadu_si256((const __m256i*)(batch->minX + i)))),
+			_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(batch->maxY + i)), _mm256_set1_epi32(queryMinY)),
+				_mm256_cmpgt_epi32(_mm256_set1_epi32(queryMaxY), _mm256_loadu_si256((const __m256i*)(batch->minY + i)))));
+		uint64_t bits = (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(hit));
+#elif defined(GAME_FIXED_POINT) && defined(HAVE_SSE2)
+		uint64_t bits = 0;
+		for (int half = 0; half < 8; half += 4) {
+			__m128i hit = _mm_and_si128(
+				_mm_and_si128(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(batch->maxX + i + half)), _mm_set1_epi32(queryMinX)),
+					_mm_cmpgt_epi32(_mm_set1_epi32(queryMaxX), _mm_loadu_si128((const __m128i*)(batch->minX + i + half)))),
+				_mm_and_si128(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(batch->maxY + i + half)), _mm_set1_epi32(queryMinY)),
+					_mm_cmpgt_epi32(_mm_set1_epi32(queryMaxY), _mm_loadu_si128((const __m128i*)(batch->minY + i + half)))));
+			bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(hit)) << half;
+		}
+#elif !defined(GAME_FIXED_POINT) && defined(__AVX__)
+		__m256 hit = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(queryMinX), _mm256_loadu_ps(batch->maxX + i), _CMP_LT_OQ),
+				_mm256_cmp_ps(_mm256_set1_ps(queryMaxX), _mm256_loadu_ps(batch->minX + i), _CMP_GT_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(queryMinY), _mm256_loadu_ps(batch->maxY + i), _CMP_LT_OQ),
+				_mm256_cmp_ps(_mm256_set1_ps(queryMaxY), _mm256_loadu_ps(batch->minY + i), _CMP_GT_OQ)));
+		uint64_t bits = (uint64_t)_mm256_movemask_ps(hit);
+#elif !defined(GAME_FIXED_POINT) && defined(HAVE_SSE2)
+		uint64_t bits = 0;
+		for (int half = 0; half < 8; half += 4) {
+			__m128 hit = _mm_and_ps(
+				_mm_and_ps(_mm_cmplt_ps(_mm_set1_ps(queryMinX), _mm_loadu_ps(batch->maxX + i + half)),
+					_mm_cmpgt_ps(_mm_set1_ps(queryMaxX), _mm_loadu_ps(batch->minX + i + half))),
+				_mm_and_ps(_mm_cmplt_ps(_mm_set1_ps(queryMinY), _mm_loadu_ps(batch->maxY + i + half)),
+					_mm_cmpgt_ps(_mm_set1_ps(queryMaxY), _mm_loadu_ps(batch->minY + i + half))));
+			bits |= (uint64_t)_mm_movemask_ps(hit) << half;
+		}
+#else
+		uint64_t bits = 0;
+		for (int k = 0; k < 8; k++) {
+			bool hit = queryMinX < batch->maxX[i + k] && queryMaxX > batch->minX[i + k] && queryMinY < batch->maxY[i + k] && queryMaxY > batch->minY[i + k];
+			bits |= (uint64_t)hit << k;
+		}
+#endif
+		mask[i >> 6] |= bits << (i & 63);
 	}
+}
 
-	return model;
+bool boxMaskAny(const uint64_t mask[BOX_MASK_WORDS]) {
+	uint64_t any = 0;
+	for (int w = 0; w < BOX_MASK_WORDS; w++) any |= mask[w];
+	return any != 0;
 }
 
-GameModel updateStage(GameModel model, float deltaTime, int tileSize) {
-	switch (model.stage) {
-	case StageOneSetup:
-		// NPC dialog setup for stage one
-		
-		model.stage = StageOne;
-		break;
+typedef struct GridEntry {
+	Rectangle rect;
+	HitKind kind;
+	int index;  // Index into the pool the entry came from
+	uint64_t mask;  // Cells of a sprite drawn at the rect's corner, 0 when the whole rect is solid
+} GridEntry;
+
+// Uniform grid over the map tiles, rebuilt every tick from the entities that can be hit.
+// Items are stored per cell contiguously (counting sort), so a query is a single range scan.
+// The arrays are scratch, so a grid only lasts the tick it was built in.
+typedef struct SpatialGrid {
+	GridEntry* entries;
+	int entryCount, entryCapacity;
+	int* cellStart;  // MAP_HEIGHT * MAP_WIDTH + 1
+	int* cellItems;  // cellStart[MAP_HEIGHT * MAP_WIDTH] of them, however many cells each entry covers
+} SpatialGrid;
+
+void gridClear(SpatialGrid* grid, int capacity) {
+	*grid = (SpatialGrid){ .entries = scratchAlloc(sizeof(GridEntry) * capacity), .entryCapacity = capacity };
+}
 
-	case StageOne:
-		
-		model.npcs[0].active = true;
-		if (model.npcs[0].dialogState == 0) {
-			model.npcs[0].dialog = "Hey There! I need five gold, can you bring it? ( Press E to cont.)";
-			model.npcs[0].dialogState++;
-		}
-		if (model.npcs[0].interact && model.npcs[0].dialogState == 1) {
-			model.npcs[0].dialog = "go get it ( Press E to giv)";
-			model.npcs[0].dialogState++;
-		}
-		else if (model.goldCollected >= 1 && model.npcs[0].interact && model.npcs[0].dialogState == 2) {
-			model.npcs[0].dialog = "Holy shit the gold!, we should not have teken i ( Press E to cont.)t";
-			model.npcs[0].dialogState++;
-			model.goldCollected -= 5;
-		}
-		else if (model.npcs[0].interact && model.npcs[0].dialogState == 2) {
-			model.npcs[0].dialog = "you dont have the gold ( Press E to cont.)";
-			model.npcs[0].dialogState = 1;
-		}
-		else if ( model.npcs[0].interact && model.npcs[0].dialogState == 3) {
-			model.killCount = 0;
-			model.stage = StageTwoSetup;
-			
-		}
-		model.npcs[0].interact = false;
-		break;
+int gridAdd(SpatialGrid* grid, Rectangle rect, HitKind kind, int index, uint64_t mask) {
+	if (grid->entryCount >= grid->entryCapacity) return -1;
+	grid->entries[grid->entryCount] = (GridEntry){ rect, kind, index, mask };
+	return grid->entryCount++;
+}
 
-	case StageTwoSetup:
-		// Transition to stage two
-		//model.npcs[0].active = false; // Disable the NPC
-		model.npcs[0].active = true;
-		if (model.killCount > 5)
-		{
-			model.npcs[0].dialog = "Good job handleing those bad guys";
-			model = moveNPCToPlayer(model, deltaTime, 100.0f, 100);
+// Stop an entry from being hit for the rest of the tick (e.g. the enemy just died)
+void gridRemove(SpatialGrid* grid, int entry) {
+	if (entry >= 0) grid->entries[entry].kind = HitNone;
+}
 
+// Cell range covered by a rectangle grown by margin on every side, clamped to the map
+void gridCellRange(Rectangle rect, float margin, int tileSize, int* x0, int* y0, int* x1, int* y1) {
+	*x0 = (int)floorf((rect.x - margin) / tileSize);
+	*y0 = (int)floorf((rect.y - margin) / tileSize);
+	*x1 = (int)floorf((rect.x + rect.width + margin) / tileSize);
+	*y1 = (int)floorf((rect.y + rect.height + margin) / tileSize);
+	if (*x0 < 0) *x0 = 0;
+	if (*y0 < 0) *y0 = 0;
+	if (*x1 > MAP_WIDTH - 1) *x1 = MAP_WIDTH - 1;
+	if (*y1 > MAP_HEIGHT - 1) *y1 = MAP_HEIGHT - 1;
+}
+
+// Bucket the entries into cells. margin is how far a query point may be from an entry and still touch it.
+void gridBuild(SpatialGrid* grid, int tileSize, float margin) {
+	int cellCount = MAP_HEIGHT * MAP_WIDTH;
+	grid->cellStart = scratchAlloc(sizeof(int) * (cellCount + 1));
+	memset(grid->cellStart, 0, sizeof(int) * (cellCount + 1));
+
+	for (int i = 0; i < grid->entryCount; i++) {
+		int x0, y0, x1, y1;
+		gridCellRange(grid->entries[i].rect, margin, tileSize, &x0, &y0, &x1, &y1);
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				grid->cellStart[y * MAP_WIDTH + x + 1]++;
+			}
 		}
-		else
-		{
-			model.npcs[0].dialog = "We are under attack!";
-			model = moveNPCToPlayer(model, deltaTime, 100.0f, 100);
-			model = spawnEnemies(model, deltaTime, tileSize);
-		}
-		break;
+	}
 
-	case StageTwo:
-		// Enemy spawning logic
-		
-		break;
+	for (int c = 0; c < cellCount; c++) {
+		grid->cellStart[c + 1] += grid->cellStart[c];
+	}
 
-	case StageThree:
-		// Future stages can be added here
-		break;
+	grid->cellItems = scratchAlloc(sizeof(int) * grid->cellStart[cellCount]);
+	size_t mark = scratchMark();
+	int* cursor = scratchAlloc(sizeof(int) * cellCount);
+	memcpy(cursor, grid->cellStart, sizeof(int) * cellCount);
+	for (int i = 0; i < grid->entryCount; i++) {
+		int x0, y0, x1, y1;
+		gridCellRange(grid->entries[i].rect, margin, tileSize, &x0, &y0, &x1, &y1);
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				grid->cellItems[cursor[y * MAP_WIDTH + x]++] = i;
+			}
+		}
 	}
-	return model;
+	scratchRewind(mark);
 }
 
-void updateParticles(Particle particles[], float deltaTime) {
-	for (int i = 0; i < MAX_PARTICLES; i++) {
-		if (particles[i].active) {
-			particles[i].position.x += particles[i].velocity.x * deltaTime * 200.0f;
-			particles[i].position.y += particles[i].velocity.y * deltaTime * 200.0f;
-			particles[i].lifespan -= deltaTime;
-			if (particles[i].lifespan <= 0.0f) {
-				particles[i].active = false;
-			}
-			else {
-				float alpha = particles[i].lifespan / PARTICLE_LIFESPAN;
-				particles[i].color.a = (unsigned char)(alpha * 255);
-			}
+// First point in [tEnter, tExit] where the swept box covers a set cell of the entry's sprite,
+// stepping half a cell at a time
+bool sweepHitsMask(const GridEntry* entry, Vector2 from, Vector2 delta, float halfSize, float* tEnter, float tExit) {
+	float length = simLength(delta);
+	float step = length > 0 ? SPRITE_SCALE / 2.0f / length : 1.0f;
+	Vector2 origin = { entry->rect.x, entry->rect.y };
+	for (float t = *tEnter; ; t += step) {
+		if (t > tExit) t = tExit;
+		Rectangle box = { from.x + delta.x * t - halfSize, from.y + delta.y * t - halfSize, 2 * halfSize, 2 * halfSize };
+		if (entry->mask & rectMask(box, origin)) {
+			*tEnter = t;
+			return true;
 		}
+		if (t >= tExit) return false;
 	}
 }
 
+typedef struct SweepHit {
+	HitKind kind;
+	int index;  // Pool index for enemy / crate hits
+	float t;  // Fraction of the segment travelled before the hit
+} SweepHit;
+
+// Trace a moving box (given by its center and half size) and return the first thing it touches.
+// Walls stop the traversal; entities are looked up only in the tiles the path crosses.
+SweepHit sweepGrid(const SpatialGrid* grid, Vector2 from, Vector2 to, float halfSize, int tileSize) {
+	SweepHit best = { HitNone, -1, 1.0f };
+	Vector2 delta = { to.x - from.x, to.y - from.y };
+	int tests = 0;
+	TileWalker walker = beginTileWalk(from, to, tileSize);
+
+	do {
+		if (walker.t > best.t) break;  // Everything left on the path is further than the current hit
+
+		if (!isWalkable(walker.x, walker.y)) {
+			best = (SweepHit){ HitWall, -1, walker.t };
+			break;
+		}
+
+		int cell = walker.y * MAP_WIDTH + walker.x;
+		for (int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; k++) {
+			const GridEntry* entry = &grid->entries[grid->cellItems[k]];
+			if (entry->kind == HitNone) continue;
+			Rectangle grown = {
+				entry->rect.x - halfSize, entry->rect.y - halfSize,
+				entry->rect.width + 2 * halfSize, entry->rect.height + 2 * halfSize
+			};
+			float tEnter, tExit;
+			tests++;
+			if (segmentHitsRect(from, delta, grown, &tEnter, &tExit) && tEnter < best.t) {
+				if (entry->mask != 0 && !sweepHitsMask(entry, from, delta, halfSize, &tEnter, tExit)) continue;  // Through a gap in the sprite
+				if (tEnter < best.t) best = (SweepHit){ entry->kind, entry->index, tEnter };
+			}
+		}
+	} while (nextTile(&walker));
+	counterAdd(CounterRectsBullets, tests);
+
+	return best;
+}
+
+#pragma endregion
+
+#pragma region Spawning
+
+#define SPAWN_REGION_SIZE 4  // Tiles per side of a spawn region
+#define SPAWN_REGIONS_X ((MAP_WIDTH + SPAWN_REGION_SIZE - 1) / SPAWN_REGION_SIZE)
+#define SPAWN_REGIONS_Y ((MAP_HEIGHT + SPAWN_REGION_SIZE - 1) / SPAWN_REGION_SIZE)
+#define SPAWN_REGION_COUNT (SPAWN_REGIONS_X * SPAWN_REGIONS_Y)
+#define ENEMY_SPAWN_EXCLUSION 1  // Regions around the player's region that never get enemies
+#define CRATE_SPAWN_EXCLUSION 0
+#define MAX_SPAWN_ATTEMPTS 4  // Retries when a picked tile still overlaps the player
+
+// Every walkable tile, grouped by spawn region. Shared and read-only between map changes.
+typedef struct WalkableIndex {
+	unsigned char tiles[MAP_WIDTH * MAP_HEIGHT][2];  // (x, y) of each walkable tile, ordered by region
+	int regionStart[SPAWN_REGION_COUNT + 1];
+	int version;  // Bumped on every rebuild, 0 until the first one
+} WalkableIndex;
+
+// Alias table over the regions outside the current exclusion zone, so a spawn tile is picked
+// in constant time. It depends on the player's position, so each simulating thread keeps its own.
+typedef struct SpawnAlias {
+	int version;  // walkableIndex.version it was built from
+	int region;  // Player region it was built for
+	int radius;
+	int eligibleCount;
+	int eligible[SPAWN_REGION_COUNT];  // Regions outside the exclusion zone that have walkable tiles
+	float probability[SPAWN_REGION_COUNT];
+	int alias[SPAWN_REGION_COUNT];
+} SpawnAlias;
+
+WalkableIndex walkableIndex;
+_Thread_local SpawnAlias spawnAlias;
+
+#define GAME_RAND_MAX 0x7FFFFFFF
+#define GAME_DEFAULT_SEED 0x9E3779B9u
+
+// xorshift32. The state lives in GameModel instead of libc's rand() so that every peer
+// simulating the same inputs rolls the same numbers.
+int gameRand(unsigned int* state) {
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return (int)(x >> 1);
+}
+
+int spawnRegionOf(int x, int y) {
+	return (y / SPAWN_REGION_SIZE) * SPAWN_REGIONS_X + x / SPAWN_REGION_SIZE;
+}
+
+// Must be called whenever map tiles change
+void rebuildWalkableIndex(void) {
+	WalkableIndex* index = &walkableIndex;
+	memset(index->regionStart, 0, sizeof(index->regionStart));
+
+	for (int y = 0; y < MAP_HEIGHT; y++) {
+		for (int x = 0; x < MAP_WIDTH; x++) {
+			if (isWalkable(x, y)) index->regionStart[spawnRegionOf(x, y) + 1]++;
+		}
+	}
+	for (int r = 0; r < SPAWN_REGION_COUNT; r++) {
+		index->regionStart[r + 1] += index->regionStart[r];
+	}
+
+	int cursor[SPAWN_REGION_COUNT];
+	memcpy(cursor, index->regionStart, sizeof(cursor));
+	for (int y = 0; y < MAP_HEIGHT; y++) {
+		for (int x = 0; x < MAP_WIDTH; x++) {
+			if (isWalkable(x, y)) {
+				int slot = cursor[spawnRegionOf(x, y)]++;
+				index->tiles[slot][0] = (unsigned char)x;
+				index->tiles[slot][1] = (unsigned char)y;
+			}
+		}
+	}
+
+	index->version++;
+}
+
+// Vose's alias method over the eligible regions, weighted by their walkable tile count.
+// Only rebuilt when the player moves to another region or the exclusion radius changes.
+void buildSpawnAlias(SpawnAlias* table, const WalkableIndex* index, int playerRegion, int radius) {
+	int px = playerRegion % SPAWN_REGIONS_X;
+	int py = playerRegion / SPAWN_REGIONS_X;
+	int total = 0;
+
+	table->eligibleCount = 0;
+	for (int r = 0; r < SPAWN_REGION_COUNT; r++) {
+		int rx = r % SPAWN_REGIONS_X;
+		int ry = r / SPAWN_REGIONS_X;
+		int distance = abs(rx - px) > abs(ry - py) ? abs(rx - px) : abs(ry - py);
+		int count = index->regionStart[r + 1] - index->regionStart[r];
+		if (distance <= radius || count == 0) continue;
+		table->eligible[table->eligibleCount++] = r;
+		total += count;
+	}
+
+	int n = table->eligibleCount;
+	float scaled[SPAWN_REGION_COUNT];
+	int small[SPAWN_REGION_COUNT], large[SPAWN_REGION_COUNT];
+	int smallCount = 0, largeCount = 0;
+
+	for (int k = 0; k < n; k++) {
+		int r = table->eligible[k];
+		scaled[k] = (float)(index->regionStart[r + 1] - index->regionStart[r]) * n / total;
+		if (scaled[k] < 1.0f) small[smallCount++] = k;
+		else large[largeCount++] = k;
+	}
+	while (smallCount > 0 && largeCount > 0) {
+		int less = small[--smallCount];
+		int more = large[--largeCount];
+		table->probability[less] = scaled[less];
+		table->alias[less] = more;
+		scaled[more] -= 1.0f - scaled[less];
+		if (scaled[more] < 1.0f) small[smallCount++] = more;
+		else large[largeCount++] = more;
+	}
+	while (largeCount > 0) table->probability[large[--largeCount]] = 1.0f;
+	while (smallCount > 0) table->probability[small[--smallCount]] = 1.0f;
+
+	table->version = index->version;
+	table->region = playerRegion;
+	table->radius = radius;
+}
+
+// Pick a random walkable tile outside the regions within radius of the player's region.
+// Returns false when the exclusion zone covers every walkable tile.
+bool pickSpawnTile(unsigned int* rng, int playerTileX, int playerTileY, int radius, int* x, int* y) {
+	const WalkableIndex* index = &walkableIndex;
+	SpawnAlias* table = &spawnAlias;
+	if (playerTileX < 0) playerTileX = 0;
+	if (playerTileY < 0) playerTileY = 0;
+	if (playerTileX >= MAP_WIDTH) playerTileX = MAP_WIDTH - 1;
+	if (playerTileY >= MAP_HEIGHT) playerTileY = MAP_HEIGHT - 1;
+
+	int playerRegion = spawnRegionOf(playerTileX, playerTileY);
+	if (table->version != index->version || table->region != playerRegion || table->radius != radius) {
+		buildSpawnAlias(table, index, playerRegion, radius);
+	}
+	if (table->eligibleCount == 0) return false;
+
+	int column = gameRand(rng) % table->eligibleCount;
+	float coin = (float)gameRand(rng) / ((float)GAME_RAND_MAX + 1.0f);
+	int region = table->eligible[coin < table->probability[column] ? column : table->alias[column]];
+
+	int first = index->regionStart[region];
+	int slot = first + gameRand(rng) % (index->regionStart[region + 1] - first);
+	*x = index->tiles[slot][0];
+	*y = index->tiles[slot][1];
+	return true;
+}
+
+#pragma endregion
+
+#pragma region ECS
+
+#define ECS_MAX_ARCHETYPES 8
+#define ECS_MAX_CHUNKS 16
+#define ECS_CHUNK_CAPACITY 32  // Entities per chunk
+#define ECS_CHUNK_BYTES (ECS_CHUNK_CAPACITY * 48)  // Enough for the widest archetype's row
+#define ECS_MAX_COMMANDS 512
+
+typedef enum {
+	ComponentPosition,
+	ComponentVelocity,
+	ComponentLifetime,
+	ComponentTint,
+	ComponentFade,  // Tag: alpha follows the remaining lifetime
+	ComponentDamageText,
+	ComponentDrag,
+	ComponentPickup,
+	ComponentSleeping,  // Tag: settled, skipped by every system until something wakes it
+	ComponentCount
+} ComponentId;
+
+typedef unsigned int ComponentMask;
+#define COMPONENT(id) (1u << (id))
+
+typedef struct Lifetime {
+	float remaining;
+	float total;
+} Lifetime;
+
+typedef struct Pickup {
+	float size;
+} Pickup;
+
+// Every component value an entity can carry, used to describe entities in commands
+typedef struct EcsValues {
+	Vector2 position;
+	Vector2 velocity;
+	Lifetime lifetime;
+	Color tint;
+	int damageAmount;
+	float drag;  // Velocity multiplier applied every tick
+	Pickup pickup;
+} EcsValues;
+
+const int componentSize[ComponentCount] = {
+	sizeof(Vector2), sizeof(Vector2), sizeof(Lifetime), sizeof(Color), 0, sizeof(int), sizeof(float), sizeof(Pickup), 0
+};
+
+const int componentValueOffset[ComponentCount] = {
+	offsetof(EcsValues, position), offsetof(EcsValues, velocity), offsetof(EcsValues, lifetime), offsetof(EcsValues, tint),
+	0, offsetof(EcsValues, damageAmount), offsetof(EcsValues, drag), offsetof(EcsValues, pickup), 0
+};
+
+// A fixed block holding up to ECS_CHUNK_CAPACITY entities of one archetype, one column per component
+typedef struct EcsChunk {
+	short archetype;
+	short count;
+	unsigned char data[ECS_CHUNK_BYTES];
+} EcsChunk;
+
+typedef struct EcsArchetype {
+	ComponentMask mask;
+	int capacity;  // Max live entities, creates beyond it are dropped like a full pool
+	int count;
+	int columnOffset[ComponentCount];  // Byte offset of each column inside a chunk
+	int chunkCount;
+	short chunks[ECS_MAX_CHUNKS];
+} EcsArchetype;
+
+typedef struct EcsWorld {
+	EcsArchetype archetypes[ECS_MAX_ARCHETYPES];
+	int archetypeCount;
+	int chunkCount;  // Ahead of chunks, snapshots keep only the fields before the chunks plus those in use
+	EcsChunk chunks[ECS_MAX_CHUNKS];
+} EcsWorld;
+
+typedef enum {
+	CommandCreate,
+	CommandDestroy,
+	CommandMove  // Change the entity's component set, keeping the values it shares with the new one
+} EcsCommandType;
+
+typedef struct EcsCommand {
+	EcsCommandType type;
+	ComponentMask mask;
+	short chunk, row;
+	EcsValues values;
+} EcsCommand;
+
+// Structural changes recorded while systems iterate, applied by ecsFlush once nothing is iterating
+typedef struct EcsCommandBuffer {
+	EcsCommand commands[ECS_MAX_COMMANDS];
+	int count;
+} EcsCommandBuffer;
+
+void ecsInit(EcsWorld* world) {
+	memset(world, 0, sizeof(*world));
+}
+
+int ecsFindArchetype(const EcsWorld* world, ComponentMask mask) {
+	for (int a = 0; a < world->archetypeCount; a++) {
+		if (world->archetypes[a].mask == mask) return a;
+	}
+	return -1;
+}
+
+int ecsRegisterArchetype(EcsWorld* world, ComponentMask mask, int capacity) {
+	int existing = ecsFindArchetype(world, mask);
+	if (existing >= 0) return existing;
+	if (world->archetypeCount >= ECS_MAX_ARCHETYPES) return -1;
+
+	EcsArchetype* archetype = &world->archetypes[world->archetypeCount];
+	memset(archetype, 0, sizeof(*archetype));
+	archetype->mask = mask;
+	archetype->capacity = capacity;
+
+	int offset = 0;
+	for (int c = 0; c < ComponentCount; c++) {
+		archetype->columnOffset[c] = -1;
+		if (mask & COMPONENT(c)) {
+			archetype->columnOffset[c] = offset;
+			offset += componentSize[c] * ECS_CHUNK_CAPACITY;
+		}
+	}
+	if (offset > ECS_CHUNK_BYTES) return -1;
+	return world->archetypeCount++;
+}
+
+void* ecsColumn(EcsWorld* world, EcsChunk* chunk, ComponentId component) {
+	int offset = world->archetypes[chunk->archetype].columnOffset[component];
+	return offset >= 0 ? chunk->data + offset : NULL;
+}
+
+int ecsCount(const EcsWorld* world, ComponentMask required) {
+	int count = 0;
+	for (int a = 0; a < world->archetypeCount; a++) {
+		if ((world->archetypes[a].mask & required) == required) count += world->archetypes[a].count;
+	}
+	return count;
+}
+
+// Iterates the non-empty chunks of every archetype that has all of `all` and none of `none`
+typedef struct EcsQuery {
+	ComponentMask all, none;
+	int archetype;
+	int chunk;  // Position in the archetype's chunk list
+	int chunkIndex;  // Index in world->chunks of the chunk last returned
+} EcsQuery;
+
+EcsQuery ecsQuery(ComponentMask all, ComponentMask none) {
+	return (EcsQuery) { all, none, 0, 0, -1 };
+}
+
+EcsChunk* ecsNext(EcsWorld* world, EcsQuery* query) {
+	for (; query->archetype < world->archetypeCount; query->archetype++, query->chunk = 0) {
+		EcsArchetype* archetype = &world->archetypes[query->archetype];
+		if ((archetype->mask & query->all) != query->all || (archetype->mask & query->none)) continue;
+		while (query->chunk < archetype->chunkCount) {
+			query->chunkIndex = archetype->chunks[query->chunk++];
+			if (world->chunks[query->chunkIndex].count > 0) return &world->chunks[query->chunkIndex];
+		}
+	}
+	return NULL;
+}
+
+// Append a row to the archetype, returns its chunk index or -1 when the archetype is full
+int ecsAppend(EcsWorld* world, int archetypeId, int* row) {
+	EcsArchetype* archetype = &world->archetypes[archetypeId];
+	if (archetype->count >= archetype->capacity) return -1;
+
+	for (int k = 0; k < archetype->chunkCount; k++) {
+		EcsChunk* chunk = &world->chunks[archetype->chunks[k]];
+		if (chunk->count < ECS_CHUNK_CAPACITY) {
+			*row = chunk->count++;
+			archetype->count++;
+			return archetype->chunks[k];
+		}
+	}
+
+	if (world->chunkCount >= ECS_MAX_CHUNKS || archetype->chunkCount >= ECS_MAX_CHUNKS) return -1;
+	int chunkIndex = world->chunkCount++;
+	world->chunks[chunkIndex].archetype = (short)archetypeId;
+	world->chunks[chunkIndex].count = 1;
+	archetype->chunks[archetype->chunkCount++] = (short)chunkIndex;
+	archetype->count++;
+	*row = 0;
+	return chunkIndex;
+}
+
+void ecsWriteRow(EcsWorld* world, int chunkIndex, int row, const EcsValues* values) {
+	EcsChunk* chunk = &world->chunks[chunkIndex];
+	EcsArchetype* archetype = &world->archetypes[chunk->archetype];
+	for (int c = 0; c < ComponentCount; c++) {
+		if (archetype->columnOffset[c] >= 0 && componentSize[c] > 0) {
+			memcpy(chunk->data + archetype->columnOffset[c] + row * componentSize[c],
+				(const unsigned char*)values + componentValueOffset[c], componentSize[c]);
+		}
+	}
+}
+
+void ecsReadRow(EcsWorld* world, int chunkIndex, int row, EcsValues* values) {
+	EcsChunk* chunk = &world->chunks[chunkIndex];
+	EcsArchetype* archetype = &world->archetypes[chunk->archetype];
+	for (int c = 0; c < ComponentCount; c++) {
+		if (archetype->columnOffset[c] >= 0 && componentSize[c] > 0) {
+			memcpy((unsigned char*)values + componentValueOffset[c],
+				chunk->data + archetype->columnOffset[c] + row * componentSize[c], componentSize[c]);
+		}
+	}
+}
+
+// Swap-remove: the chunk's last row moves into the hole
+void ecsRemoveRow(EcsWorld* world, int chunkIndex, int row) {
+	EcsChunk* chunk = &world->chunks[chunkIndex];
+	EcsArchetype* archetype = &world->archetypes[chunk->archetype];
+	int last = chunk->count - 1;
+	if (row != last) {
+		for (int c = 0; c < ComponentCount; c++) {
+			int size = componentSize[c];
+			if (archetype->columnOffset[c] >= 0 && size > 0) {
+				unsigned char* column = chunk->data + archetype->columnOffset[c];
+				memcpy(column + row * size, column + last * size, size);
+			}
+		}
+	}
+	chunk->count--;
+	archetype->count--;
+}
+
+// The defer calls return false when the buffer is full and the command was dropped, so
+// callers that keep their own books about an entity only update them for queued commands
+bool ecsDeferCreate(EcsCommandBuffer* buffer, ComponentMask mask, const EcsValues* values) {
+	if (buffer->count >= ECS_MAX_COMMANDS) return false;
+	EcsCommand* command = &buffer->commands[buffer->count++];
+	command->type = CommandCreate;
+	command->mask = mask;
+	command->values = *values;
+	return true;
+}
+
+bool ecsDeferDestroy(EcsCommandBuffer* buffer, int chunkIndex, int row) {
+	if (buffer->count >= ECS_MAX_COMMANDS) return false;
+	EcsCommand* command = &buffer->commands[buffer->count++];
+	command->type = CommandDestroy;
+	command->chunk = (short)chunkIndex;
+	command->row = (short)row;
+	return true;
+}
+
+bool ecsDeferMove(EcsCommandBuffer* buffer, int chunkIndex, int row, ComponentMask mask) {
+	if (buffer->count >= ECS_MAX_COMMANDS) return false;
+	EcsCommand* command = &buffer->commands[buffer->count++];
+	command->type = CommandMove;
+	command->mask = mask;
+	command->chunk = (short)chunkIndex;
+	command->row = (short)row;
+	return true;
+}
+
+// Removal order for swap-remove: per chunk, highest row first
+int compareRemovals(const void* a, const void* b) {
+	const EcsCommand* commandA = *(const EcsCommand* const*)a;
+	const EcsCommand* commandB = *(const EcsCommand* const*)b;
+	if (commandA->chunk != commandB->chunk) return commandA->chunk - commandB->chunk;
+	return commandB->row - commandA->row;
+}
+
+void ecsFlush(EcsWorld* world, EcsCommandBuffer* buffer) {
+	EcsCommand* removals[ECS_MAX_COMMANDS];
+	int removalCount = 0;
+
+	// Moves copy into their new archetype first; appends never disturb existing rows
+	for (int i = 0; i < buffer->count; i++) {
+		EcsCommand* command = &buffer->commands[i];
+		if (command->type == CommandMove) {
+			int archetypeId = ecsFindArchetype(world, command->mask);
+			if (archetypeId < 0) archetypeId = ecsRegisterArchetype(world, command->mask, world->archetypes[world->chunks[command->chunk].archetype].capacity);
+			int row;
+			int chunkIndex = archetypeId >= 0 ? ecsAppend(world, archetypeId, &row) : -1;
+			if (chunkIndex < 0) continue;  // Nowhere to go, the entity stays as it is
+			EcsValues values = { 0 };
+			ecsReadRow(world, command->chunk, command->row, &values);
+			ecsWriteRow(world, chunkIndex, row, &values);
+		}
+		if (command->type == CommandMove || command->type == CommandDestroy) {
+			removals[removalCount++] = command;
+		}
+	}
+
+	qsort(removals, removalCount, sizeof(removals[0]), compareRemovals);
+	for (int i = 0; i < removalCount; i++) {
+		if (i > 0 && removals[i]->chunk == removals[i - 1]->chunk && removals[i]->row == removals[i - 1]->row) continue;
+		ecsRemoveRow(world, removals[i]->chunk, removals[i]->row);
+	}
+
+	for (int i = 0; i < buffer->count; i++) {
+		EcsCommand* command = &buffer->commands[i];
+		if (command->type != CommandCreate) continue;
+		int archetypeId = ecsFindArchetype(world, command->mask);
+		int row;
+		int chunkIndex = archetypeId >= 0 ? ecsAppend(world, archetypeId, &row) : -1;
+		if (chunkIndex >= 0) ecsWriteRow(world, chunkIndex, row, &command->values);
+	}
+
+	buffer->count = 0;
+}
+
+#pragma endregion
+
+#pragma region Events
+
+#define MAX_EVENTS_PER_TICK 65536  // What the 16 bit sequence can order
+#define EVENT_QUEUE_INITIAL 64
+
+// Systems that raise events, in the order their events are applied
+typedef enum {
+	SystemEnemies,
+	SystemBullets,
+	SystemSword,
+	SystemCrates,
+	SystemGold,
+	SystemNpcs
+} EventSource;
+
+typedef enum {
+	EventDamageEnemy,  // target = enemy index
+	EventDamagePlayer,  // target = player index
+	EventDamageCrate,  // target = crate index
+	EventCollectGold,
+	EventSpawnParticles,
+	EventInteract  // target = NPC index
+} GameEventType;
+
+typedef struct GameEvent {
+	unsigned int key;  // Source system and entity, events are applied in key order
+	unsigned short sequence;  // Raise order within the tick, breaks ties between events of one entity
+	unsigned char type;
+	short target;
+	short amount;  // Damage dealt, or particles spawned for EventSpawnParticles
+	short particleCount;  // Effect particles spawned with a hit
+	Vector2 position;
+	Color color;
+} GameEvent;
+
+// Events raised during the tick being simulated. A game is only ever simulated by one thread at
+// a time and each batch worker has its own queue, so raising never locks. The queue grows in the
+// raising thread's scratch arena and applyEvents sorts and empties it at the end of update().
+typedef struct EventQueue {
+	GameEvent* events;
+	int count, capacity;
+} EventQueue;
+
+EventQueue tickEvents;
+_Thread_local EventQueue* activeEvents = &tickEvents;  // Queue of the game this thread is simulating
+
+unsigned int eventKey(EventSource source, int entity) {
+	return ((unsigned int)source << 16) | (unsigned int)(entity & 0xFFFF);
+}
+
+void raiseEvent(GameEvent event) {
+	EventQueue* queue = activeEvents;
+	if (queue->count >= MAX_EVENTS_PER_TICK) {
+		counterAdd(CounterEventDrops, 1);
+		return;
+	}
+	if (queue->count == queue->capacity) {
+		int capacity = queue->capacity > 0 ? queue->capacity * 2 : EVENT_QUEUE_INITIAL;
+		GameEvent* events = scratchAlloc(sizeof(GameEvent) * capacity);
+		if (queue->count > 0) memcpy(events, queue->events, sizeof(GameEvent) * queue->count);
+		queue->events = events;
+		queue->capacity = capacity;
+	}
+	event.sequence = (unsigned short)queue->count;
+	queue->events[queue->count++] = event;
+}
+
+int compareEvents(const void* a, const void* b) {
+	const GameEvent* eventA = (const GameEvent*)a;
+	const GameEvent* eventB = (const GameEvent*)b;
+	if (eventA->key != eventB->key) return eventA->key < eventB->key ? -1 : 1;
+	return (int)eventA->sequence - (int)eventB->sequence;
+}
+
+#pragma endregion
+
+// Particles, damage numbers and gold live in the ECS world, one archetype each. Enemies, bullets,
+// crates and NPCs stay in fixed pools: events, influence stamps, sleep lists, saves and the
+// lockstep checksum all name them by slot, and their updates are per-kind logic, not shared math.
+#define ARCHETYPE_PARTICLE (COMPONENT(ComponentPosition) | COMPONENT(ComponentVelocity) | COMPONENT(ComponentLifetime) | COMPONENT(ComponentTint) | COMPONENT(ComponentFade))
+#define ARCHETYPE_DAMAGE_TEXT (COMPONENT(ComponentPosition) | COMPONENT(ComponentVelocity) | COMPONENT(ComponentLifetime) | COMPONENT(ComponentTint) | COMPONENT(ComponentDamageText))
+#define ARCHETYPE_GOLD (COMPONENT(ComponentPosition) | COMPONENT(ComponentVelocity) | COMPONENT(ComponentDrag) | COMPONENT(ComponentPickup))
+#define ARCHETYPE_SLEEPING_GOLD (COMPONENT(ComponentPosition) | COMPONENT(ComponentPickup) | COMPONENT(ComponentSleeping))
+
+// Parts of GameModel tracked separately by snapshots. Systems set the bit of every pool they
+// write in GameModel.dirty; core (everything before the pools) is small and always compared.
+typedef enum {
+	SectionCore,
+	SectionEnemies,
+	SectionBullets,
+	SectionCrates,
+	SectionNpcs,
+	SectionSleep,
+	SectionFov,
+	SectionInfluence,
+	SectionEcs,
+	SectionCount
+} ModelSection;
+
+#define SECTION(section) (1u << (section))
+#define MARK_DIRTY(model, section) ((model).dirty |= SECTION(section))
+
+// Crates and gold that have settled leave the per-tick passes. Sleepers are filed by map cell
+// so that a bullet, sword or player only has to look at the cells it touches to wake them.
+typedef struct SleepState {
+	short awakeCrates[MAX_CRATES];
+	short awakeCrateCount;
+	short cellCrates[MAP_HEIGHT * MAP_WIDTH];  // First sleeping crate in each cell, -1 when none
+	short nextCrate[MAX_CRATES];  // Next sleeping crate in the same cell
+	unsigned char cellGold[MAP_HEIGHT * MAP_WIDTH];  // Sleeping gold in each cell
+	unsigned int npcAwake;  // Bit per active NPC
+} SleepState;
+
+#define FOV_RADIUS 12  // Tiles
+#define FOV_ROW_WORDS ((MAP_WIDTH + 31) / 32)
+
+// What one player can see, cast from the tile they stand on. Derived from positions and the
+// map, so it is only recast when either changes.
+typedef struct FieldOfView {
+	short tileX, tileY;  // Tile it was cast from, -1 before the first cast
+	int mapVersion;  // walkableIndex.version it was cast against
+	unsigned int rows[MAP_HEIGHT][FOV_ROW_WORDS];  // Bit per visible tile
+} FieldOfView;
+
+#define INFLUENCE_CELL 2  // Tiles per influence cell along each axis
+#define INFLUENCE_WIDTH (MAP_WIDTH / INFLUENCE_CELL)
+#define INFLUENCE_HEIGHT (MAP_HEIGHT / INFLUENCE_CELL)
+#define INFLUENCE_ECHOES 32
+
+typedef enum {
+	InfluenceThreat,  // Players, stronger while the sword is out
+	InfluenceCrowd,  // Enemies
+	InfluenceLoot,  // Crates still holding gold
+	InfluenceThreatBlurred,  // Threat through a [1 2 1] blur, rebuilt when threat changes
+	InfluenceLayerCount
+} InfluenceLayer;
+
+// Where a source last stamped its layer, cell -1 when it has not
+typedef struct InfluenceStamp {
+	short cell;
+	short strength;
+} InfluenceStamp;
+
+// A stamp left behind by a source that moved or died, fading out a step per tick
+typedef struct InfluenceEcho {
+	short cell;
+	short strength;
+	unsigned char layer;
+} InfluenceEcho;
+
+// Coarse per-cell sums the AI reads in O(1). Every source keeps the stamp it added, so a
+// tick only touches the cells around sources that changed cell or strength and the echoes.
+typedef struct InfluenceMap {
+	short layers[InfluenceLayerCount][INFLUENCE_HEIGHT][INFLUENCE_WIDTH];
+	InfluenceStamp players[MAX_PLAYERS];
+	InfluenceStamp enemies[MAX_ENEMIES];
+	InfluenceStamp crates[MAX_CRATES];
+	InfluenceEcho echoes[INFLUENCE_ECHOES];
+	short echoCount;
+	bool blurStale;
+} InfluenceMap;
+
+// What a quest node can wait for. Triggers are checked only when their event is applied.
+typedef enum {
+	TriggerInteract,  // A player pressed interact on the node's NPC
+	TriggerGold,  // Gold was picked up
+	TriggerKill,  // An enemy died
+	TriggerCount
+} QuestTrigger;
+
+// Where each NPC is in the quest graph, with bits per NPC so events and ticks only visit
+// the NPCs whose current node cares
+typedef struct QuestState {
+	short node[MAX_NPCS];  // Current node, -1 when the NPC has no part in the quest
+	unsigned int listening[TriggerCount];  // NPCs whose node has an edge on each trigger
+	unsigned int following;  // NPCs walking after the first player
+	unsigned int spawning;  // NPCs whose node keeps enemies coming
+} QuestState;
+
+typedef struct GameModel {
+	Player players[MAX_PLAYERS];
+	int playerCount;
+	unsigned int rngState;
+	KindInfo kinds[KindCount];
+	float enemySpawnTimer;
+	int goldCollected;
+	GameStage stage;
+	int killCount;
+	unsigned int dirty;  // Sections written since the last snapshot
+	GameLimits limits;
+	QuestState quest;
+	Enemy enemies[MAX_ENEMIES];
+	EnemySteering steering[MAX_ENEMIES];  // Same slots as enemies
+	Bullet bullets[BULLET_POOL];
+	Crate crates[MAX_CRATES];
+	NPC npcs[MAX_NPCS];
+	SleepState sleep;
+	FieldOfView fov[MAX_PLAYERS];
+	InfluenceMap influence;
+	EcsWorld ecs;
+} GameModel;
+
+
+
+#pragma region Sleeping
+
+#define CRATE_SLEEP_TICKS 30  // Undisturbed ticks before an awake crate goes back to sleep
+
+int lowestBit(unsigned int mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+int lowestBit64(uint64_t mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+int highestBit64(uint64_t mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, mask);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(mask);
+#endif
+}
+
+int cellIndexOf(Vector2 position, int tileSize) {
+	int x = (int)floorf(position.x / tileSize);
+	int y = (int)floorf(position.y / tileSize);
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x > MAP_WIDTH - 1) x = MAP_WIDTH - 1;
+	if (y > MAP_HEIGHT - 1) y = MAP_HEIGHT - 1;
+	return y * MAP_WIDTH + x;
+}
+
+void sleepInit(SleepState* sleep) {
+	sleep->awakeCrateCount = 0;
+	for (int c = 0; c < MAP_WIDTH * MAP_HEIGHT; c++) {
+		sleep->cellCrates[c] = -1;
+		sleep->cellGold[c] = 0;
+	}
+	sleep->npcAwake = 0;
+}
+
+void setNpcActive(GameModel* model, int i, bool active) {
+	model->npcs[i].active = active;
+	if (active) model->sleep.npcAwake |= 1u << i;
+	else model->sleep.npcAwake &= ~(1u << i);
+}
+
+// Caller takes the crate off the awake list
+void sleepCrate(GameModel* model, int i, int tileSize) {
+	SleepState* sleep = &model->sleep;
+	int cell = cellIndexOf(model->crates[i].position, tileSize);
+	sleep->nextCrate[i] = sleep->cellCrates[cell];
+	sleep->cellCrates[cell] = (short)i;
+	model->crates[i].sleeping = true;
+	MARK_DIRTY(*model, SectionSleep);
+	MARK_DIRTY(*model, SectionCrates);
+}
+
+// Everything sleeping in the cells rect touches, widened by margin, rejoins the awake list
+void wakeArea(GameModel* model, Rectangle rect, float margin, int tileSize) {
+	SleepState* sleep = &model->sleep;
+	int x0, y0, x1, y1;
+	gridCellRange(rect, margin, tileSize, &x0, &y0, &x1, &y1);
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			int cell = y * MAP_WIDTH + x;
+			if (sleep->cellCrates[cell] < 0) continue;
+			for (int i = sleep->cellCrates[cell]; i >= 0; i = sleep->nextCrate[i]) {
+				model->crates[i].sleeping = false;
+				model->crates[i].idleTicks = 0;
+				sleep->awakeCrates[sleep->awakeCrateCount++] = (short)i;
+			}
+			sleep->cellCrates[cell] = -1;
+			MARK_DIRTY(*model, SectionSleep);
+			MARK_DIRTY(*model, SectionCrates);
+		}
+	}
+}
+
+// Drops broken crates from the awake list and puts undisturbed ones back to sleep
+void settleCrates(GameModel* model, int tileSize) {
+	SleepState* sleep = &model->sleep;
+	for (int k = sleep->awakeCrateCount - 1; k >= 0; k--) {
+		int i = sleep->awakeCrates[k];
+		Crate* crate = &model->crates[i];
+		MARK_DIRTY(*model, SectionCrates);  // idleTicks counts up every tick the crate is awake
+		if (crate->active && ++crate->idleTicks < CRATE_SLEEP_TICKS) continue;
+		sleep->awakeCrates[k] = sleep->awakeCrates[--sleep->awakeCrateCount];
+		if (crate->active) sleepCrate(model, i, tileSize);
+		MARK_DIRTY(*model, SectionSleep);
+	}
+}
+
+// Whether a cell lies within pickup reach of some player, the test that both wakes and
+// keeps awake gold, so loot next to a player never flips between the two states
+bool cellNearPlayers(const GameModel* model, int cell, int tileSize) {
+	int cx = cell % MAP_WIDTH;
+	int cy = cell / MAP_WIDTH;
+	for (int p = 0; p < model->playerCount; p++) {
+		const Player* player = &model->players[p];
+		int x0, y0, x1, y1;
+		gridCellRange((Rectangle) { player->position.x, player->position.y, player->size, player->size }, tileSize / 2.0f, tileSize, &x0, &y0, &x1, &y1);
+		if (cx >= x0 && cx <= x1 && cy >= y0 && cy <= y1) return true;
+	}
+	return false;
+}
+
+#pragma endregion
+
+#pragma region FieldOfView
+
+// Recursive shadowcasting over one octant, rows `row` to FOV_RADIUS out from the origin,
+// between slopes start and end. (xx, xy, yx, yy) maps the octant onto the grid.
+void fovCastOctant(FieldOfView* fov, int originX, int originY, int row, float start, float end, int xx, int xy, int yx, int yy) {
+	if (start < end) return;
+	float nextStart = start;
+	for (int distance = row; distance <= FOV_RADIUS; distance++) {
+		bool blocked = false;
+		int dy = -distance;
+		for (int dx = -distance; dx <= 0; dx++) {
+			float leftSlope = (dx - 0.5f) / (dy + 0.5f);
+			float rightSlope = (dx + 0.5f) / (dy - 0.5f);
+			if (start < rightSlope) continue;
+			if (end > leftSlope) break;
+
+			int x = originX + dx * xx + dy * xy;
+			int y = originY + dx * yx + dy * yy;
+			bool inside = x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT;
+			if (inside && dx * dx + dy * dy <= FOV_RADIUS * FOV_RADIUS) {
+				fov->rows[y][x >> 5] |= 1u << (x & 31);
+			}
+			bool opaque = !inside || map[y][x] == '#';
+			if (blocked) {
+				if (opaque) {
+					nextStart = rightSlope;
+					continue;
+				}
+				blocked = false;
+				start = nextStart;
+			}
+			else if (opaque && distance < FOV_RADIUS) {
+				blocked = true;
+				fovCastOctant(fov, originX, originY, distance + 1, start, leftSlope, xx, xy, yx, yy);
+				nextStart = rightSlope;
+			}
+		}
+		if (blocked) break;
+	}
+}
+
+void fovCast(FieldOfView* fov, int originX, int originY) {
+	static const int octants[8][4] = {
+		{ 1, 0, 0, 1 }, { 0, 1, 1, 0 }, { 0, -1, 1, 0 }, { -1, 0, 0, 1 },
+		{ -1, 0, 0, -1 }, { 0, -1, -1, 0 }, { 0, 1, -1, 0 }, { 1, 0, 0, -1 }
+	};
+	memset(fov->rows, 0, sizeof(fov->rows));
+	fov->tileX = (short)originX;
+	fov->tileY = (short)originY;
+	fov->mapVersion = walkableIndex.version;
+	if (originX < 0 || originX >= MAP_WIDTH || originY < 0 || originY >= MAP_HEIGHT) return;
+	fov->rows[originY][originX >> 5] |= 1u << (originX & 31);
+	for (int o = 0; o < 8; o++) {
+		fovCastOctant(fov, originX, originY, 1, 1.0f, 0.0f, octants[o][0], octants[o][1], octants[o][2], octants[o][3]);
+	}
+}
+
+bool fovVisible(const FieldOfView* fov, int x, int y) {
+	if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT) return false;
+	return (fov->rows[y][x >> 5] >> (x & 31)) & 1;
+}
+
+// Whether any tile under rect can be seen
+bool fovSeesRect(const FieldOfView* fov, Rectangle rect, int tileSize) {
+	int x0, y0, x1, y1;
+	gridCellRange(rect, 0.0f, tileSize, &x0, &y0, &x1, &y1);
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			if (fovVisible(fov, x, y)) return true;
+		}
+	}
+	return false;
+}
+
+// Recasts a player's view only after they step onto another tile or the map changes,
+// so a tick spent within one tile costs two comparisons per player
+void updateFieldOfView(GameModel* model, int tileSize) {
+	for (int p = 0; p < model->playerCount; p++) {
+		const Player* player = &model->players[p];
+		FieldOfView* fov = &model->fov[p];
+		int x = (int)floorf((player->position.x + player->size / 2.0f) / tileSize);
+		int y = (int)floorf((player->position.y + player->size / 2.0f) / tileSize);
+		if (x == fov->tileX && y == fov->tileY && fov->mapVersion == walkableIndex.version) continue;
+		fovCast(fov, x, y);
+		MARK_DIRTY(*model, SectionFov);
+	}
+}
+
+#pragma endregion
+
+#pragma region Influence
+
+#define INFLUENCE_DECAY 16  // Strength an echo loses per tick
+#define INFLUENCE_PLAYER 256
+#define INFLUENCE_SWORD 512  // A player swinging is worth keeping further away from
+#define INFLUENCE_ENEMY 64
+#define INFLUENCE_LOOT 128
+
+void influenceReset(InfluenceMap* influence) {
+	memset(influence, 0, sizeof(*influence));
+	for (int p = 0; p < MAX_PLAYERS; p++) influence->players[p].cell = -1;
+	for (int i = 0; i < MAX_ENEMIES; i++) influence->enemies[i].cell = -1;
+	for (int i = 0; i < MAX_CRATES; i++) influence->crates[i].cell = -1;
+}
+
+// Cell under the centre of a size by size box
+int influenceCellOf(Vector2 position, float size, int tileSize) {
+	int x = (int)floorf((position.x + size / 2) / (tileSize * INFLUENCE_CELL));
+	int y = (int)floorf((position.y + size / 2) / (tileSize * INFLUENCE_CELL));
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x > INFLUENCE_WIDTH - 1) x = INFLUENCE_WIDTH - 1;
+	if (y > INFLUENCE_HEIGHT - 1) y = INFLUENCE_HEIGHT - 1;
+	return y * INFLUENCE_WIDTH + x;
+}
+
+// Adds (sign 1) or takes back (sign -1) a 3x3 stamp: the full strength in the middle, half on
+// the edges and a quarter on the corners. The weights are integers, so taking one back is exact.
+void influenceSplat(InfluenceMap* influence, int layer, int cell, int strength, int sign) {
+	int cellX = cell % INFLUENCE_WIDTH, cellY = cell / INFLUENCE_WIDTH;
+	for (int dy = -1; dy <= 1; dy++) {
+		int y = cellY + dy;
+		if (y < 0 || y >= INFLUENCE_HEIGHT) continue;
+		for (int dx = -1; dx <= 1; dx++) {
+			int x = cellX + dx;
+			if (x < 0 || x >= INFLUENCE_WIDTH) continue;
+			int weight = strength >> ((dx != 0) + (dy != 0));
+			influence->layers[layer][y][x] = (short)(influence->layers[layer][y][x] + sign * weight);
+		}
+	}
+	if (layer == InfluenceThreat) influence->blurStale = true;
+	counterAdd(CounterInfluenceSplats, 1);
+}
+
+// Restamps a source whose cell or strength changed, strength 0 once it is gone. The old stamp
+// stays behind as an echo, or is taken back at once when the echo list is full.
+bool influenceMove(InfluenceMap* influence, int layer, InfluenceStamp* stamp, int cell, int strength) {
+	if (strength <= 0) cell = -1;
+	if (stamp->cell == cell && (cell < 0 || stamp->strength == strength)) return false;
+	if (stamp->cell >= 0) {
+		if (influence->echoCount < INFLUENCE_ECHOES) {
+			influence->echoes[influence->echoCount++] = (InfluenceEcho){ .cell = stamp->cell, .strength = stamp->strength, .layer = (unsigned char)layer };
+		}
+		else {
+			influenceSplat(influence, layer, stamp->cell, stamp->strength, -1);
+		}
+	}
+	if (cell >= 0) influenceSplat(influence, layer, cell, strength, 1);
+	*stamp = (InfluenceStamp){ .cell = (short)cell, .strength = (short)(cell >= 0 ? strength : 0) };
+	return true;
+}
+
+// Each echo gives back INFLUENCE_DECAY of its stamp, the rest of the map is left alone
+bool influenceFade(InfluenceMap* influence) {
+	if (influence->echoCount == 0) return false;
+	int kept = 0;
+	for (int e = 0; e < influence->echoCount; e++) {
+		InfluenceEcho echo = influence->echoes[e];
+		influenceSplat(influence, echo.layer, echo.cell, echo.strength, -1);
+		echo.strength -= INFLUENCE_DECAY;
+		if (echo.strength <= 0) continue;
+		influenceSplat(influence, echo.layer, echo.cell, echo.strength, 1);
+		influence->echoes[kept++] = echo;
+	}
+	influence->echoCount = (short)kept;
+	return true;
+}
+
+// (a + 2b + c) / 4 as two rounding averages, which is what _mm_avg_epu16 computes without
+// overflowing 16 bits. Layers never go negative, so the unsigned lanes are safe.
+int influenceAverage(int a, int b, int c) {
+	return (((a + c + 1) >> 1) + b + 1) >> 1;
+}
+
+// [1 2 1] blur along each axis, repeating the edge cells. A row is INFLUENCE_WIDTH shorts,
+// two SSE2 registers, so each pass is a handful of instructions per row.
+void influenceBlur(short source[INFLUENCE_HEIGHT][INFLUENCE_WIDTH], short out[INFLUENCE_HEIGHT][INFLUENCE_WIDTH]) {
+	short across[INFLUENCE_HEIGHT][INFLUENCE_WIDTH];
+	for (int y = 0; y < INFLUENCE_HEIGHT; y++) {
+		short padded[INFLUENCE_WIDTH + 2];
+		memcpy(padded + 1, source[y], sizeof(source[y]));
+		padded[0] = source[y][0];
+		padded[INFLUENCE_WIDTH + 1] = source[y][INFLUENCE_WIDTH - 1];
+#if defined(HAVE_SSE2)
+		for (int x = 0; x < INFLUENCE_WIDTH; x += 8) {
+			__m128i left = _mm_loadu_si128((const __m128i*)(padded + x));
+			__m128i middle = _mm_loadu_si128((const __m128i*)(padded + x + 1));
+			__m128i right = _mm_loadu_si128((const __m128i*)(padded + x + 2));
+			_mm_storeu_si128((__m128i*)&across[y][x], _mm_avg_epu16(_mm_avg_epu16(left, right), middle));
+		}
+#else
+		for (int x = 0; x < INFLUENCE_WIDTH; x++) {
+			across[y][x] = (short)influenceAverage(padded[x], padded[x + 1], padded[x + 2]);
+		}
+#endif
+	}
+	for (int y = 0; y < INFLUENCE_HEIGHT; y++) {
+		const short* up = across[y > 0 ? y - 1 : 0];
+		const short* down = across[y < INFLUENCE_HEIGHT - 1 ? y + 1 : INFLUENCE_HEIGHT - 1];
+#if defined(HAVE_SSE2)
+		for (int x = 0; x < INFLUENCE_WIDTH; x += 8) {
+			__m128i above = _mm_loadu_si128((const __m128i*)(up + x));
+			__m128i middle = _mm_loadu_si128((const __m128i*)&across[y][x]);
+			__m128i below = _mm_loadu_si128((const __m128i*)(down + x));
+			_mm_storeu_si128((__m128i*)&out[y][x], _mm_avg_epu16(_mm_avg_epu16(above, below), middle));
+		}
+#else
+		for (int x = 0; x < INFLUENCE_WIDTH; x++) {
+			out[y][x] = (short)influenceAverage(up[x], across[y][x], down[x]);
+		}
+#endif
+	}
+}
+
+short influenceAt(const InfluenceMap* influence, InfluenceLayer layer, int cell) {
+	return influence->layers[layer][cell / INFLUENCE_WIDTH][cell % INFLUENCE_WIDTH];
+}
+
+// Central difference over the neighbouring cells, pointing uphill
+Vector2 influenceGradient(const InfluenceMap* influence, InfluenceLayer layer, int cell) {
+	int x = cell % INFLUENCE_WIDTH, y = cell / INFLUENCE_WIDTH;
+	const short(*grid)[INFLUENCE_WIDTH] = influence->layers[layer];
+	int left = grid[y][x > 0 ? x - 1 : x], right = grid[y][x < INFLUENCE_WIDTH - 1 ? x + 1 : x];
+	int up = grid[y > 0 ? y - 1 : y][x], down = grid[y < INFLUENCE_HEIGHT - 1 ? y + 1 : y][x];
+	return (Vector2){ (float)(right - left), (float)(down - up) };
+}
+
+// Restamps whatever changed cell or strength since the last tick and fades the echoes, so a
+// tick where nothing crossed a cell boundary costs one comparison per source
+void updateInfluence(GameModel* model, int tileSize) {
+	InfluenceMap* influence = &model->influence;
+	bool changed = influenceFade(influence);
+	for (int p = 0; p < MAX_PLAYERS; p++) {
+		const Player* player = &model->players[p];
+		int strength = p >= model->playerCount ? 0 : player->sword.active ? INFLUENCE_SWORD : INFLUENCE_PLAYER;
+		int cell = influenceCellOf(player->position, (float)player->size, tileSize);
+		changed |= influenceMove(influence, InfluenceThreat, &influence->players[p], cell, strength);
+	}
+	float enemySize = model->kinds[KindEnemy].size;
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		const Enemy* enemy = &model->enemies[i];
+		int cell = influenceCellOf(enemy->position, enemySize, tileSize);
+		changed |= influenceMove(influence, InfluenceCrowd, &influence->enemies[i], cell, enemy->active ? INFLUENCE_ENEMY : 0);
+	}
+	float crateSize = model->kinds[KindCrate].size;
+	for (int i = 0; i < MAX_CRATES; i++) {
+		const Crate* crate = &model->crates[i];
+		int cell = influenceCellOf(crate->position, crateSize, tileSize);
+		changed |= influenceMove(influence, InfluenceLoot, &influence->crates[i], cell, crate->active && crate->hasGold ? INFLUENCE_LOOT : 0);
+	}
+	if (influence->blurStale) {
+		influenceBlur(influence->layers[InfluenceThreat], influence->layers[InfluenceThreatBlurred]);
+		influence->blurStale = false;
+	}
+	if (changed) MARK_DIRTY(*model, SectionInfluence);
+}
+
+#pragma endregion
+
+#pragma region Quests
+
+#define QUEST_MAX_NODES 256
+#define QUEST_MAX_EDGES 512
+#define QUEST_NAME_BYTES 24
+#define QUEST_TEXT_BYTES 16384
+
+// Taken on the first matching edge of the current node, tried in file order
+typedef struct QuestEdge {
+	unsigned char trigger;
+	unsigned char checkGold : 1;
+	unsigned char checkKills : 1;
+	short gold;  // Taken only with at least this much gold, when checkGold
+	short kills;  // And at least this many kills, when checkKills
+	short target;  // Node entered
+} QuestEdge;
+
+typedef struct QuestNode {
+	char name[QUEST_NAME_BYTES];
+	short npc;  // Whose node this is, entering it moves that NPC here
+	GameStage stage;  // Set on entry, so code keyed on the stage keeps working
+	int say;  // Dialog set on entry as an offset into QuestGraph.text, -1 keeps the current one
+	short takeGold;  // Gold handed over on entry
+	bool resetKills;
+	bool follow;  // Walk after the first player while here
+	bool spawn;  // Keep enemies spawning while here
+	short firstEdge, edgeCount;
+} QuestNode;
+
+// The stage and dialog graph, read once at startup and shared read-only by every game
+typedef struct QuestGraph {
+	QuestNode nodes[QUEST_MAX_NODES];
+	int nodeCount;
+	QuestEdge edges[QUEST_MAX_EDGES];
+	int edgeCount;
+	char text[QUEST_TEXT_BYTES];
+	int textUsed;
+} QuestGraph;
+
+QuestGraph questGraph;
+
+const char* stageNames[] = { "StageOneSetup", "StageOne", "StageTwoSetup", "StageTwo", "StageThree" };
+const char* triggerNames[TriggerCount] = { "interact", "gold", "kill" };
+
+// The stock story in the --quests file format. Lines are
+//   node <name> npc=<index> stage=<GameStage> [take_gold=<n>] [reset_kills] [follow] [spawn]
+//   say <dialog to the end of the line>
+//   on <interact|gold|kill> [gold>=<n>] [kills>=<n>] -> <node>
+// and the first node of each NPC is where it starts. '#' at the start of a line is a comment.
+const char* defaultQuests =
+	"node ask npc=0 stage=StageOne\n"
+	"say Hey There! I need five gold, can you bring it? ( Press E to cont.)\n"
+	"on interact -> fetch\n"
+	"\n"
+	"node fetch npc=0 stage=StageOne\n"
+	"say go get it ( Press E to giv)\n"
+	"on interact gold>=1 -> thanks\n"
+	"on interact -> short\n"
+	"\n"
+	"node short npc=0 stage=StageOne\n"
+	"say you dont have the gold ( Press E to cont.)\n"
+	"on interact -> fetch\n"
+	"\n"
+	"node thanks npc=0 stage=StageOne take_gold=5\n"
+	"say Holy shit the gold!, we should not have teken i ( Press E to cont.)t\n"
+	"on interact -> attack\n"
+	"\n"
+	"node attack npc=0 stage=StageTwoSetup reset_kills follow spawn\n"
+	"say We are under attack!\n"
+	"on kill kills>=6 -> cleared\n"
+	"\n"
+	"node cleared npc=0 stage=StageTwoSetup follow\n"
+	"say Good job handleing those bad guys\n";
+
+bool questError(const char* origin, int line, const char* message) {
+	printf("quests: %s:%d: %s\n", origin, line, message);
+	return false;
+}
+
+int questFindNode(const QuestGraph* graph, const char* name) {
+	for (int n = 0; n < graph->nodeCount; n++) {
+		if (strcmp(graph->nodes[n].name, name) == 0) return n;
+	}
+	return -1;
+}
+
+// Parses a whole graph, leaving `graph` unusable on failure. Edge targets may name nodes
+// further down the file, so they are resolved once every node is known.
+bool questParse(QuestGraph* graph, const char* text, const char* origin) {
+	static char targets[QUEST_MAX_EDGES][QUEST_NAME_BYTES];
+	int targetLines[QUEST_MAX_EDGES];
+	graph->nodeCount = graph->edgeCount = graph->textUsed = 0;
+	int lineNumber = 0;
+	while (*text != '\0') {
+		char line[256];
+		size_t length = strcspn(text, "\n");
+		lineNumber++;
+		if (length >= sizeof(line)) return questError(origin, lineNumber, "line too long");
+		memcpy(line, text, length);
+		line[length] = '\0';
+		text += length + (text[length] == '\n');
+		if (length > 0 && line[length - 1] == '\r') line[length - 1] = '\0';
+
+		char word[32];
+		int used;
+		if (sscanf(line, "%31s%n", word, &used) != 1 || word[0] == '#') continue;
+		const char* rest = line + used;
+		QuestNode* current = graph->nodeCount > 0 ? &graph->nodes[graph->nodeCount - 1] : NULL;
+
+		if (strcmp(word, "node") == 0) {
+			if (graph->nodeCount >= QUEST_MAX_NODES) return questError(origin, lineNumber, "too many nodes");
+			QuestNode* node = &graph->nodes[graph->nodeCount];
+			*node = (QuestNode){ .npc = -1, .stage = StageOne, .say = -1, .firstEdge = (short)graph->edgeCount };
+			if (sscanf(rest, "%23s%n", node->name, &used) != 1) return questError(origin, lineNumber, "node without a name");
+			if (questFindNode(graph, node->name) >= 0) return questError(origin, lineNumber, "node defined twice");
+			rest += used;
+			while (sscanf(rest, "%31s%n", word, &used) == 1) {
+				rest += used;
+				int value;
+				if (sscanf(word, "npc=%d", &value) == 1) node->npc = (short)value;
+				else if (sscanf(word, "take_gold=%d", &value) == 1) node->takeGold = (short)value;
+				else if (strcmp(word, "reset_kills") == 0) node->resetKills = true;
+				else if (strcmp(word, "follow") == 0) node->follow = true;
+				else if (strcmp(word, "spawn") == 0) node->spawn = true;
+				else if (strncmp(word, "stage=", 6) == 0) {
+					int stage = 0;
+					while (stage < (int)(sizeof(stageNames) / sizeof(stageNames[0])) && strcmp(word + 6, stageNames[stage]) != 0) stage++;
+					if (stage == (int)(sizeof(stageNames) / sizeof(stageNames[0]))) return questError(origin, lineNumber, "unknown stage");
+					node->stage = (GameStage)stage;
+				}
+				else return questError(origin, lineNumber, "unknown node option");
+			}
+			if (node->npc < 0 || node->npc >= MAX_NPCS) return questError(origin, lineNumber, "node without a valid npc=<index>");
+			graph->nodeCount++;
+		}
+		else if (strcmp(word, "say") == 0) {
+			if (current == NULL) return questError(origin, lineNumber, "say before any node");
+			while (*rest == ' ' || *rest == '\t') rest++;
+			size_t size = strlen(rest) + 1;
+			if (graph->textUsed + size > QUEST_TEXT_BYTES) return questError(origin, lineNumber, "too much dialog");
+			memcpy(graph->text + graph->textUsed, rest, size);
+			current->say = graph->textUsed;
+			graph->textUsed += (int)size;
+		}
+		else if (strcmp(word, "on") == 0) {
+			if (current == NULL) return questError(origin, lineNumber, "edge before any node");
+			if (graph->edgeCount >= QUEST_MAX_EDGES) return questError(origin, lineNumber, "too many edges");
+			QuestEdge* edge = &graph->edges[graph->edgeCount];
+			*edge = (QuestEdge){ .trigger = TriggerCount, .target = -1 };
+			if (sscanf(rest, "%31s%n", word, &used) == 1) {
+				for (int t = 0; t < TriggerCount; t++) {
+					if (strcmp(word, triggerNames[t]) == 0) edge->trigger = (unsigned char)t;
+				}
+			}
+			if (edge->trigger == TriggerCount) return questError(origin, lineNumber, "unknown trigger");
+			rest += used;
+			char* target = targets[graph->edgeCount];
+			target[0] = '\0';
+			while (target[0] == '\0' && sscanf(rest, "%31s%n", word, &used) == 1) {
+				rest += used;
+				int value;
+				if (sscanf(word, "gold>=%d", &value) == 1) {
+					edge->checkGold = 1;
+					edge->gold = (short)value;
+				}
+				else if (sscanf(word, "kills>=%d", &value) == 1) {
+					edge->checkKills = 1;
+					edge->kills = (short)value;
+				}
+				else if (strcmp(word, "->") == 0) {
+					if (sscanf(rest, "%23s%n", target, &used) != 1) return questError(origin, lineNumber, "-> without a node");
+					rest += used;
+				}
+				else return questError(origin, lineNumber, "unknown condition");
+			}
+			if (target[0] == '\0') return questError(origin, lineNumber, "edge without -> <node>");
+			targetLines[graph->edgeCount] = lineNumber;
+			graph->edgeCount++;
+			current->edgeCount++;
+		}
+		else return questError(origin, lineNumber, "expected node, say or on");
+	}
+
+	for (int e = 0; e < graph->edgeCount; e++) {
+		graph->edges[e].target = (short)questFindNode(graph, targets[e]);
+		if (graph->edges[e].target < 0) return questError(origin, targetLines[e], "edge to an unknown node");
+	}
+	return true;
+}
+
+// Replaces the stock graph, before any game is set up. Every lockstep peer needs the same file.
+bool questLoadFile(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("quests: cannot open %s\n", path);
+		return false;
+	}
+	static char text[QUEST_MAX_NODES * 256];
+	size_t length = fread(text, 1, sizeof(text) - 1, file);
+	bool whole = feof(file);
+	fclose(file);
+	if (!whole) {
+		printf("quests: %s is too long\n", path);
+		return false;
+	}
+	text[length] = '\0';
+	static QuestGraph parsed;
+	if (!questParse(&parsed, text, path)) return false;
+	questGraph = parsed;
+	return true;
+}
+
+once_flag questDefaultOnce = ONCE_FLAG_INIT;
+
+void questLoadDefault(void) {
+	if (questGraph.nodeCount == 0) questParse(&questGraph, defaultQuests, "default");
+}
+
+// Takes an NPC out of the quest, it keeps standing there with its last dialog
+void questLeave(GameModel* model, int npc) {
+	unsigned int bit = 1u << npc;
+	model->quest.node[npc] = -1;
+	for (int t = 0; t < TriggerCount; t++) model->quest.listening[t] &= ~bit;
+	model->quest.following &= ~bit;
+	model->quest.spawning &= ~bit;
+}
+
+// Moves the node's NPC onto it, applies what entering does and files the NPC under the
+// triggers the node waits for
+void questEnter(GameModel* model, int n) {
+	const QuestNode* node = &questGraph.nodes[n];
+	int npc = node->npc;
+	unsigned int bit = 1u << npc;
+	questLeave(model, npc);
+	model->quest.node[npc] = (short)n;
+	for (int e = node->firstEdge; e < node->firstEdge + node->edgeCount; e++) {
+		model->quest.listening[questGraph.edges[e].trigger] |= bit;
+	}
+	if (node->follow) model->quest.following |= bit;
+	if (node->spawn) model->quest.spawning |= bit;
+	if (node->say >= 0) model->npcs[npc].dialog = questGraph.text + node->say;
+	model->goldCollected -= node->takeGold;
+	if (node->resetKills) model->killCount = 0;
+	model->stage = node->stage;
+	setNpcActive(model, npc, true);
+	MARK_DIRTY(*model, SectionNpcs);
+}
+
+// Every NPC starts on its first node in the graph
+void questInit(GameModel* model) {
+	call_once(&questDefaultOnce, questLoadDefault);
+	model->quest = (QuestState){ 0 };
+	for (int i = 0; i < MAX_NPCS; i++) model->quest.node[i] = -1;
+	for (int n = 0; n < questGraph.nodeCount; n++) {
+		if (model->quest.node[questGraph.nodes[n].npc] < 0) model->quest.node[questGraph.nodes[n].npc] = (short)n;
+	}
+	for (int i = 0; i < MAX_NPCS; i++) {
+		if (model->quest.node[i] >= 0) questEnter(model, model->quest.node[i]);
+	}
+}
+
+// Jumps straight to the first node of a stage, for modes that skip the story
+void questStart(GameModel* model, GameStage stage) {
+	for (int n = 0; n < questGraph.nodeCount; n++) {
+		if (questGraph.nodes[n].stage == stage) {
+			questEnter(model, n);
+			return;
+		}
+	}
+	model->stage = stage;
+}
+
+// Called by applyEvents as each event lands, with the NPC for TriggerInteract or -1. Only
+// NPCs filed under the trigger are looked at, so an idle tick does no quest work at all.
+// An edge to another NPC's node hands the story over and this NPC drops out.
+void questNotify(GameModel* model, QuestTrigger trigger, int npc) {
+	unsigned int listening = model->quest.listening[trigger];
+	if (npc >= 0) listening &= 1u << npc;
+	for (; listening != 0; listening &= listening - 1) {
+		int from = lowestBit(listening);
+		const QuestNode* node = &questGraph.nodes[model->quest.node[from]];
+		for (int e = node->firstEdge; e < node->firstEdge + node->edgeCount; e++) {
+			const QuestEdge* edge = &questGraph.edges[e];
+			if (edge->trigger != trigger) continue;
+			if (edge->checkGold && model->goldCollected < edge->gold) continue;
+			if (edge->checkKills && model->killCount < edge->kills) continue;
+			if (questGraph.nodes[edge->target].npc != from) questLeave(model, from);
+			questEnter(model, edge->target);
+			break;
+		}
+	}
+}
+
+#pragma endregion
+
+////////// 
+#pragma region INIT
+
+const float frameDuration = 0.3f;  // Seconds per sprite animation frame
+
+// Entities spawned during the tick, created by ecsFlush at the end of update(). Per thread,
+// since a thread only ever steps one model at a time.
+_Thread_local EcsCommandBuffer ecsCommands;
+
+Rectangle playerBounds(const Player* player) {
+	return (Rectangle) { player->position.x, player->position.y, player->size, player->size };
+}
+
+// First player overlapping rect, -1 when none does. Tests count towards `counter`.
+int overlappingPlayer(const GameModel* model, Rectangle rect, CounterId counter) {
+	for (int p = 0; p < model->playerCount; p++) {
+		counterAdd(counter, 1);
+		if (CheckCollisionRecs(rect, playerBounds(&model->players[p]))) return p;
+	}
+	return -1;
+}
+
+int nearestPlayer(const GameModel* model, Vector2 position) {
+	int nearest = 0;
+	float best = INFINITY;
+	for (int p = 0; p < model->playerCount; p++) {
+		float dx = model->players[p].position.x - position.x;
+		float dy = model->players[p].position.y - position.y;
+		if (dx * dx + dy * dy < best) {
+			best = dx * dx + dy * dy;
+			nearest = p;
+		}
+	}
+	return nearest;
+}
+
+void spawnDamageParticle(Vector2 position, int damageAmount, Color color) {
+	EcsValues values = {
+		.position = position,
+		.velocity = (Vector2){ 0, -50 }, // Move the particle upward
+		.lifetime = (Lifetime){ 1.0f, 1.0f }, // Lasts for 1 second
+		.tint = color,
+		.damageAmount = damageAmount
+	};
+	ecsDeferCreate(&ecsCommands, ARCHETYPE_DAMAGE_TEXT, &values);
+}
+
+void spawnParticles(unsigned int* rng, Vector2 position, int count, Color color) {
+	for (int i = 0; i < count; i++) {
+		// Random velocity
+		Vector2 direction = simDirection((unsigned int)gameRand(rng));
+		float speed = (float)(gameRand(rng) % 100) / 50.0f * 200.0f;
+		EcsValues values = {
+			.position = position,
+			.velocity = (Vector2){ direction.x * speed, direction.y * speed },
+			.lifetime = (Lifetime){ PARTICLE_LIFESPAN, PARTICLE_LIFESPAN },
+			.tint = color
+		};
+		ecsDeferCreate(&ecsCommands, ARCHETYPE_PARTICLE, &values);
+	}
+}
+
+// Fills the free crate slots under the limit, each one settled where it lands
+void spawnCrates(GameModel* model, int tileSize) {
+	Vector2 playerPosition = model->players[0].position;
+	for (int i = 0; i < model->limits.crates; i++) {
+		if (!model->crates[i].active) {
+			int x, y;
+			if (!pickSpawnTile(&model->rngState, playerPosition.x / tileSize, playerPosition.y / tileSize, CRATE_SPAWN_EXCLUSION, &x, &y)) break;
+			model->crates[i] = (Crate){ .position = { x * tileSize, y * tileSize }, .health = 2, .active = true, .hasGold = true };
+			sleepCrate(model, i, tileSize);
+		}
+	}
+}
+
+// Tries to bring the first free enemy slot under the limit into play, false when none was placed
+bool spawnEnemy(GameModel* model, int tileSize) {
+	for (int i = 0; i < model->limits.enemies; i++) {
+		if (model->enemies[i].active) continue;
+		// The walkable index already excludes walls and the first player's surroundings,
+		// the rect test keeps enemies off the other players and region borders
+		Vector2 anchor = model->players[0].position;
+		for (int attempt = 0; attempt < MAX_SPAWN_ATTEMPTS; attempt++) {
+			int x, y;
+			if (!pickSpawnTile(&model->rngState, anchor.x / tileSize, anchor.y / tileSize, ENEMY_SPAWN_EXCLUSION, &x, &y)) {
+				counterAdd(CounterSpawnRejects, 1);
+				break;
+			}
+			Vector2 spawnPos = { x * tileSize, y * tileSize };
+			Rectangle spawnRect = { spawnPos.x, spawnPos.y, model->kinds[KindEnemy].size, model->kinds[KindEnemy].size };
+			if (overlappingPlayer(model, spawnRect, CounterRectsEnemies) < 0) {
+				model->enemies[i].position = spawnPos;
+				model->steering[i].searchTarget = anchor;  // The noise of the player it spawned for
+				model->enemies[i].active = true;
+				model->enemies[i].chasing = false;
+				model->enemies[i].health = 3;
+				MARK_DIRTY(*model, SectionEnemies);
+				return true;
+			}
+			counterAdd(CounterSpawnRejects, 1);
+		}
+		return false;
+	}
+	return false;
+}
+
+GameModel spawnEnemies(GameModel model, float deltaTime, int tileSize)
+{
+	model.enemySpawnTimer += deltaTime;
+	if (model.enemySpawnTimer >= ENEMY_RESPAWN_TIME) {
+		model.enemySpawnTimer = 0.0f;
+		spawnEnemy(&model, tileSize);
+	}
+	return model;
+}
+
+GameModel spawnGold(GameModel model, Vector2 cratePosition, int tileSize) {
+	float randomOffsetX = (gameRand(&model.rngState) % 20 - 10) * 0.1f; // Random offset between -1.0 and 1.0
+	float randomOffsetY = (gameRand(&model.rngState) % 20 - 10) * 0.1f;
+
+	EcsValues values = {
+		.position = cratePosition,
+		// Set initial velocity to simulate "falling out"
+		.velocity = (Vector2){ randomOffsetX * 500.0f, randomOffsetY * 500.0f },
+		.drag = 0.9f,
+		.pickup = (Pickup){ tileSize / 2 }
+	};
+	ecsDeferCreate(&ecsCommands, ARCHETYPE_GOLD, &values);
+	return model;
+}
+
+// Start tiles, one per player slot
+const int playerSpawnTiles[MAX_PLAYERS][2] = {
+	{ 2, 2 }, { 2, 4 }, { 4, 4 }, { 6, 4 }, { 8, 4 }, { 10, 4 }, { 2, 6 }, { 4, 6 }
+};
+
+GameModel setup(int tileSize, int playerCount, unsigned int seed)
+{
+	GameModel model =
+	{ .playerCount = playerCount
+	, .rngState = seed != 0 ? seed : GAME_DEFAULT_SEED  // xorshift never leaves 0
+	, .enemies = {0}
+	, .bullets = { 0 }
+	, .enemySpawnTimer = 0.0f
+	, .npcs = { 0 }
+	, .goldCollected = 0
+	, .crates = {0}
+	, .stage = StageOne
+	, .dirty = ~0u
+	, .limits = defaultLimits
+	};
+	sleepInit(&model.sleep);
+
+	for (int p = 0; p < playerCount; p++) {
+		model.players[p] = (Player)
+			{.position = (Vector2){ playerSpawnTiles[p][0] * tileSize, playerSpawnTiles[p][1] * tileSize }
+			, .direction = (Vector2){ 0, -1 }
+			, .speed = 200.0f
+			, .size = 50
+			, .health = 10
+			, .color = BLUE
+			, .sword = (Sword)
+				{.size = (Vector2){40, 10}
+				, .color = DARKBROWN
+				, .active = false
+				, .cooldown = 0.0f
+				, .duration = 0.0f
+				}
+			, .activeDialog = NULL
+			};
+	}
+
+	ecsInit(&model.ecs);
+	ecsRegisterArchetype(&model.ecs, ARCHETYPE_PARTICLE, model.limits.particles);
+	ecsRegisterArchetype(&model.ecs, ARCHETYPE_DAMAGE_TEXT, MAX_DAMAGE_PARTICLES);
+	ecsRegisterArchetype(&model.ecs, ARCHETYPE_GOLD, MAX_GOLD);
+	ecsRegisterArchetype(&model.ecs, ARCHETYPE_SLEEPING_GOLD, MAX_GOLD);
+	ecsCommands.count = 0;
+
+	for (int i = 0; i < MAX_NPCS; i++) {
+		model.npcs[i].position = (Vector2){ (4 + i * 2) * tileSize, 2 * tileSize };
+		model.npcs[i].size = tileSize;
+		model.npcs[i].dialog = "";//i == 0 ? "Hello, brave warrior!" : i == 1 ? "Beware of the enemies ahead!" : "You must find the sacred relic.";
+		model.npcs[i].active = false;
+		model.npcs[i].color = GREEN;
+	}
+	questInit(&model);
+
+	model.kinds[KindEnemy] = (KindInfo){ .size = tileSize, .speed = 100.0f, .color = RED };
+	model.kinds[KindBullet] = (KindInfo){ .size = 10, .speed = 400.0f, .color = BLACK };
+	model.kinds[KindCrate] = (KindInfo){ .size = tileSize, .speed = 0.0f, .color = BROWN };
+
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		model.enemies[i].health = 1;
+		model.enemies[i].active = false;
+		model.enemies[i].attackCooldown = 0.0f;
+	}
+
+	for (int i = 0; i < BULLET_POOL; i++) {
+		model.bullets[i].active = false;
+	}
+
+	// Built once; whoever edits the map rebuilds it, so concurrent setups only ever read it
+	if (walkableIndex.version == 0) rebuildWalkableIndex();
+	spawnCrates(&model, tileSize);
+	for (int p = 0; p < MAX_PLAYERS; p++) {
+		model.fov[p].tileX = model.fov[p].tileY = -1;
+	}
+	updateFieldOfView(&model, tileSize);
+	influenceReset(&model.influence);
+	updateInfluence(&model, tileSize);
+	return model;
+}
+
+short limitTo(int value, int ceiling) {
+	return (short)(value < 0 ? 0 : value > ceiling ? ceiling : value);
+}
+
+// Limits apply from the next spawn on, entities already past a lowered limit live out their time
+void setGameLimits(GameModel* model, GameLimits limits) {
+	model->limits.enemies = limitTo(limits.enemies, MAX_ENEMIES);
+	model->limits.bulletsPerPlayer = limitTo(limits.bulletsPerPlayer, MAX_BULLETS);
+	model->limits.crates = limitTo(limits.crates, MAX_CRATES);
+	model->limits.particles = limitTo(limits.particles, MAX_PARTICLES);
+	int particles = ecsFindArchetype(&model->ecs, ARCHETYPE_PARTICLE);
+	if (particles >= 0) model->ecs.archetypes[particles].capacity = model->limits.particles;
+	MARK_DIRTY(*model, SectionEcs);
+}
+#pragma endregion
+
+#pragma region Update
+
+GameModel moveNPCToPlayer(GameModel model, int i, float deltaTime, float npcSpeed, float stoppingDistance) {
+	// Access the NPC and the player's position
+	Vector2 npcPos = model.npcs[i].position; // NPC's current position
+	Vector2 playerPos = model.players[0].position; // First player's current position
+
+	// Calculate the direction vector from the NPC to the player
+	Vector2 direction = {
+		playerPos.x - npcPos.x,
+		playerPos.y - npcPos.y
+	};
+
+	// Calculate the distance between the NPC and the player
+	float distance = simLength(direction);
+
+	// Move the NPC only if it's farther than the stopping distance
+	if (distance > stoppingDistance) {
+		// Normalize the direction vector
+		direction.x /= distance;
+		direction.y /= distance;
+
+		// Update the NPC's position by moving it towards the player
+		npcPos.x += direction.x * npcSpeed * deltaTime;
+		npcPos.y += direction.y * npcSpeed * deltaTime;
+
+		// Assign the updated position back to the NPC in the model
+		model.npcs[i].position = npcPos;
+	}
+
+	return model;
+}
+
+// Dialog and stage changes happen in questNotify as events are applied; all that is left per
+// tick is what the current nodes keep doing
+GameModel updateStage(GameModel model, float deltaTime, int tileSize) {
+	for (unsigned int following = model.quest.following; following != 0; following &= following - 1) {
+		model = moveNPCToPlayer(model, lowestBit(following), deltaTime, 100.0f, 100);
+		MARK_DIRTY(model, SectionNpcs);
+	}
+	if (model.quest.spawning != 0) model = spawnEnemies(model, deltaTime, tileSize);
+	return model;
+}
+
+// Everything with a velocity moves, whatever kind of entity it is
+void updateMotion(EcsWorld* world, float deltaTime) {
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition) | COMPONENT(ComponentVelocity), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(world, &query)) != NULL) {
+		Vector2* position = ecsColumn(world, chunk, ComponentPosition);
+		Vector2* velocity = ecsColumn(world, chunk, ComponentVelocity);
+		for (int i = 0; i < chunk->count; i++) {
+			position[i].x += velocity[i].x * deltaTime;
+			position[i].y += velocity[i].y * deltaTime;
+		}
+	}
+}
+
+void updateDrag(EcsWorld* world) {
+	EcsQuery query = ecsQuery(COMPONENT(ComponentVelocity) | COMPONENT(ComponentDrag), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(world, &query)) != NULL) {
+		Vector2* velocity = ecsColumn(world, chunk, ComponentVelocity);
+		float* drag = ecsColumn(world, chunk, ComponentDrag);
+		for (int i = 0; i < chunk->count; i++) {
+			// Gradually slow down
+			velocity[i].x *= drag[i];
+			velocity[i].y *= drag[i];
+
+			// Stop after it slows down enough
+			if (fabsf(velocity[i].x) < 0.1f && fabsf(velocity[i].y) < 0.1f) {
+				velocity[i] = (Vector2){ 0.0f, 0.0f };
+			}
+		}
+	}
+}
+
+void updateLifetimes(EcsWorld* world, float deltaTime) {
+	EcsQuery query = ecsQuery(COMPONENT(ComponentLifetime), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(world, &query)) != NULL) {
+		Lifetime* lifetime = ecsColumn(world, chunk, ComponentLifetime);
+		Color* tint = ecsColumn(world, chunk, ComponentTint);
+		bool fade = (world->archetypes[chunk->archetype].mask & COMPONENT(ComponentFade)) != 0;
+		for (int i = 0; i < chunk->count; i++) {
+			lifetime[i].remaining -= deltaTime;
+			if (lifetime[i].remaining <= 0.0f) {
+				ecsDeferDestroy(&ecsCommands, query.chunkIndex, i);
+			}
+			else if (fade && tint != NULL) {
+				float alpha = lifetime[i].remaining / lifetime[i].total;
+				tint[i].a = (unsigned char)(alpha * 255);
+			}
+		}
+	}
+}
+
+GameModel damageCrate(GameModel model, int i, int damage, int particleCount, int tileSize) {
+	if (!model.crates[i].active) return model;
+	model.crates[i].health -= damage;
+	model.crates[i].idleTicks = 0;
+	spawnParticles(&model.rngState, (Vector2) { model.crates[i].position.x + model.kinds[KindCrate].size / 2, model.crates[i].position.y + model.kinds[KindCrate].size / 2 }, particleCount, BROWN);
+	if (model.crates[i].health <= 0) {
+		model.crates[i].active = false;
+		model = spawnGold(model, model.crates[i].position, tileSize);
+	}
+	return model;
+}
+
+// Bullet hits on crates are resolved by the swept pass in updateBullets
 GameModel updateCrates(GameModel model, int tileSize) {
+	for (int p = 0; p < model.playerCount; p++) {
+		Sword* sword = &model.players[p].sword;
+		if (!sword->active) continue;
+		Rectangle swordRect = { sword->position.x, sword->position.y, sword->size.x, sword->size.y };
+		wakeArea(&model, swordRect, 0.0f, tileSize);
+
+		// Slot k is the k-th awake crate, so hits come out in the same order as the list
+		BoxBatch boxes;
+		boxBatchReset(&boxes, model.sleep.awakeCrateCount);
+		for (int k = 0; k < model.sleep.awakeCrateCount; k++) {
+			int i = model.sleep.awakeCrates[k];
+			if (model.crates[i].active) boxBatchSet(&boxes, k, (Rectangle) { model.crates[i].position.x, model.crates[i].position.y, model.kinds[KindCrate].size, model.kinds[KindCrate].size });
+		}
+		uint64_t hits[BOX_MASK_WORDS];
+		boxBatchOverlaps(&boxes, swordRect, hits);
+		counterAdd(CounterRectsCrates, boxes.count);
+		for (int w = 0; w < BOX_MASK_WORDS; w++) {
+			for (uint64_t bits = hits[w]; bits != 0; bits &= bits - 1) {
+				int i = model.sleep.awakeCrates[w * 64 + lowestBit64(bits)];
+				raiseEvent((GameEvent) { .key = eventKey(SystemCrates, p * MAX_CRATES + i), .type = EventDamageCrate, .target = i, .amount = 1, .particleCount = 5 });
+			}
+		}
+	}
+	return model;
+}
+
+// Wake the sleeping gold within reach of a player. The archetype is only scanned when a
+// player is near a cell that has some, so resting loot costs nothing per tick otherwise.
+void wakeGold(GameModel* model, int tileSize) {
+	bool nearby = false;
+	for (int p = 0; p < model->playerCount && !nearby; p++) {
+		const Player* player = &model->players[p];
+		int x0, y0, x1, y1;
+		gridCellRange((Rectangle) { player->position.x, player->position.y, player->size, player->size }, tileSize / 2.0f, tileSize, &x0, &y0, &x1, &y1);
+		for (int y = y0; y <= y1 && !nearby; y++) {
+			for (int x = x0; x <= x1 && !nearby; x++) {
+				nearby = model->sleep.cellGold[y * MAP_WIDTH + x] > 0;
+			}
+		}
+	}
+	if (!nearby) return;
+
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPickup) | COMPONENT(ComponentSleeping), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model->ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model->ecs, chunk, ComponentPosition);
+		for (int i = 0; i < chunk->count; i++) {
+			int cell = cellIndexOf(position[i], tileSize);
+			if (cellNearPlayers(model, cell, tileSize) && ecsDeferMove(&ecsCommands, query.chunkIndex, i, ARCHETYPE_GOLD)) {
+				model->sleep.cellGold[cell]--;
+				MARK_DIRTY(*model, SectionSleep);
+			}
+		}
+	}
+}
+
+GameModel updateGold(GameModel model, int tileSize) {
+	wakeGold(&model, tileSize);
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition) | COMPONENT(ComponentPickup), COMPONENT(ComponentSleeping));
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model.ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model.ecs, chunk, ComponentPosition);
+		Pickup* pickup = ecsColumn(&model.ecs, chunk, ComponentPickup);
+		for (int i = 0; i < chunk->count; i++) {
+			if (overlappingPlayer(&model, (Rectangle) { position[i].x, position[i].y, pickup[i].size, pickup[i].size }, CounterRectsGold) >= 0
+				&& ecsDeferDestroy(&ecsCommands, query.chunkIndex, i)) {
+				raiseEvent((GameEvent) { .key = eventKey(SystemGold, query.chunkIndex * ECS_CHUNK_CAPACITY + i), .type = EventCollectGold, .position = position[i] });
+			}
+		}
+	}
+	return model;
+}
+
+// Gold that has stopped and is out of every player's reach goes to sleep, leaving the
+// motion, drag and pickup passes. Runs after updateDrag so the stop is this tick's.
+void settleGold(GameModel* model, int tileSize) {
+	EcsQuery query = ecsQuery(COMPONENT(ComponentVelocity) | COMPONENT(ComponentPickup), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model->ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model->ecs, chunk, ComponentPosition);
+		Vector2* velocity = ecsColumn(&model->ecs, chunk, ComponentVelocity);
+		for (int i = 0; i < chunk->count; i++) {
+			if (velocity[i].x != 0.0f || velocity[i].y != 0.0f) continue;
+			int cell = cellIndexOf(position[i], tileSize);
+			if (cellNearPlayers(model, cell, tileSize) || model->sleep.cellGold[cell] == 255) continue;
+			if (!ecsDeferMove(&ecsCommands, query.chunkIndex, i, ARCHETYPE_SLEEPING_GOLD)) continue;  // Tries again next tick
+			model->sleep.cellGold[cell]++;
+			MARK_DIRTY(*model, SectionSleep);
+		}
+	}
+}
+
+GameModel updatePlayerMovement(GameModel model, int p, PlayerInput input, float deltaTime, int tileSize)
+{
+	Player* player = &model.players[p];
+	Vector2 newPosition = player->position;
+	player->isMoving = false;
+	if (input & InputRight) {
+		newPosition.x += player->speed * deltaTime;
+		player->direction = (Vector2){ 1, 0 };
+		player->isMoving = true;
+	}
+	if (input & InputLeft) {
+		newPosition.x -= player->speed * deltaTime;
+		player->direction = (Vector2){ -1, 0 };
+		player->isMoving = true;
+	}
+	if (input & InputUp) {
+		newPosition.y -= player->speed * deltaTime;
+		player->direction = (Vector2){ 0, -1 };
+		player->isMoving = true;
+	}
+	if (input & InputDown) {
+		newPosition.y += player->speed * deltaTime;
+		player->direction = (Vector2){ 0, 1 };
+		player->isMoving = true;
+	}
+
+	// Define the player and map rectangles
+	Rectangle playerRect = {
+		player->position.x - 10,
+		player->position.y - 10,
+		player->size - 10,  // Assuming player size is defined
+		player->size - 10  // Assuming player size is defined
+	};
+
+	// Track the original position to revert if collision occurs
+	Vector2 originalPosition = player->position;
+
+	// Move player to the new position
+	player->position = newPosition;
+	playerRect.x = player->position.x;
+	playerRect.y = player->position.y;
+
+	// Check collisions and adjust position if needed
+	bool collisionDetected = false;
+	int tests = 0;
+	for (int y = 0; y < MAP_HEIGHT; y++) {
+		for (int x = 0; x < MAP_WIDTH; x++) {
+			if (map[y][x] == '#') {
+				Rectangle tileRect = {
+					x * tileSize,
+					y * tileSize,
+					tileSize,
+					tileSize
+				};
+				tests++;
+				if (CheckCollisionRecs(playerRect, tileRect)) {
+					collisionDetected = true;
+					tests += 2;  // The two axis tests below
+
+					// Move player back to original position
+					player->position = originalPosition;
+					playerRect.x = player->position.x;
+					playerRect.y = player->position.y;
+
+					// Handle collision by checking and resolving separately for X and Y axes
+					// Check horizontal collision
+					if (CheckCollisionRecs(playerRect, tileRect)) {
+						if (newPosition.x > originalPosition.x) {
+							// Player is moving right
+							player->position.x = tileRect.x - playerRect.width;
+						}
+						else {
+							// Player is moving left
+							player->position.x = tileRect.x + tileRect.width;
+						}
+					}
+
+					// Update player rectangle position
+					playerRect.x = player->position.x;
+					playerRect.y = player->position.y;
+
+					// Check vertical collision
+					if (CheckCollisionRecs(playerRect, tileRect)) {
+						if (newPosition.y > originalPosition.y) {
+							// Player is moving down
+							player->position.y = tileRect.y - playerRect.height;
+						}
+						else {
+							// Player is moving up
+							player->position.y = tileRect.y + tileRect.height;
+						}
+					}
+
+					// Break out of loops once collision is resolved
+					break;
+				}
+			}
+		}
+		if (collisionDetected) break;
+	}
+	counterAdd(CounterRectsMovement, tests);
+
+	return model;
+
+}
+// Slot i holds enemy i, dead enemies get an empty box
+void enemyBoxes(const GameModel* model, BoxBatch* boxes) {
+	boxBatchReset(boxes, MAX_ENEMIES);
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (model->enemies[i].active) boxBatchSet(boxes, i, (Rectangle) { model->enemies[i].position.x, model->enemies[i].position.y, model->kinds[KindEnemy].size, model->kinds[KindEnemy].size });
+	}
+}
+
+#define STEER_SEPARATION 1.5f  // Weight of the push away from crowding neighbours
+#define STEER_ALIGNMENT 0.3f  // Weight of matching the neighbours' velocity
+#define STEER_RESPONSE 10.0f  // How fast velocity turns toward the steering target, per second
+#define RETREAT_THREAT 96  // Blurred threat at which a wounded enemy backs off, about a cell from a player
+
+// Active enemies bucketed by the tile under their centre. Enemies are one tile wide, so
+// any two that overlap sit in the same or adjacent cells and a query reads 3x3 cells.
+typedef struct CrowdGrid {
+	int* cellStart;  // Scratch, MAP_HEIGHT * MAP_WIDTH + 1
+	short* items;  // Scratch, one per active enemy
+} CrowdGrid;
+
+int crowdCell(Vector2 position, float size, int tileSize, int* cellX, int* cellY) {
+	int x = (int)floorf((position.x + size / 2) / tileSize);
+	int y = (int)floorf((position.y + size / 2) / tileSize);
+	*cellX = x < 0 ? 0 : x > MAP_WIDTH - 1 ? MAP_WIDTH - 1 : x;
+	*cellY = y < 0 ? 0 : y > MAP_HEIGHT - 1 ? MAP_HEIGHT - 1 : y;
+	return *cellY * MAP_WIDTH + *cellX;
+}
+
+// Counting sort, the same as gridBuild, so a cell's enemies are in index order
+void crowdBuild(CrowdGrid* grid, const GameModel* model, int tileSize) {
+	float size = model->kinds[KindEnemy].size;
+	int cells[MAX_ENEMIES];
+	grid->cellStart = scratchAlloc(sizeof(int) * (MAP_HEIGHT * MAP_WIDTH + 1));
+	memset(grid->cellStart, 0, sizeof(int) * (MAP_HEIGHT * MAP_WIDTH + 1));
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (!model->enemies[i].active) continue;
+		int x, y;
+		cells[i] = crowdCell(model->enemies[i].position, size, tileSize, &x, &y);
+		grid->cellStart[cells[i] + 1]++;
+	}
+	for (int c = 0; c < MAP_HEIGHT * MAP_WIDTH; c++) grid->cellStart[c + 1] += grid->cellStart[c];
+	grid->items = scratchAlloc(sizeof(short) * grid->cellStart[MAP_HEIGHT * MAP_WIDTH]);
+	size_t mark = scratchMark();
+	int* cursor = scratchAlloc(sizeof(int) * MAP_HEIGHT * MAP_WIDTH);
+	memcpy(cursor, grid->cellStart, sizeof(int) * MAP_HEIGHT * MAP_WIDTH);
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (model->enemies[i].active) grid->items[cursor[cells[i]]++] = (short)i;
+	}
+	scratchRewind(mark);
+}
+
+// Neighbours of enemy i from the 3x3 cells around it, returns how many were written
+int crowdNeighbours(const CrowdGrid* grid, const GameModel* model, int i, int tileSize, short* out, int capacity) {
+	int cellX, cellY, count = 0;
+	crowdCell(model->enemies[i].position, model->kinds[KindEnemy].size, tileSize, &cellX, &cellY);
+	for (int y = cellY > 0 ? cellY - 1 : 0; y <= cellY + 1 && y < MAP_HEIGHT; y++) {
+		for (int x = cellX > 0 ? cellX - 1 : 0; x <= cellX + 1 && x < MAP_WIDTH; x++) {
+			int cell = y * MAP_WIDTH + x;
+			for (int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1] && count < capacity; k++) {
+				if (grid->items[k] != i) out[count++] = grid->items[k];
+			}
+		}
+	}
+	return count;
+}
+
+// Whether an enemy box at position is clear of walls, a hair inside its edges so that
+// resting flush against a wall still fits
+bool enemyFits(Vector2 position, float size, int tileSize) {
+	int x0 = (int)floorf((position.x + 0.01f) / tileSize), x1 = (int)floorf((position.x + size - 0.01f) / tileSize);
+	int y0 = (int)floorf((position.y + 0.01f) / tileSize), y1 = (int)floorf((position.y + size - 0.01f) / tileSize);
+	for (int y = y0; y <= y1; y++) {
+		for (int x = x0; x <= x1; x++) {
+			if (!isWalkable(x, y)) return false;
+		}
+	}
+	return true;
+}
+
+// Move by offset, sliding along whichever axis is still free when the full move hits a wall.
+// An enemy already stuck in a wall is let out.
+void moveEnemy(Enemy* enemy, Vector2 offset, float size, int tileSize) {
+	Vector2 moved = { enemy->position.x + offset.x, enemy->position.y + offset.y };
+	if (enemyFits(moved, size, tileSize) || !enemyFits(enemy->position, size, tileSize)) {
+		enemy->position = moved;
+		return;
+	}
+	Vector2 alongX = { moved.x, enemy->position.y };
+	if (offset.x != 0 && enemyFits(alongX, size, tileSize)) enemy->position = alongX;
+	Vector2 alongY = { enemy->position.x, moved.y };
+	if (offset.y != 0 && enemyFits(alongY, size, tileSize)) enemy->position = alongY;
+}
+
+// Velocity toward the next node of the path, slowing to land on the node and easing off
+// within a tile of the goal
+Vector2 arrivalVelocity(Vector2 position, Vector2 node, Vector2 goal, float speed, float deltaTime, int tileSize) {
+	Vector2 toNode = { node.x - position.x, node.y - position.y };
+	float distance = simLength(toNode);
+	if (distance <= 0) return (Vector2) { 0, 0 };
+	float toGoal = simLength((Vector2) { goal.x - position.x, goal.y - position.y });
+	float wanted = toGoal < tileSize ? speed * (0.25f + 0.75f * toGoal / tileSize) : speed;
+	if (wanted > distance / deltaTime) wanted = distance / deltaTime;
+	return (Vector2) { toNode.x / distance * wanted, toNode.y / distance * wanted };
+}
+
+GameModel updateEnemies(GameModel model, float deltaTime, int tileSize)
+{
+	int activeCount = 0;
+	for (int i = 0; i < MAX_ENEMIES; i++) activeCount += model.enemies[i].active;
+	if (activeCount == 0) return model;  // Most of stage one, no grids to build
+
+	float size = model.kinds[KindEnemy].size;
+	float speed = model.kinds[KindEnemy].speed;
+	Vector2 desired[MAX_ENEMIES];
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (model.enemies[i].active) {
+			MARK_DIRTY(model, SectionEnemies);
+
+			// Update attack timer
+			if (model.enemies[i].attackCooldown > 0) {
+				model.enemies[i].attackCooldown -= deltaTime;
+			}
+
+			// Chase the nearest player while they can see us, otherwise search where they were
+			// last seen. Visibility is symmetric enough to use the player's view for both.
+			int targetIndex = nearestPlayer(&model, model.enemies[i].position);
+			Player* target = &model.players[targetIndex];
+			Rectangle bounds = { model.enemies[i].position.x, model.enemies[i].position.y, size, size };
+			model.enemies[i].chasing = fovSeesRect(&model.fov[targetIndex], bounds, tileSize);
+			if (model.enemies[i].chasing) {
+				model.steering[i].searchTarget = target->position;
+			}
+			else if (fabsf(model.steering[i].searchTarget.x - model.enemies[i].position.x) < tileSize / 2 && fabsf(model.steering[i].searchTarget.y - model.enemies[i].position.y) < tileSize / 2) {
+				// Nobody here, follow the noise to wherever the player is now
+				model.steering[i].searchTarget = target->position;
+			}
+
+			// A wounded enemy close to the players falls back down the threat slope, towards the
+			// rest of the crowd and the crates still holding gold, instead of closing in
+			desired[i] = (Vector2){ 0, 0 };
+			int cell = influenceCellOf(model.enemies[i].position, size, tileSize);
+			if (model.enemies[i].health == 1 && influenceAt(&model.influence, InfluenceThreatBlurred, cell) >= RETREAT_THREAT) {
+				Vector2 threat = influenceGradient(&model.influence, InfluenceThreatBlurred, cell);
+				Vector2 crowd = influenceGradient(&model.influence, InfluenceCrowd, cell);
+				Vector2 loot = influenceGradient(&model.influence, InfluenceLoot, cell);
+				Vector2 retreat = { crowd.x + loot.x - threat.x, crowd.y + loot.y - threat.y };
+				float length = simLength(retreat);
+				if (length > 0) {
+					desired[i] = (Vector2){ retreat.x / length * speed, retreat.y / length * speed };
+					continue;
+				}
+			}
+
+			// Pathfinding
+			// From the centre, a corner resting on a tile edge can round into the wall behind it
+			Vector2 centre = { model.enemies[i].position.x + size / 2, model.enemies[i].position.y + size / 2 };
+			size_t mark = scratchMark();
+			Node* path = findPath(centre, model.steering[i].searchTarget, tileSize);
+			if (path != NULL) {
+				Vector2 nextPosition = getNextPathPosition(path, &model.enemies[i], tileSize);
+				desired[i] = arrivalVelocity(model.enemies[i].position, nextPosition, model.steering[i].searchTarget, speed, deltaTime, tileSize);
+			}
+			scratchRewind(mark);
+		}
+	}
+
+	// Steer: follow the path, keep apart from and move along with the neighbours. Every
+	// enemy reads last tick's positions and velocities, so the order does not matter.
+	CrowdGrid crowd;
+	crowdBuild(&crowd, &model, tileSize);
+	Vector2 velocity[MAX_ENEMIES];
+	float response = STEER_RESPONSE * deltaTime < 1.0f ? STEER_RESPONSE * deltaTime : 1.0f;
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (!model.enemies[i].active) continue;
+		const Enemy* enemy = &model.enemies[i];
+		Vector2 current = model.steering[i].velocity;
+		short neighbours[MAX_ENEMIES];
+		int count = crowdNeighbours(&crowd, &model, i, tileSize, neighbours, MAX_ENEMIES);
+		Vector2 separation = { 0, 0 }, alignment = { 0, 0 };
+		int aligned = 0;
+		for (int n = 0; n < count; n++) {
+			const Enemy* other = &model.enemies[neighbours[n]];
+			float dx = enemy->position.x - other->position.x, dy = enemy->position.y - other->position.y;
+			float distance = simLength((Vector2) { dx, dy });
+			if (distance >= size) continue;
+			float push = (size - distance) / size;  // 1 when stacked, 0 when just touching
+			if (distance <= 0) {
+				// Stacked exactly, the lower index steps left
+				dx = i < neighbours[n] ? -1.0f : 1.0f;
+				dy = 0;
+				distance = 1.0f;
+			}
+			separation.x += dx / distance * push * speed;
+			separation.y += dy / distance * push * speed;
+			alignment.x += model.steering[neighbours[n]].velocity.x;
+			alignment.y += model.steering[neighbours[n]].velocity.y;
+			aligned++;
+		}
+		Vector2 steer = { desired[i].x + separation.x * STEER_SEPARATION, desired[i].y + separation.y * STEER_SEPARATION };
+		if (aligned > 0) {
+			steer.x += (alignment.x / aligned - current.x) * STEER_ALIGNMENT;
+			steer.y += (alignment.y / aligned - current.y) * STEER_ALIGNMENT;
+		}
+		float length = simLength(steer);
+		if (length > speed) {
+			steer.x *= speed / length;
+			steer.y *= speed / length;
+		}
+		velocity[i] = (Vector2){ current.x + (steer.x - current.x) * response, current.y + (steer.y - current.y) * response };
+	}
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (!model.enemies[i].active) continue;
+		model.steering[i].velocity = velocity[i];
+		moveEnemy(&model.enemies[i], (Vector2) { velocity[i].x * deltaTime, velocity[i].y * deltaTime }, size, tileSize);
+	}
+
+	// One relaxation pass: split whatever overlap is left between each pair, along the
+	// shallower axis. Whoever would end up in a wall leaves the whole move to the other.
+	crowdBuild(&crowd, &model, tileSize);
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (!model.enemies[i].active) continue;
+		short neighbours[MAX_ENEMIES];
+		int count = crowdNeighbours(&crowd, &model, i, tileSize, neighbours, MAX_ENEMIES);
+		for (int n = 0; n < count; n++) {
+			int j = neighbours[n];
+			if (j < i) continue;
+			Enemy* a = &model.enemies[i];
+			Enemy* b = &model.enemies[j];
+			float dx = b->position.x - a->position.x, dy = b->position.y - a->position.y;
+			float overlapX = size - fabsf(dx), overlapY = size - fabsf(dy);
+			if (overlapX <= 0 || overlapY <= 0) continue;
+			Vector2 split = overlapX < overlapY
+				? (Vector2){ (dx < 0 ? -overlapX : overlapX) / 2, 0 }
+				: (Vector2){ 0, (dy < 0 ? -overlapY : overlapY) / 2 };
+			Vector2 aTo = { a->position.x - split.x, a->position.y - split.y };
+			Vector2 bTo = { b->position.x + split.x, b->position.y + split.y };
+			bool aFits = enemyFits(aTo, size, tileSize), bFits = enemyFits(bTo, size, tileSize);
+			if (aFits && bFits) {
+				a->position = aTo;
+				b->position = bTo;
+			}
+			else if (aFits) {
+				a->position = (Vector2){ aTo.x - split.x, aTo.y - split.y };
+				if (!enemyFits(a->position, size, tileSize)) a->position = aTo;
+			}
+			else if (bFits) {
+				b->position = (Vector2){ bTo.x + split.x, bTo.y + split.y };
+				if (!enemyFits(b->position, size, tileSize)) b->position = bTo;
+			}
+		}
+	}
+
+	// Players do not give way: an enemy that reached one attacks, then steps back out
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (!model.enemies[i].active) continue;
+		Enemy* enemy = &model.enemies[i];
+		Rectangle enemyRect = { enemy->position.x, enemy->position.y, size, size };
+		int touchedPlayer = overlappingPlayer(&model, enemyRect, CounterRectsEnemies);
+		if (touchedPlayer < 0) continue;
+		if (enemy->attackCooldown <= 0) {
+			raiseEvent((GameEvent) { .key = eventKey(SystemEnemies, i), .type = EventDamagePlayer, .target = touchedPlayer, .amount = 1, .particleCount = 10 });
+			enemy->attackCooldown = 1.0f;
+		}
+		Rectangle player = playerBounds(&model.players[touchedPlayer]);
+		float left = enemyRect.x + size - player.x, right = player.x + player.width - enemyRect.x;
+		float up = enemyRect.y + size - player.y, down = player.y + player.height - enemyRect.y;
+		float least = fminf(fminf(left, right), fminf(up, down));
+		Vector2 out = least == left ? (Vector2){ -left, 0 } : least == right ? (Vector2){ right, 0 } : least == up ? (Vector2){ 0, -up } : (Vector2){ 0, down };
+		Vector2 to = { enemy->position.x + out.x, enemy->position.y + out.y };
+		if (enemyFits(to, size, tileSize)) enemy->position = to;
+	}
+
+	return model;
+}
+	
+
+GameModel updateBullets(GameModel model, const PlayerInput inputs[], float deltaTime, int tileSize)
+{
+	for (int p = 0; p < model.playerCount; p++) {
+		if (!(inputs[p] & InputFire)) continue;
+		Player* player = &model.players[p];
+		for (int i = p * MAX_BULLETS; i < p * MAX_BULLETS + model.limits.bulletsPerPlayer; i++) {
+			if (!model.bullets[i].active) {
+				model.bullets[i].position = (Vector2){ player->position.x + player->size / 2, player->position.y + player->size / 2 };
+				model.bullets[i].directionX = (signed char)player->direction.x;
+				model.bullets[i].directionY = (signed char)player->direction.y;
+				model.bullets[i].active = true;
+				break;
+			}
+		}
+	}
+
+	// Wake whatever sleeps along this tick's bullet paths before deciding what they can hit
+	for (int i = 0; i < BULLET_POOL; i++) {
+		if (!model.bullets[i].active) continue;
+		float halfSize = model.kinds[KindBullet].size / 2.0f;
+		float stepX = model.bullets[i].directionX * model.kinds[KindBullet].speed * deltaTime;
+		float stepY = model.bullets[i].directionY * model.kinds[KindBullet].speed * deltaTime;
+		Rectangle path = {
+			model.bullets[i].position.x + fminf(stepX, 0.0f), model.bullets[i].position.y + fminf(stepY, 0.0f),
+			model.kinds[KindBullet].size + fabsf(stepX), model.kinds[KindBullet].size + fabsf(stepY)
+		};
+		wakeArea(&model, path, halfSize, tileSize);
+	}
+
+	// Index everything a bullet can hit this tick so each bullet only looks at the tiles it crosses
+	SpatialGrid grid;
+	int enemyEntry[MAX_ENEMIES];
+	int crateEntry[MAX_CRATES];
+	int enemyHealth[MAX_ENEMIES];  // Health once this tick's hits land, so later bullets pass through kills
+	int crateHealth[MAX_CRATES];
+
+	gridClear(&grid, MAX_ENEMIES + model.sleep.awakeCrateCount);
+	for (int j = 0; j < MAX_ENEMIES; j++) {
+		enemyEntry[j] = -1;
+		enemyHealth[j] = model.enemies[j].health;
+		if (model.enemies[j].active) {
+			enemyEntry[j] = gridAdd(&grid, (Rectangle) { model.enemies[j].position.x, model.enemies[j].position.y, model.kinds[KindEnemy].size, model.kinds[KindEnemy].size }, HitEnemy, j, spriteHitMask(SpriteEnemy));
+		}
+	}
+	for (int k = 0; k < model.sleep.awakeCrateCount; k++) {
+		int j = model.sleep.awakeCrates[k];
+		crateHealth[j] = model.crates[j].health;
+		if (model.crates[j].active) {
+			crateEntry[j] = gridAdd(&grid, (Rectangle) { model.crates[j].position.x, model.crates[j].position.y, model.kinds[KindCrate].size, model.kinds[KindCrate].size }, HitCrate, j, 0);
+		}
+	}
+	gridBuild(&grid, tileSize, model.kinds[KindBullet].size / 2.0f);
+
+	for (int i = 0; i < BULLET_POOL; i++) {
+		if (model.bullets[i].active) {
+			MARK_DIRTY(model, SectionBullets);
+
+			// Sweep the bullet's center over the whole step instead of testing only where it lands
+			float halfSize = model.kinds[KindBullet].size / 2.0f;
+			Vector2 from = { model.bullets[i].position.x + halfSize, model.bullets[i].position.y + halfSize };
+			Vector2 to = {
+				from.x + model.bullets[i].directionX * model.kinds[KindBullet].speed * deltaTime,
+				from.y + model.bullets[i].directionY * model.kinds[KindBullet].speed * deltaTime
+			};
+			SweepHit hit = sweepGrid(&grid, from, to, halfSize, tileSize);
+
+			model.bullets[i].position.x = from.x + (to.x - from.x) * hit.t - halfSize;
+			model.bullets[i].position.y = from.y + (to.y - from.y) * hit.t - halfSize;
+			if (hit.kind == HitNone) continue;
+
+			model.bullets[i].active = false;
+
+			if (hit.kind == HitWall) {
+				raiseEvent((GameEvent) {
+					.key = eventKey(SystemBullets, i), .type = EventSpawnParticles, .amount = 3, .color = GRAY,
+					.position = (Vector2){ from.x + (to.x - from.x) * hit.t, from.y + (to.y - from.y) * hit.t }
+				});
+			}
+			else if (hit.kind == HitEnemy) {
+				int j = hit.index;
+				raiseEvent((GameEvent) { .key = eventKey(SystemBullets, i), .type = EventDamageEnemy, .target = j, .amount = 1, .particleCount = 5 });
+				if (--enemyHealth[j] <= 0) {
+					gridRemove(&grid, enemyEntry[j]);
+				}
+			}
+			else if (hit.kind == HitCrate) {
+				int j = hit.index;
+				raiseEvent((GameEvent) { .key = eventKey(SystemBullets, i), .type = EventDamageCrate, .target = j, .amount = 1, .particleCount = 10 });
+				if (--crateHealth[j] <= 0) {
+					gridRemove(&grid, crateEntry[j]);
+				}
+			}
+		}
+	}
+	return model;
+}
+
+GameModel updateSword(GameModel model, int p, PlayerInput input, float deltaTime, int tileSize)
+{
+	Player* player = &model.players[p];
+	Sword* sword = &player->sword;
+
+	if (sword->cooldown > 0.0f) {
+		sword->cooldown -= deltaTime;
+	}
+
+	if (sword->active) {
+		sword->duration -= deltaTime;
+		if (sword->duration <= 0.0f) {
+			sword->active = false;
+		}
+	}
+
+	// Sword attack logic
+	if ((input & InputSword) && sword->cooldown <= 0.0f) {
+		sword->active = true;
+		sword->cooldown = SWORD_COOLDOWN;
+		sword->duration = SWORD_DURATION;
+
+		// Adjust sword orientation based on player direction
+		float swordOffset = player->size / 3; // Make the sword closer by reducing the offset
+
+		if (player->direction.y != 0) { // Moving up or down (vertical sword)
+			sword->size = (Vector2){ SWORD_WIDTH, SWORD_HEIGHT };
+			sword->position = (Vector2){
+				player->position.x + player->size / 2 - sword->size.x / 2,
+				player->position.y + player->size / 2 + player->direction.y * (player->size - swordOffset)
+			};
+		}
+		else if (player->direction.x != 0) { // Moving left or right (horizontal sword)
+			sword->size = (Vector2){ SWORD_HEIGHT, SWORD_WIDTH };
+			sword->position = (Vector2){
+				player->position.x + player->size / 2 + player->direction.x * (player->size - swordOffset),
+				player->position.y + player->size / 2 - sword->size.y / 2
+			};
+		}
+
+		// Sword hitbox (centered on the position)
+		Rectangle swordRect = {
+			sword->position.x - sword->size.x / 2,
+			sword->position.y - sword->size.y / 2,
+			sword->size.x, sword->size.y
+		};
+
+		// Check for collisions with enemies
+		BoxBatch boxes;
+		enemyBoxes(&model, &boxes);
+		uint64_t hits[BOX_MASK_WORDS];
+		boxBatchOverlaps(&boxes, swordRect, hits);
+		counterAdd(CounterRectsSword, boxes.count);
+		for (int w = 0; w < BOX_MASK_WORDS; w++) {
+			for (uint64_t bits = hits[w]; bits != 0; bits &= bits - 1) {
+				int i = w * 64 + lowestBit64(bits);
+				if (!(spriteHitMask(SpriteEnemy) & rectMask(swordRect, model.enemies[i].position))) continue;  // Only grazed empty cells
+				raiseEvent((GameEvent) { .key = eventKey(SystemSword, p * MAX_ENEMIES + i), .type = EventDamageEnemy, .target = i, .amount = 1, .particleCount = 10 });
+			}
+		}
+	}
+
+	return model;
+}
+
+
+GameModel updateNpcs(GameModel model, float deltaTime, int tileSize)
+{
+
+}
+
+
+// Resolve everything the systems raised this tick, in a fixed order independent of raise order
+GameModel applyEvents(GameModel model, int tileSize)
+{
+	GameEvent* events = activeEvents->events;
+	int count = activeEvents->count;
+	*activeEvents = (EventQueue){ 0 };
+	if (count > 0) qsort(events, count, sizeof(GameEvent), compareEvents);
+
+	for (int e = 0; e < count; e++) {
+		GameEvent* event = &events[e];
+		switch (event->type) {
+		case EventDamageEnemy: {
+			Enemy* target = &model.enemies[event->target];
+			if (!target->active) break;
+			MARK_DIRTY(model, SectionEnemies);
+			float size = model.kinds[KindEnemy].size;
+			target->health -= event->amount;
+			spawnDamageParticle((Vector2) { target->position.x + size / 2, target->position.y }, event->amount, RED);
+			spawnParticles(&model.rngState, (Vector2) { target->position.x + size / 2, target->position.y + size / 2 }, event->particleCount, RED);
+			if (target->health <= 0) {
+				target->active = false;
+				model.killCount++;
+				questNotify(&model, TriggerKill, -1);
+			}
+			break;
+		}
+		case EventDamagePlayer: {
+			Player* target = &model.players[event->target];
+			target->health -= event->amount;
+			spawnDamageParticle((Vector2) { target->position.x + target->size / 2, target->position.y }, event->amount, BLUE);
+			spawnParticles(&model.rngState, (Vector2) { target->position.x + target->size / 2, target->position.y + target->size / 2 }, event->particleCount, BLUE);
+			break;
+		}
+		case EventDamageCrate:
+			MARK_DIRTY(model, SectionCrates);
+			model = damageCrate(model, event->target, event->amount, event->particleCount, tileSize);
+			break;
+		case EventCollectGold:
+			model.goldCollected++;
+			spawnParticles(&model.rngState, event->position, 20, GOLD);
+			questNotify(&model, TriggerGold, -1);
+			break;
+		case EventSpawnParticles:
+			spawnParticles(&model.rngState, event->position, event->amount, event->color);
+			break;
+		case EventInteract:
+			questNotify(&model, TriggerInteract, event->target);
+			break;
+		}
+	}
+	return model;
+}
+
+// inputs holds one entry per player; nothing in here may read the keyboard or the clock
+GameModel update(GameModel model, const PlayerInput inputs[], float deltaTime, int tileSize)
+{
+	scratchReset();  // Nothing from last tick's scratch is still referenced
+	for (int p = 0; p < model.playerCount; p++) {
+		model = updatePlayerMovement(model, p, inputs[p], deltaTime, tileSize);
+	}
+	updateFieldOfView(&model, tileSize);
+	updateInfluence(&model, tileSize);
+	model = updateEnemies(model, deltaTime, tileSize);
+	model = updateBullets(model, inputs, deltaTime, tileSize);
+	for (int p = 0; p < model.playerCount; p++) {
+		model = updateSword(model, p, inputs[p], deltaTime, tileSize);
+	}
+	model = updateCrates(model, tileSize);
+	model = updateGold(model, tileSize);
+	updateMotion(&model.ecs, deltaTime);
+	updateDrag(&model.ecs);
+	settleGold(&model, tileSize);
+	updateLifetimes(&model.ecs, deltaTime);
+	model = updateStage(model, deltaTime, tileSize);
+	for (int p = 0; p < model.playerCount; p++) {
+		Player* player = &model.players[p];
+		player->activeDialog = NULL;
+		for (unsigned int awake = model.sleep.npcAwake; awake != 0; awake &= awake - 1) {
+			int i = lowestBit(awake);
+			counterAdd(CounterRectsNpcs, 1);
+			if (CheckCollisionRecs(playerBounds(player),
+					(Rectangle) {
+				model.npcs[i].position.x, model.npcs[i].position.y, model.npcs[i].size, model.npcs[i].size
+			})) {
+				player->activeDialog = model.npcs[i].dialog;
+				if (inputs[p] & InputInteract) {
+					raiseEvent((GameEvent) { .key = eventKey(SystemNpcs, p), .type = EventInteract, .target = (short)i });
+				}
+				break;
+			}
+		}
+	}
+	model = applyEvents(model, tileSize);
+	settleCrates(&model, tileSize);
+	if (ecsCommands.count > 0 || ecsCount(&model.ecs, 0) > 0) {
+		MARK_DIRTY(model, SectionEcs);
+	}
+	ecsFlush(&model.ecs, &ecsCommands);
+
+	counterMax(CounterParticles, ecsCount(&model.ecs, ARCHETYPE_PARTICLE));
+	counterMax(CounterDamageText, ecsCount(&model.ecs, ARCHETYPE_DAMAGE_TEXT));
+	counterMax(CounterGold, ecsCount(&model.ecs, COMPONENT(ComponentPickup)));
+	int bullets = 0;
+	for (int i = 0; i < BULLET_POOL; i++) bullets += model.bullets[i].active;
+	counterMax(CounterBullets, bullets);
+	countersPublish();
+	return model;
+}
+
+// The only place the keyboard is read, update() sees nothing but these bits
+PlayerInput readLocalInput(void) {
+	PlayerInput input = 0;
+	if (IsKeyDown(KEY_RIGHT)) input |= InputRight;
+	if (IsKeyDown(KEY_LEFT)) input |= InputLeft;
+	if (IsKeyDown(KEY_UP)) input |= InputUp;
+	if (IsKeyDown(KEY_DOWN)) input |= InputDown;
+	if (IsKeyPressed(KEY_SPACE)) input |= InputFire;
+	if (IsKeyDown(KEY_C)) input |= InputSword;
+	if (IsKeyPressed(KEY_E)) input |= InputInteract;
+	return input;
+}
+
+#pragma region Snapshots
+
+#define SNAPSHOT_GROUPS 4  // Keyframe groups kept, the ring covers SNAPSHOT_GROUPS * SNAPSHOT_KEYFRAME_INTERVAL ticks
+#define SNAPSHOT_KEYFRAME_INTERVAL 16
+#define SNAPSHOT_GROUP_BYTES (64 * 1024)  // Delta payload per group, a full group starts a new keyframe early
+#define SNAPSHOT_BLOCK_BYTES 64  // Granularity of the change scan
+
+// A keyframe and the ticks after it, each stored as the blocks that changed since the tick before
+typedef struct SnapshotGroup {
+	int firstTick;
+	int tickCount;
+	GameModel keyframe;
+	int deltaEnd[SNAPSHOT_KEYFRAME_INTERVAL];  // End of each tick's delta in payload, [0] is the keyframe itself
+	int payloadSize;
+	unsigned char payload[SNAPSHOT_GROUP_BYTES];
+} SnapshotGroup;
+
+typedef struct SnapshotRing {
+	SnapshotGroup groups[SNAPSHOT_GROUPS];
+	int newest;  // Group holding the newest tick, -1 when empty
+	int count;
+	GameModel last;  // State of the newest tick, what the next delta is taken against
+	int lastTick;
+	int lastCaptureBytes;  // Payload written by the latest capture, sizeof(GameModel) for keyframes
+} SnapshotRing;
+
+// Record header inside a delta: `length` bytes at `offset` follow it
+typedef struct SnapshotRecord {
+	unsigned int offset;
+	unsigned int length;
+} SnapshotRecord;
+
+void snapshotInit(SnapshotRing* ring) {
+	ring->newest = -1;
+	ring->count = 0;
+	ring->lastTick = -1;
+	ring->lastCaptureBytes = 0;
+}
+
+// Byte range of a section inside GameModel. The ECS range stops after the chunks in use.
+void snapshotSectionRange(const GameModel* model, int section, size_t* offset, size_t* size) {
+	switch (section) {
+	case SectionCore: *offset = 0; *size = offsetof(GameModel, enemies); break;
+	case SectionEnemies: *offset = offsetof(GameModel, enemies); *size = offsetof(GameModel, bullets) - offsetof(GameModel, enemies); break;  // Steering too
+	case SectionBullets: *offset = offsetof(GameModel, bullets); *size = sizeof(model->bullets); break;
+	case SectionCrates: *offset = offsetof(GameModel, crates); *size = sizeof(model->crates); break;
+	case SectionNpcs: *offset = offsetof(GameModel, npcs); *size = sizeof(model->npcs); break;
+	case SectionSleep: *offset = offsetof(GameModel, sleep); *size = sizeof(model->sleep); break;
+	case SectionFov: *offset = offsetof(GameModel, fov); *size = sizeof(model->fov); break;
+	case SectionInfluence: *offset = offsetof(GameModel, influence); *size = sizeof(model->influence); break;
+	default:
+		*offset = offsetof(GameModel, ecs);
+		*size = offsetof(EcsWorld, chunks) + model->ecs.chunkCount * sizeof(EcsChunk);
+		break;
+	}
+}
+
+// Worst case payload of a delta over the dirty sections
+size_t snapshotDeltaBound(const GameModel* model, unsigned int dirty) {
+	size_t bound = 0;
+	for (int section = 0; section < SectionCount; section++) {
+		if (section != SectionCore && !(dirty & SECTION(section))) continue;
+		size_t offset, size;
+		snapshotSectionRange(model, section, &offset, &size);
+		bound += size + (size / SNAPSHOT_BLOCK_BYTES + 1) * sizeof(SnapshotRecord);
+	}
+	return bound;
+}
+
+// Append the blocks of the dirty sections that differ from `previous`, merging neighbouring blocks into one record
+int snapshotEncode(const GameModel* model, const GameModel* previous, unsigned int dirty, unsigned char* out) {
+	const unsigned char* current = (const unsigned char*)model;
+	const unsigned char* before = (const unsigned char*)previous;
+	int written = 0;
+
+	for (int section = 0; section < SectionCount; section++) {
+		if (section != SectionCore && !(dirty & SECTION(section))) continue;  // Untouched pools are never scanned
+		size_t offset, size;
+		snapshotSectionRange(model, section, &offset, &size);
+
+		size_t end = offset + size;
+		size_t block = offset;
+		while (block < end) {
+			size_t length = end - block < SNAPSHOT_BLOCK_BYTES ? end - block : SNAPSHOT_BLOCK_BYTES;
+			if (memcmp(current + block, before + block, length) == 0) {
+				block += length;
+				continue;
+			}
+			size_t runStart = block;
+			while (block < end) {
+				length = end - block < SNAPSHOT_BLOCK_BYTES ? end - block : SNAPSHOT_BLOCK_BYTES;
+				if (memcmp(current + block, before + block, length) == 0) break;
+				block += length;
+			}
+			SnapshotRecord record = { (unsigned int)runStart, (unsigned int)(block - runStart) };
+			memcpy(out + written, &record, sizeof(record));
+			memcpy(out + written + sizeof(record), current + runStart, record.length);
+			written += sizeof(record) + record.length;
+		}
+	}
+	return written;
+}
+
+void snapshotApply(GameModel* model, const unsigned char* delta, int size) {
+	int read = 0;
+	while (read < size) {
+		SnapshotRecord record;
+		memcpy(&record, delta + read, sizeof(record));
+		memcpy((unsigned char*)model + record.offset, delta + read + sizeof(record), record.length);
+		read += sizeof(record) + record.length;
+	}
+}
+
+void snapshotStartGroup(SnapshotRing* ring, const GameModel* model, int tick) {
+	ring->newest = (ring->newest + 1) % SNAPSHOT_GROUPS;
+	if (ring->count < SNAPSHOT_GROUPS) ring->count++;
+
+	SnapshotGroup* group = &ring->groups[ring->newest];
+	group->firstTick = tick;
+	group->tickCount = 1;
+	group->keyframe = *model;
+	group->deltaEnd[0] = 0;
+	group->payloadSize = 0;
+	ring->lastCaptureBytes = sizeof(GameModel);
+}
+
+// Store the state after `tick` and clear its dirty bits. Ticks must be captured in increasing order.
+void snapshotCapture(SnapshotRing* ring, GameModel* model, int tick) {
+	SnapshotGroup* group = ring->newest >= 0 ? &ring->groups[ring->newest] : NULL;
+	bool keyframe = group == NULL
+		|| group->tickCount >= SNAPSHOT_KEYFRAME_INTERVAL
+		|| tick != ring->lastTick + 1
+		|| group->payloadSize + snapshotDeltaBound(model, model->dirty) > SNAPSHOT_GROUP_BYTES;
+
+	if (keyframe) {
+		snapshotStartGroup(ring, model, tick);
+	}
+	else {
+		int written = snapshotEncode(model, &ring->last, model->dirty, group->payload + group->payloadSize);
+		group->payloadSize += written;
+		group->deltaEnd[group->tickCount++] = group->payloadSize;
+		ring->lastCaptureBytes = written;
+	}
+
+	ring->last = *model;
+	ring->lastTick = tick;
+	model->dirty = 0;
+}
+
+SnapshotGroup* snapshotFindGroup(SnapshotRing* ring, int tick, int* slot) {
+	for (int k = 0; k < ring->count; k++) {
+		int g = (ring->newest - k + SNAPSHOT_GROUPS) % SNAPSHOT_GROUPS;
+		SnapshotGroup* group = &ring->groups[g];
+		if (tick >= group->firstTick && tick < group->firstTick + group->tickCount) {
+			*slot = g;
+			return group;
+		}
+	}
+	return NULL;
+}
+
+// Rebuild the state after `tick`: its keyframe plus at most SNAPSHOT_KEYFRAME_INTERVAL - 1 small deltas
+bool snapshotLoad(SnapshotRing* ring, int tick, GameModel* out) {
+	int slot;
+	SnapshotGroup* group = snapshotFindGroup(ring, tick, &slot);
+	if (group == NULL) return false;
+
+	*out = group->keyframe;
+	int steps = tick - group->firstTick;
+	snapshotApply(out, group->payload, group->deltaEnd[steps]);
+	out->dirty = 0;
+	return true;
+}
+
+// Load `tick` and forget every tick after it, so simulation (or rollback resimulation) continues from there
+bool snapshotRewind(SnapshotRing* ring, int tick, GameModel* out) {
+	int slot;
+	SnapshotGroup* group = snapshotFindGroup(ring, tick, &slot);
+	if (group == NULL || !snapshotLoad(ring, tick, out)) return false;
+
+	while (ring->newest != slot) {
+		ring->newest = (ring->newest - 1 + SNAPSHOT_GROUPS) % SNAPSHOT_GROUPS;
+		ring->count--;
+	}
+	group->tickCount = tick - group->firstTick + 1;
+	group->payloadSize = group->deltaEnd[group->tickCount - 1];
+	ring->last = *out;
+	ring->lastTick = tick;
+	return true;
+}
+
+int snapshotOldestTick(const SnapshotRing* ring) {
+	if (ring->count == 0) return -1;
+	return ring->groups[(ring->newest - ring->count + 1 + SNAPSHOT_GROUPS) % SNAPSHOT_GROUPS].firstTick;
+}
+
+#pragma endregion
+
+#pragma region Lockstep
+
+#define LOCKSTEP_TICK_RATE 60
+#define LOCKSTEP_DT (1.0f / LOCKSTEP_TICK_RATE)  // Peers must all step with the same dt
+#define LOCKSTEP_INPUT_DELAY 3  // Ticks between sampling an input and simulating it, hides the round trip
+#define LOCKSTEP_REDUNDANCY 16  // Unconfirmed ticks repeated in every packet, so a lost packet costs nothing
+#define LOCKSTEP_WINDOW 128  // Ticks held by the input rings, must exceed delay + redundancy
+#define LOCKSTEP_MAX_CATCHUP 4  // Ticks a peer may simulate in one step after a stall
+#define LOCKSTEP_MAX_BACKLOG 0.25  // Seconds behind the tick clock a loop catches up on, more is dropped
+#define LOCKSTEP_MAX_LEAD (LOCKSTEP_WINDOW / 2)  // Sampled input may run this far ahead of the simulation
+#define LOCKSTEP_CHECKSUM_INTERVAL 30
+#define LOCKSTEP_CHECKSUM_SLOTS 8
+#define LOCKSTEP_PACKET_BYTES 512
+#define NO_TICK -1
+
+#if defined(_WIN32)
+typedef SOCKET NetSocket;
+#define NET_INVALID_SOCKET INVALID_SOCKET
+#else
+typedef int NetSocket;
+#define NET_INVALID_SOCKET -1
+#endif
+
+typedef struct sockaddr_in NetAddress;
+
+// Traffic through one socket. lossRate drops that share of outgoing packets to exercise
+// redundancy without a real network.
+typedef struct NetLink {
+	NetSocket socket;
+	float lossRate;
+	unsigned int lossRng;
+	long long bytesSent;
+	long long bytesReceived;
+	int packetsSent;
+	int packetsReceived;
+	int packetsDropped;
+} NetLink;
+
+// Seconds since some fixed point, for pacing ticks and timing. Wall time can be stepped by NTP
+// or the user, which would stall a tick loop or make it burst; this clock only runs forward.
+double monotonicNow(void) {
+#if defined(_WIN32)
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+void netSleep(double seconds) {
+	struct timespec duration = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+	thrd_sleep(&duration, NULL);
+}
+
+// Non-blocking UDP socket bound to port on every interface, 0 picks a free port
+NetSocket netOpen(unsigned short port) {
+#if defined(_WIN32)
+	static bool started = false;
+	if (!started) {
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0) return NET_INVALID_SOCKET;
+		started = true;
+	}
+#endif
+	NetSocket sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == NET_INVALID_SOCKET) return NET_INVALID_SOCKET;
+
+	NetAddress address = { 0 };
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+#if defined(_WIN32)
+	u_long nonBlocking = 1;
+	if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 || ioctlsocket(sock, FIONBIO, &nonBlocking) != 0) {
+		closesocket(sock);
+		return NET_INVALID_SOCKET;
+	}
+#else
+	if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) != 0) {
+		close(sock);
+		return NET_INVALID_SOCKET;
+	}
+#endif
+	return sock;
+}
+
+void netClose(NetSocket sock) {
+#if defined(_WIN32)
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+unsigned short netLocalPort(NetSocket sock) {
+	NetAddress address;
+	socklen_t length = sizeof(address);
+	if (getsockname(sock, (struct sockaddr*)&address, &length) != 0) return 0;
+	return ntohs(address.sin_port);
+}
+
+bool netResolve(const char* host, unsigned short port, NetAddress* out) {
+	struct addrinfo hints = { 0 };
+	struct addrinfo* result = NULL;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, NULL, &hints, &result) != 0 || result == NULL) return false;
+	*out = *(NetAddress*)result->ai_addr;
+	out->sin_port = htons(port);
+	freeaddrinfo(result);
+	return true;
+}
+
+bool netSameAddress(const NetAddress* a, const NetAddress* b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+void netSend(NetLink* link, const NetAddress* to, const unsigned char* data, int size) {
+	link->bytesSent += size;
+	link->packetsSent++;
+	if (link->lossRate > 0.0f && gameRand(&link->lossRng) < link->lossRate * GAME_RAND_MAX) {
+		link->packetsDropped++;
+		return;
+	}
+	sendto(link->socket, (const char*)data, size, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+// Size of the next pending datagram, -1 when none is waiting
+int netReceive(NetLink* link, NetAddress* from, unsigned char* data, int capacity) {
+	socklen_t length = sizeof(*from);
+	int size = (int)recvfrom(link->socket, (char*)data, capacity, 0, (struct sockaddr*)from, &length);
+	if (size < 0) return -1;
+	link->bytesReceived += size;
+	link->packetsReceived++;
+	return size;
+}
+
+// Packets are little-endian byte streams, never raw structs, so padding and byte order cannot differ between peers
+void putU8(unsigned char* data, int* at, unsigned int value) {
+	data[(*at)++] = (unsigned char)value;
+}
+
+void putU32(unsigned char* data, int* at, unsigned int value) {
+	for (int i = 0; i < 4; i++) data[(*at)++] = (unsigned char)(value >> (8 * i));
+}
+
+unsigned int getU8(const unsigned char* data, int* at) {
+	return data[(*at)++];
+}
+
+unsigned int getU32(const unsigned char* data, int* at) {
+	unsigned int value = 0;
+	for (int i = 0; i < 4; i++) value |= (unsigned int)data[(*at)++] << (8 * i);
+	return value;
+}
+
+typedef enum {
+	PacketInputs = 1,  // Client -> relay: type, player, confirmed, first tick, count, inputs[count], checksum tick, checksum
+	PacketFrames  // Relay -> client: type, player count, first tick, count, inputs[count][player count], desync tick
+} PacketType;
+
+#define INPUTS_HEADER_BYTES 11
+#define INPUTS_TRAILER_BYTES 8
+#define FRAMES_HEADER_BYTES 7
+#define FRAMES_TRAILER_BYTES 4
+
+// FNV-1a over the simulated state, field by field so padding and pointers never enter it
+unsigned int hashBytes(unsigned int hash, const void* data, size_t size) {
+	const unsigned char* bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+#define HASH_FIELD(hash, field) ((hash) = hashBytes((hash), &(field), sizeof(field)))
+
+unsigned int modelChecksum(const GameModel* model) {
+	unsigned int hash = 2166136261u;
+	for (int p = 0; p < model->playerCount; p++) {
+		const Player* player = &model->players[p];
+		HASH_FIELD(hash, player->position);
+		HASH_FIELD(hash, player->direction);
+		HASH_FIELD(hash, player->health);
+		HASH_FIELD(hash, player->sword.active);
+		HASH_FIELD(hash, player->sword.position);
+		HASH_FIELD(hash, player->sword.cooldown);
+	}
+	HASH_FIELD(hash, model->rngState);
+	HASH_FIELD(hash, model->enemySpawnTimer);
+	HASH_FIELD(hash, model->goldCollected);
+	HASH_FIELD(hash, model->stage);
+	HASH_FIELD(hash, model->killCount);
+	HASH_FIELD(hash, model->quest.node);
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		const Enemy* enemy = &model->enemies[i];
+		unsigned char active = enemy->active;
+		HASH_FIELD(hash, active);
+		if (!active) continue;
+		HASH_FIELD(hash, enemy->position);
+		HASH_FIELD(hash, enemy->health);
+		HASH_FIELD(hash, enemy->attackCooldown);
+	}
+	for (int i = 0; i < BULLET_POOL; i++) {
+		const Bullet* bullet = &model->bullets[i];
+		unsigned char active = bullet->active;
+		HASH_FIELD(hash, active);
+		if (active) HASH_FIELD(hash, bullet->position);
+	}
+	for (int i = 0; i < MAX_CRATES; i++) {
+		const Crate* crate = &model->crates[i];
+		unsigned char active = crate->active;
+		HASH_FIELD(hash, active);
+		if (active) HASH_FIELD(hash, crate->health);
+	}
+	for (int i = 0; i < MAX_NPCS; i++) {
+		HASH_FIELD(hash, model->npcs[i].position);
+	}
+	// ECS columns are tightly packed, so every live row can be hashed as raw bytes
+	const EcsWorld* world = &model->ecs;
+	for (int c = 0; c < world->chunkCount; c++) {
+		const EcsChunk* chunk = &world->chunks[c];
+		const EcsArchetype* archetype = &world->archetypes[chunk->archetype];
+		HASH_FIELD(hash, chunk->count);
+		for (int id = 0; id < ComponentCount; id++) {
+			if (!(archetype->mask & COMPONENT(id)) || componentSize[id] == 0) continue;
+			hash = hashBytes(hash, chunk->data + archetype->columnOffset[id], (size_t)componentSize[id] * chunk->count);
+		}
+	}
+	return hash;
+}
+
+// Collects every player's input for each tick and hands out a tick's frame once all of them
+// have arrived. It never simulates; desyncs are caught by comparing the clients' checksums.
+typedef struct LockstepRelay {
+	NetLink link;
+	int playerCount;
+	NetAddress clients[MAX_PLAYERS];
+	bool joined[MAX_PLAYERS];
+	int clientConfirmed[MAX_PLAYERS];  // Client holds every frame before this tick
+	PlayerInput inputs[LOCKSTEP_WINDOW][MAX_PLAYERS];
+	unsigned char received[LOCKSTEP_WINDOW];  // Bit per player whose input for the slot's tick arrived
+	int confirmed;  // Every input before this tick has arrived
+	int checksumTick[LOCKSTEP_CHECKSUM_SLOTS];
+	unsigned int checksums[LOCKSTEP_CHECKSUM_SLOTS][MAX_PLAYERS];
+	unsigned char checksumReceived[LOCKSTEP_CHECKSUM_SLOTS];
+	int desyncTick;  // Earliest tick whose checksums disagreed, NO_TICK while in sync
+} LockstepRelay;
+
+bool relayOpen(LockstepRelay* relay, unsigned short port, int playerCount) {
+	memset(relay, 0, sizeof(*relay));
+	relay->link.socket = netOpen(port);
+	relay->playerCount = playerCount;
+	// Nobody can have sampled input for the ticks inside the initial delay, they are empty frames
+	relay->confirmed = LOCKSTEP_INPUT_DELAY;
+	for (int p = 0; p < playerCount; p++) relay->clientConfirmed[p] = LOCKSTEP_INPUT_DELAY;
+	for (int k = 0; k < LOCKSTEP_CHECKSUM_SLOTS; k++) relay->checksumTick[k] = NO_TICK;
+	relay->desyncTick = NO_TICK;
+	return relay->link.socket != NET_INVALID_SOCKET;
+}
+
+void relayRecordChecksum(LockstepRelay* relay, int player, int tick, unsigned int checksum) {
+	if (tick == NO_TICK) return;
+	int slot = (tick / LOCKSTEP_CHECKSUM_INTERVAL) % LOCKSTEP_CHECKSUM_SLOTS;
+	if (relay->checksumTick[slot] != tick) {
+		relay->checksumTick[slot] = tick;
+		relay->checksumReceived[slot] = 0;
+	}
+	relay->checksums[slot][player] = checksum;
+	relay->checksumReceived[slot] |= 1u << player;
+	if (relay->checksumReceived[slot] != (1u << relay->playerCount) - 1) return;
+
+	for (int p = 1; p < relay->playerCount; p++) {
+		if (relay->checksums[slot][p] != relay->checksums[slot][0]) {
+			if (relay->desyncTick == NO_TICK || tick < relay->desyncTick) relay->desyncTick = tick;
+			break;
+		}
+	}
+}
+
+void relaySendFrames(LockstepRelay* relay, int player) {
+	unsigned char packet[LOCKSTEP_PACKET_BYTES];
+	int first = relay->clientConfirmed[player];
+	int count = relay->confirmed - first;
+	if (count > LOCKSTEP_REDUNDANCY) count = LOCKSTEP_REDUNDANCY;
+
+	int at = 0;
+	putU8(packet, &at, PacketFrames);
+	putU8(packet, &at, relay->playerCount);
+	putU32(packet, &at, first);
+	putU8(packet, &at, count);
+	for (int k = 0; k < count; k++) {
+		for (int p = 0; p < relay->playerCount; p++) putU8(packet, &at, relay->inputs[(first + k) % LOCKSTEP_WINDOW][p]);
+	}
+	putU32(packet, &at, (unsigned int)relay->desyncTick);
+	netSend(&relay->link, &relay->clients[player], packet, at);
+}
+
+// Drain the socket, answering every input packet with the frames that client still lacks
+void relayPoll(LockstepRelay* relay) {
+	unsigned char packet[LOCKSTEP_PACKET_BYTES];
+	NetAddress from;
+	int size;
+	while ((size = netReceive(&relay->link, &from, packet, sizeof(packet))) >= 0) {
+		int at = 0;
+		if (size < INPUTS_HEADER_BYTES || getU8(packet, &at) != PacketInputs) continue;
+		int player = getU8(packet, &at);
+		int confirmed = (int)getU32(packet, &at);
+		int first = (int)getU32(packet, &at);
+		int count = getU8(packet, &at);
+		if (player >= relay->playerCount || size != INPUTS_HEADER_BYTES + count + INPUTS_TRAILER_BYTES) continue;
+		if (relay->joined[player] && !netSameAddress(&from, &relay->clients[player])) continue;
+		relay->clients[player] = from;
+		relay->joined[player] = true;
+		if (confirmed > relay->clientConfirmed[player] && confirmed <= relay->confirmed) relay->clientConfirmed[player] = confirmed;
+
+		// A slot is only reused once every client holds the frame it last carried
+		int oldestNeeded = relay->confirmed;
+		for (int p = 0; p < relay->playerCount; p++) {
+			if (relay->clientConfirmed[p] < oldestNeeded) oldestNeeded = relay->clientConfirmed[p];
+		}
+		for (int k = 0; k < count; k++) {
+			int tick = first + k;
+			PlayerInput input = getU8(packet, &at);
+			if (tick < relay->confirmed || tick >= oldestNeeded + LOCKSTEP_WINDOW) continue;
+			int slot = tick % LOCKSTEP_WINDOW;
+			relay->inputs[slot][player] = input;
+			relay->received[slot] |= 1u << player;
+		}
+		unsigned char everyone = (1u << relay->playerCount) - 1;
+		while (relay->received[relay->confirmed % LOCKSTEP_WINDOW] == everyone) {
+			relay->received[relay->confirmed % LOCKSTEP_WINDOW] = 0;
+			relay->confirmed++;
+		}
+
+		int checksumTick = (int)getU32(packet, &at);
+		unsigned int checksum = getU32(packet, &at);
+		relayRecordChecksum(relay, player, checksumTick, checksum);
+		relaySendFrames(relay, player);
+	}
+}
+
+// One peer: samples local input, sends it ahead with the unconfirmed tail, and simulates a tick
+// only once the relay has returned every player's input for it.
+typedef struct LockstepClient {
+	NetLink link;
+	NetAddress relay;
+	int player;
+	int tileSize;
+	GameModel model;
+	int tick;  // Next tick to simulate
+	int confirmed;  // Frames for every tick before this have arrived
+	int newestInput;  // Latest tick holding a sampled local input
+	PlayerInput frames[LOCKSTEP_WINDOW][MAX_PLAYERS];
+	PlayerInput localInputs[LOCKSTEP_WINDOW];
+	double sampledAt[LOCKSTEP_WINDOW];
+	int checksumTick;  // Latest checksum, repeated in every packet until the next one
+	unsigned int checksum;
+	int desyncTick;  // As reported by the relay
+	int stalls;  // Steps spent waiting for a frame
+	double latencyTotal;  // Seconds from sampling an input to simulating it
+	double latencyMax;
+	int latencyCount;
+} LockstepClient;
+
+bool lockstepConnect(LockstepClient* client, const char* host, unsigned short port, int player, int playerCount, int tileSize) {
+	memset(client, 0, sizeof(*client));
+	client->link.socket = netOpen(0);
+	client->player = player;
+	client->tileSize = tileSize;
+	client->model = setup(tileSize, playerCount, GAME_DEFAULT_SEED);
+	client->confirmed = LOCKSTEP_INPUT_DELAY;
+	client->newestInput = LOCKSTEP_INPUT_DELAY - 1;
+	client->checksumTick = NO_TICK;
+	client->desyncTick = NO_TICK;
+	return client->link.socket != NET_INVALID_SOCKET && netResolve(host, port, &client->relay);
+}
+
+void lockstepReceive(LockstepClient* client) {
+	unsigned char packet[LOCKSTEP_PACKET_BYTES];
+	NetAddress from;
+	int size;
+	int playerCount = client->model.playerCount;
+	while ((size = netReceive(&client->link, &from, packet, sizeof(packet))) >= 0) {
+		int at = 0;
+		if (!netSameAddress(&from, &client->relay)) continue;
+		if (size < FRAMES_HEADER_BYTES || getU8(packet, &at) != PacketFrames || (int)getU8(packet, &at) != playerCount) continue;
+		int first = (int)getU32(packet, &at);
+		int count = getU8(packet, &at);
+		if (size != FRAMES_HEADER_BYTES + count * playerCount + FRAMES_TRAILER_BYTES) continue;
+		for (int k = 0; k < count; k++) {
+			// Frames arrive in order from our last acknowledged tick, anything else is a stale duplicate
+			if (first + k == client->confirmed) {
+				memcpy(client->frames[client->confirmed % LOCKSTEP_WINDOW], packet + at, playerCount);
+				client->confirmed++;
+			}
+			at += playerCount;
+		}
+		int desyncTick = (int)getU32(packet, &at);
+		if (desyncTick != NO_TICK) client->desyncTick = desyncTick;
+	}
+}
+
+void lockstepSendInputs(LockstepClient* client) {
+	unsigned char packet[LOCKSTEP_PACKET_BYTES];
+	int first = client->newestInput - LOCKSTEP_REDUNDANCY + 1;
+	if (first < client->confirmed) first = client->confirmed;
+	int count = client->newestInput - first + 1;
+
+	int at = 0;
+	putU8(packet, &at, PacketInputs);
+	putU8(packet, &at, client->player);
+	putU32(packet, &at, client->confirmed);
+	putU32(packet, &at, first);
+	putU8(packet, &at, count);
+	for (int k = 0; k < count; k++) putU8(packet, &at, client->localInputs[(first + k) % LOCKSTEP_WINDOW]);
+	putU32(packet, &at, (unsigned int)client->checksumTick);
+	putU32(packet, &at, client->checksum);
+	netSend(&client->link, &client->relay, packet, at);
+}
+
+// One tick of the peer's clock: queue the local input, then simulate the ticks whose frames
+// have arrived. Input keeps being sampled at the tick rate through a stall, and the ticks
+// queued meanwhile are simulated a few per step afterwards, so a stalled peer catches up.
+// Returns whether input was queued; when it was not, the caller offers the same input again.
+bool lockstepStep(LockstepClient* client, PlayerInput input, double now) {
+	lockstepReceive(client);
+	bool sampled = false;
+	if (client->newestInput - client->tick < LOCKSTEP_MAX_LEAD) {
+		int tick = ++client->newestInput;
+		client->localInputs[tick % LOCKSTEP_WINDOW] = input;
+		client->sampledAt[tick % LOCKSTEP_WINDOW] = now;
+		sampled = true;
+	}
+	lockstepSendInputs(client);
+
+	if (client->tick >= client->confirmed) {
+		client->stalls++;
+		return sampled;
+	}
+	// Never run closer than the input delay to our own sampling, or the delay would quietly shrink
+	for (int step = 0; step < LOCKSTEP_MAX_CATCHUP && client->tick < client->confirmed && client->tick + LOCKSTEP_INPUT_DELAY <= client->newestInput; step++) {
+		int slot = client->tick % LOCKSTEP_WINDOW;
+		client->model = update(client->model, client->frames[slot], LOCKSTEP_DT, client->tileSize);
+		if (client->tick >= LOCKSTEP_INPUT_DELAY) {
+			double latency = now - client->sampledAt[slot];
+			client->latencyTotal += latency;
+			client->latencyCount++;
+			if (latency > client->latencyMax) client->latencyMax = latency;
+		}
+		if (client->tick % LOCKSTEP_CHECKSUM_INTERVAL == 0) {
+			client->checksumTick = client->tick;
+			client->checksum = modelChecksum(&client->model);
+		}
+		client->tick++;
+	}
+	return sampled;
+}
+
+// Wandering bot: holds a random direction for a while, fires and swings now and then
+PlayerInput botInput(unsigned int* rng, PlayerInput* held) {
+	if (gameRand(rng) % 20 == 0) {
+		static const PlayerInput directions[] = { 0, InputRight, InputLeft, InputUp, InputDown, InputRight | InputUp, InputLeft | InputDown };
+		*held = directions[gameRand(rng) % (int)(sizeof(directions) / sizeof(directions[0]))];
+	}
+	PlayerInput input = *held;
+	if (gameRand(rng) % 30 == 0) input |= InputFire;
+	if (gameRand(rng) % 40 == 0) input |= InputSword;
+	if (gameRand(rng) % 60 == 0) input |= InputInteract;
+	return input;
+}
+
+// Relay and every client in one thread over loopback, in real time. desyncAt >= 0 nudges
+// one client's state at that tick; the run passes when a desync is reported exactly then.
+int runLockstepTest(int playerCount, float seconds, float lossRate, int desyncAt, int tileSize) {
+	static LockstepRelay relay;
+	static LockstepClient clients[MAX_PLAYERS];
+	unsigned int botRng[MAX_PLAYERS];
+	PlayerInput held[MAX_PLAYERS] = { 0 };
+	PlayerInput pending[MAX_PLAYERS];
+	bool havePending[MAX_PLAYERS] = { 0 };
+	bool injected = false;
+
+	if (!relayOpen(&relay, 0, playerCount)) {
+		printf("lockstep: cannot open relay socket\n");
+		return 1;
+	}
+	relay.link.lossRate = lossRate;
+	relay.link.lossRng = 0x51EDu;
+	for (int p = 0; p < playerCount; p++) {
+		if (!lockstepConnect(&clients[p], "127.0.0.1", netLocalPort(relay.link.socket), p, playerCount, tileSize)) {
+			printf("lockstep: cannot open client socket\n");
+			return 1;
+		}
+		clients[p].link.lossRate = lossRate;
+		clients[p].link.lossRng = 0xC0FFEEu + p;
+		botRng[p] = 0x1234567u * (p + 1);
+	}
+
+	double start = monotonicNow();
+	double nextTick = start;
+	double now;
+	while ((now = monotonicNow()) - start < seconds) {
+		relayPoll(&relay);
+		if (now < nextTick) {
+			netSleep(0.0005);
+			continue;
+		}
+		nextTick += LOCKSTEP_DT;
+		for (int p = 0; p < playerCount; p++) {
+			if (!havePending[p]) {
+				pending[p] = botInput(&botRng[p], &held[p]);
+				havePending[p] = true;
+			}
+			if (lockstepStep(&clients[p], pending[p], now)) havePending[p] = false;
+			if (p == playerCount - 1 && !injected && clients[p].tick == desyncAt + 1) {
+				clients[p].model.rngState ^= 1;
+				injected = true;
+			}
+		}
+	}
+
+	long long clientSent = 0, clientReceived = 0;
+	int minTick = clients[0].tick, maxTick = clients[0].tick, stalls = 0, dropped = relay.link.packetsDropped;
+	double latencyTotal = 0.0, latencyMax = 0.0;
+	int latencyCount = 0;
+	for (int p = 0; p < playerCount; p++) {
+		LockstepClient* client = &clients[p];
+		clientSent += client->link.bytesSent;
+		clientReceived += client->link.bytesReceived;
+		stalls += client->stalls;
+		dropped += client->link.packetsDropped;
+		latencyTotal += client->latencyTotal;
+		latencyCount += client->latencyCount;
+		if (client->latencyMax > latencyMax) latencyMax = client->latencyMax;
+		if (client->tick < minTick) minTick = client->tick;
+		if (client->tick > maxTick) maxTick = client->tick;
+	}
+	float elapsed = (float)(monotonicNow() - start);
+
+	printf("lockstep: %d players, %.1f s, input delay %d ticks, redundancy %d, loss %.0f%%\n",
+		playerCount, elapsed, LOCKSTEP_INPUT_DELAY, LOCKSTEP_REDUNDANCY, lossRate * 100.0f);
+	printf("ticks simulated: %d..%d of %d, stalled steps %d, packets dropped %d\n",
+		minTick, maxTick, (int)(elapsed * LOCKSTEP_TICK_RATE), stalls, dropped);
+	printf("per client: up %.0f B/s, down %.0f B/s; relay: up %.0f B/s, down %.0f B/s\n",
+		clientSent / (double)playerCount / elapsed, clientReceived / (double)playerCount / elapsed,
+		relay.link.bytesSent / (double)elapsed, relay.link.bytesReceived / (double)elapsed);
+	printf("input to simulation: avg %.1f ms, max %.1f ms\n",
+		latencyCount > 0 ? latencyTotal / latencyCount * 1000.0 : 0.0, latencyMax * 1000.0);
+
+	bool passed;
+	if (relay.desyncTick == NO_TICK) {
+		printf("checksums: in sync\n");
+		passed = desyncAt < 0;
+	}
+	else {
+		printf("checksums: desync at tick %d\n", relay.desyncTick);
+		passed = desyncAt >= 0 && relay.desyncTick == (desyncAt / LOCKSTEP_CHECKSUM_INTERVAL + 1) * LOCKSTEP_CHECKSUM_INTERVAL;
+	}
+
+	for (int p = 0; p < playerCount; p++) netClose(clients[p].link.socket);
+	netClose(relay.link.socket);
+	return passed ? 0 : 1;
+}
+
+// Headless relay for real matches
+int runRelay(unsigned short port, int playerCount) {
+	static LockstepRelay relay;
+	if (!relayOpen(&relay, port, playerCount)) {
+		printf("relay: cannot open port %d\n", port);
+		return 1;
+	}
+	printf("relay: waiting for %d players on port %d\n", playerCount, port);
+	int reportedDesync = NO_TICK;
+	int reportedJoined = 0;
+	while (true) {
+		relayPoll(&relay);
+		int joined = 0;
+		for (int p = 0; p < playerCount; p++) joined += relay.joined[p];
+		if (joined != reportedJoined) {
+			printf("relay: %d of %d players joined\n", joined, playerCount);
+			reportedJoined = joined;
+		}
+		if (relay.desyncTick != reportedDesync) {
+			printf("relay: desync at tick %d\n", relay.desyncTick);
+			reportedDesync = relay.desyncTick;
+		}
+		netSleep(0.001);
+	}
+}
+
+#pragma endregion
+
+#pragma region Streaming
+
+// A world file is a grid of fixed-size chunks. The model only ever holds the window of
+// STREAM_WINDOW_X by STREAM_WINDOW_Y chunks that `map` covers, with every position relative to
+// the window's corner. A loader thread reads the chunks around the window before the player
+// gets there and writes back the ones the window leaves, so memory and per-tick cost are the
+// same whatever the size of the world.
+#define CHUNK_WIDTH 8
+#define CHUNK_HEIGHT 6
+#define STREAM_WINDOW_X (MAP_WIDTH / CHUNK_WIDTH)
+#define STREAM_WINDOW_Y (MAP_HEIGHT / CHUNK_HEIGHT)
+#define STREAM_CACHE_SLOTS ((STREAM_WINDOW_X + 2) * (STREAM_WINDOW_Y + 2))  // The window plus one chunk on every side
+// Tiles between the player and the window edge that shift the window by a chunk. More than half
+// the view, so the camera never shows past the window, and less than (window - chunk) / 2, so a
+// shift never lands the player on the opposite trigger.
+#define STREAM_EDGE_X 10.0f
+#define STREAM_EDGE_Y 5.5f
+// Every live crate and piece of gold could come to rest in one chunk, so a record holds the
+// whole pools: awake and sleeping gold have MAX_GOLD rows each. Both counts are single bytes.
+#define CHUNK_MAX_CRATES MAX_CRATES
+#define CHUNK_MAX_GOLD (2 * MAX_GOLD)
+#define WORLD_MAGIC 0x57505242u  // "BRPW"
+#define WORLD_VERSION 2  // 2: records sized for the whole crate and gold pools
+#define WORLD_HEADER_BYTES 24
+#define CHUNK_CRATE_BYTES 10
+#define CHUNK_RECORD_BYTES (CHUNK_WIDTH * CHUNK_HEIGHT + 2 + CHUNK_MAX_CRATES * CHUNK_CRATE_BYTES + CHUNK_MAX_GOLD * 8)
+
+typedef struct ChunkCrate {
+	Vector2 position;  // Tiles from the chunk's corner
+	short health;
+	bool hasGold;
+} ChunkCrate;
+
+// Tiles plus the entities that were resting in the chunk when it was stored
+typedef struct ChunkRecord {
+	char tiles[CHUNK_HEIGHT][CHUNK_WIDTH];
+	int crateCount;
+	int goldCount;
+	ChunkCrate crates[CHUNK_MAX_CRATES];
+	Vector2 gold[CHUNK_MAX_GOLD];  // Tiles from the chunk's corner
+} ChunkRecord;
+
+typedef enum {
+	ChunkFree,
+	ChunkLoading,  // The loader owns the record until it turns Ready
+	ChunkReady,  // The simulation owns the record, and it matches the file unless the chunk is in the window
+	ChunkSaving  // The loader owns the record until it turns Ready again
+} ChunkState;
+
+typedef struct ChunkSlot {
+	int x, y;  // World chunk, meaningless while Free
+	ChunkState state;
+	ChunkRecord record;
+} ChunkSlot;
+
+typedef struct ChunkStream {
+	FILE* file;  // Only the loader touches it once the stream is open
+	int chunksX, chunksY;
+	int originX, originY;  // World chunk at the window's top-left
+	ChunkSlot* window[STREAM_WINDOW_Y][STREAM_WINDOW_X];  // Always Ready
+	ChunkSlot slots[STREAM_CACHE_SLOTS];
+	bool wantsRequest;  // Some chunk around the window is still waiting for a slot
+	mtx_t lock;  // Guards slot states and stopping
+	cnd_t work;
+	cnd_t done;
+	bool stopping;
+	int loads, saves;
+	int lostCrates, lostGold;  // Left behind because their record was already full
+	thrd_t thread;
+} ChunkStream;
+
+unsigned int floatBits(float value) {
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+float bitsFloat(unsigned int bits) {
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Records are little-endian byte streams like packets, so world files move between machines.
+// Unused entity slots are written as zeros to keep every record the same size.
+void chunkEncode(const ChunkRecord* record, unsigned char* data) {
+	int at = 0;
+	memcpy(data, record->tiles, sizeof(record->tiles));
+	at += sizeof(record->tiles);
+	putU8(data, &at, record->crateCount);
+	putU8(data, &at, record->goldCount);
+	for (int i = 0; i < CHUNK_MAX_CRATES; i++) {
+		ChunkCrate crate = i < record->crateCount ? record->crates[i] : (ChunkCrate) { 0 };
+		putU32(data, &at, floatBits(crate.position.x));
+		putU32(data, &at, floatBits(crate.position.y));
+		putU8(data, &at, (unsigned int)crate.health);
+		putU8(data, &at, crate.hasGold);
+	}
+	for (int i = 0; i < CHUNK_MAX_GOLD; i++) {
+		Vector2 gold = i < record->goldCount ? record->gold[i] : (Vector2) { 0 };
+		putU32(data, &at, floatBits(gold.x));
+		putU32(data, &at, floatBits(gold.y));
+	}
+}
+
+void chunkDecode(const unsigned char* data, ChunkRecord* record) {
+	int at = 0;
+	for (int y = 0; y < CHUNK_HEIGHT; y++) {
+		for (int x = 0; x < CHUNK_WIDTH; x++) {
+			record->tiles[y][x] = data[at++] == '#' ? '#' : '.';
+		}
+	}
+	record->crateCount = (int)getU8(data, &at);
+	record->goldCount = (int)getU8(data, &at);
+	if (record->crateCount > CHUNK_MAX_CRATES) record->crateCount = CHUNK_MAX_CRATES;
+	if (record->goldCount > CHUNK_MAX_GOLD) record->goldCount = CHUNK_MAX_GOLD;
+	for (int i = 0; i < CHUNK_MAX_CRATES; i++) {
+		record->crates[i].position.x = bitsFloat(getU32(data, &at));
+		record->crates[i].position.y = bitsFloat(getU32(data, &at));
+		record->crates[i].health = (short)getU8(data, &at);
+		record->crates[i].hasGold = getU8(data, &at) != 0;
+	}
+	for (int i = 0; i < CHUNK_MAX_GOLD; i++) {
+		record->gold[i].x = bitsFloat(getU32(data, &at));
+		record->gold[i].y = bitsFloat(getU32(data, &at));
+	}
+}
+
+long chunkOffset(const ChunkStream* stream, int x, int y) {
+	return WORLD_HEADER_BYTES + ((long)y * stream->chunksX + x) * CHUNK_RECORD_BYTES;
+}
+
+// Loads before saves, since a load may be holding up a window shift
+ChunkSlot* streamNextJob(ChunkStream* stream) {
+	for (int s = 0; s < STREAM_CACHE_SLOTS; s++) {
+		if (stream->slots[s].state == ChunkLoading) return &stream->slots[s];
+	}
+	for (int s = 0; s < STREAM_CACHE_SLOTS; s++) {
+		if (stream->slots[s].state == ChunkSaving) return &stream->slots[s];
+	}
+	return NULL;
+}
+
+int streamLoaderMain(void* arg) {
+	ChunkStream* stream = arg;
+	unsigned char data[CHUNK_RECORD_BYTES];
+
+	mtx_lock(&stream->lock);
+	for (;;) {
+		ChunkSlot* slot = streamNextJob(stream);
+		if (slot == NULL) {
+			if (stream->stopping) break;
+			cnd_wait(&stream->work, &stream->lock);
+			continue;
+		}
+		ChunkState job = slot->state;
+		mtx_unlock(&stream->lock);
+
+		// The slot's state hands its record to this thread, so the file work runs unlocked
+		bool seeked = fseek(stream->file, chunkOffset(stream, slot->x, slot->y), SEEK_SET) == 0;
+		if (job == ChunkLoading) {
+			if (seeked && fread(data, 1, sizeof(data), stream->file) == sizeof(data)) {
+				chunkDecode(data, &slot->record);
+			}
+			else {
+				// Unreadable chunks come back as solid rock rather than stopping the game
+				memset(&slot->record, 0, sizeof(slot->record));
+				memset(slot->record.tiles, '#', sizeof(slot->record.tiles));
+			}
+		}
+		else {
+			chunkEncode(&slot->record, data);
+			if (seeked) fwrite(data, 1, sizeof(data), stream->file);
+			fflush(stream->file);
+		}
+
+		mtx_lock(&stream->lock);
+		slot->state = ChunkReady;
+		if (job == ChunkLoading) stream->loads++;
+		else stream->saves++;
+		cnd_broadcast(&stream->done);
+	}
+	mtx_unlock(&stream->lock);
+	return 0;
+}
+
+bool chunkInWindow(int x, int y, int originX, int originY) {
+	return x >= originX && x < originX + STREAM_WINDOW_X && y >= originY && y < originY + STREAM_WINDOW_Y;
+}
+
+// Cached chunks are the window and the ring around it
+bool chunkWanted(const ChunkStream* stream, int x, int y) {
+	return x >= stream->originX - 1 && x <= stream->originX + STREAM_WINDOW_X && y >= stream->originY - 1 && y <= stream->originY + STREAM_WINDOW_Y;
+}
+
+// Lock held
+ChunkSlot* streamFindSlot(ChunkStream* stream, int x, int y) {
+	for (int s = 0; s < STREAM_CACHE_SLOTS; s++) {
+		ChunkSlot* slot = &stream->slots[s];
+		if (slot->state != ChunkFree && slot->x == x && slot->y == y) return slot;
+	}
+	return NULL;
+}
+
+// Lock held. Queues a load for every wanted chunk that is not cached, reusing slots that hold
+// chunks no longer wanted. A slot still saving cannot be reused yet, so the next tick retries.
+void streamRequest(ChunkStream* stream) {
+	stream->wantsRequest = false;
+	for (int y = stream->originY - 1; y <= stream->originY + STREAM_WINDOW_Y; y++) {
+		for (int x = stream->originX - 1; x <= stream->originX + STREAM_WINDOW_X; x++) {
+			if (x < 0 || y < 0 || x >= stream->chunksX || y >= stream->chunksY) continue;
+			if (streamFindSlot(stream, x, y) != NULL) continue;
+
+			ChunkSlot* slot = NULL;
+			for (int s = 0; s < STREAM_CACHE_SLOTS && slot == NULL; s++) {
+				ChunkSlot* candidate = &stream->slots[s];
+				if (candidate->state == ChunkFree || (candidate->state == ChunkReady && !chunkWanted(stream, candidate->x, candidate->y))) slot = candidate;
+			}
+			if (slot == NULL) {
+				stream->wantsRequest = true;
+				continue;
+			}
+			slot->x = x;
+			slot->y = y;
+			slot->state = ChunkLoading;
+			cnd_signal(&stream->work);
+		}
+	}
+}
+
+// Lock held. Fills `window` when every chunk of the window at (originX, originY) is Ready.
+bool streamWindowReady(ChunkStream* stream, int originX, int originY, ChunkSlot* window[STREAM_WINDOW_Y][STREAM_WINDOW_X]) {
+	for (int y = 0; y < STREAM_WINDOW_Y; y++) {
+		for (int x = 0; x < STREAM_WINDOW_X; x++) {
+			ChunkSlot* slot = streamFindSlot(stream, originX + x, originY + y);
+			if (slot == NULL || slot->state != ChunkReady) return false;
+			window[y][x] = slot;
+		}
+	}
+	return true;
+}
+
+// Window chunk holding a window position, clamped so that stragglers on the edge still have one
+void windowChunkOf(Vector2 position, int tileSize, int* x, int* y) {
+	*x = (int)floorf(position.x / (CHUNK_WIDTH * tileSize));
+	*y = (int)floorf(position.y / (CHUNK_HEIGHT * tileSize));
+	if (*x < 0) *x = 0;
+	if (*y < 0) *y = 0;
+	if (*x > STREAM_WINDOW_X - 1) *x = STREAM_WINDOW_X - 1;
+	if (*y > STREAM_WINDOW_Y - 1) *y = STREAM_WINDOW_Y - 1;
+}
+
+bool insideWindow(Vector2 position, int tileSize) {
+	return position.x >= 0 && position.y >= 0 && position.x < MAP_WIDTH * tileSize && position.y < MAP_HEIGHT * tileSize;
+}
+
+// Hands the crates and gold whose chunk is outside the window at (originX, originY) over to
+// their chunk's record, by where they rest now rather than where they came from. With `all`
+// every window chunk gives its entities back. A record only runs out of room when it still
+// carries entities the pools had no slot for on arrival; what does not fit then is counted.
+void streamStoreLeaving(ChunkStream* stream, GameModel* model, int originX, int originY, bool all, int tileSize) {
 	for (int i = 0; i < MAX_CRATES; i++) {
-		if (model.crates[i].active) {
-			for (int j = 0; j < MAX_BULLETS; j++) {
-				if (model.bullets[j].active && CheckCollisionRecs(
-					(Rectangle) {
-					model.crates[i].position.x, model.crates[i].position.y, model.crates[i].size, model.crates[i].size
-				},
-					(Rectangle) {
-					model.bullets[j].position.x, model.bullets[j].position.y, model.bullets[j].size, model.bullets[j].size
-				})) {
-
-					model.crates[i].health--;
-					spawnParticles(model.particles, (Vector2) { model.crates[i].position.x + model.crates[i].size / 2, model.crates[i].position.y + model.crates[i].size / 2 }, 10, BROWN);
-
-					model.bullets[j].active = false;
-					if (model.crates[i].health <= 0) {
-						model.crates[i].active = false;
-						for (int g = 0; g < MAX_GOLD; g++) {
-							if (!model.gold[g].active) {
-								model = spawnGold(model, model.crates[i].position, tileSize);
-								break;
-							}
-						}
-					}
-					break;
+		Crate* crate = &model->crates[i];
+		if (!crate->active) continue;
+		int x, y;
+		windowChunkOf(crate->position, tileSize, &x, &y);
+		if (!all && chunkInWindow(stream->originX + x, stream->originY + y, originX, originY)) continue;
+		ChunkRecord* record = &stream->window[y][x]->record;
+		if (record->crateCount < CHUNK_MAX_CRATES) {
+			record->crates[record->crateCount++] = (ChunkCrate) {
+				.position = { crate->position.x / tileSize - x * CHUNK_WIDTH, crate->position.y / tileSize - y * CHUNK_HEIGHT },
+				.health = crate->health,
+				.hasGold = crate->hasGold
+			};
+		}
+		else {
+			stream->lostCrates++;
+		}
+		crate->active = false;
+	}
+
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition) | COMPONENT(ComponentPickup), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model->ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model->ecs, chunk, ComponentPosition);
+		for (int i = 0; i < chunk->count; i++) {
+			int x, y;
+			windowChunkOf(position[i], tileSize, &x, &y);
+			if (!all && chunkInWindow(stream->originX + x, stream->originY + y, originX, originY)) continue;
+			ChunkRecord* record = &stream->window[y][x]->record;
+			if (record->goldCount < CHUNK_MAX_GOLD) {
+				record->gold[record->goldCount++] = (Vector2){ position[i].x / tileSize - x * CHUNK_WIDTH, position[i].y / tileSize - y * CHUNK_HEIGHT };
+			}
+			else {
+				stream->lostGold++;
+			}
+			ecsDeferDestroy(&ecsCommands, query.chunkIndex, i);
+		}
+	}
+	ecsFlush(&model->ecs, &ecsCommands);
+}
+
+// Moves everything by `offset` pixels after the window moved the other way. Transient entities
+// that end up outside the window are dropped; NPCs rejoin the player they follow.
+void translatePosition(Vector2* position, Vector2 offset) {
+	position->x += offset.x;
+	position->y += offset.y;
+}
+
+void streamTranslate(GameModel* model, Vector2 offset, int tileSize) {
+	for (int p = 0; p < model->playerCount; p++) {
+		translatePosition(&model->players[p].position, offset);
+		translatePosition(&model->players[p].sword.position, offset);
+	}
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		translatePosition(&model->enemies[i].position, offset);
+		translatePosition(&model->steering[i].searchTarget, offset);
+		if (!insideWindow(model->enemies[i].position, tileSize)) model->enemies[i].active = false;
+	}
+	for (int i = 0; i < BULLET_POOL; i++) {
+		translatePosition(&model->bullets[i].position, offset);
+		if (!insideWindow(model->bullets[i].position, tileSize)) model->bullets[i].active = false;
+	}
+	for (int i = 0; i < MAX_CRATES; i++) {
+		if (model->crates[i].active) translatePosition(&model->crates[i].position, offset);
+	}
+	for (int i = 0; i < MAX_NPCS; i++) {
+		translatePosition(&model->npcs[i].position, offset);
+		if (!insideWindow(model->npcs[i].position, tileSize)) model->npcs[i].position = model->players[0].position;
+	}
+
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model->ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model->ecs, chunk, ComponentPosition);
+		for (int i = 0; i < chunk->count; i++) {
+			translatePosition(&position[i], offset);
+		}
+	}
+}
+
+// Copies the window's tiles into `map`
+void streamCopyTiles(ChunkStream* stream) {
+	for (int cy = 0; cy < STREAM_WINDOW_Y; cy++) {
+		for (int cx = 0; cx < STREAM_WINDOW_X; cx++) {
+			const ChunkRecord* record = &stream->window[cy][cx]->record;
+			for (int y = 0; y < CHUNK_HEIGHT; y++) {
+				memcpy(&map[cy * CHUNK_HEIGHT + y][cx * CHUNK_WIDTH], record->tiles[y], CHUNK_WIDTH);
+			}
+		}
+	}
+	rebuildWalkableIndex();
+}
+
+// Moves a window chunk's stored entities into the model. What does not fit stays in the
+// record, which the chunk takes back with it when it leaves.
+void streamPlaceChunk(ChunkStream* stream, GameModel* model, int cx, int cy, int tileSize) {
+	ChunkRecord* record = &stream->window[cy][cx]->record;
+	Vector2 corner = { (float)(cx * CHUNK_WIDTH * tileSize), (float)(cy * CHUNK_HEIGHT * tileSize) };
+
+	int kept = 0;
+	int slot = 0;
+	for (int k = 0; k < record->crateCount; k++) {
+		while (slot < MAX_CRATES && model->crates[slot].active) slot++;
+		if (slot == MAX_CRATES) {
+			record->crates[kept++] = record->crates[k];
+			continue;
+		}
+		model->crates[slot] = (Crate){
+			.position = { corner.x + record->crates[k].position.x * tileSize, corner.y + record->crates[k].position.y * tileSize },
+			.health = record->crates[k].health,
+			.active = true,
+			.hasGold = record->crates[k].hasGold
+		};
+	}
+	record->crateCount = kept;
+
+	int archetype = ecsFindArchetype(&model->ecs, ARCHETYPE_SLEEPING_GOLD);
+	kept = 0;
+	for (int k = 0; k < record->goldCount; k++) {
+		int row;
+		int chunkIndex = archetype >= 0 ? ecsAppend(&model->ecs, archetype, &row) : -1;
+		if (chunkIndex < 0) {
+			record->gold[kept++] = record->gold[k];
+			continue;
+		}
+		EcsValues values = {
+			.position = { corner.x + record->gold[k].x * tileSize, corner.y + record->gold[k].y * tileSize },
+			.pickup = (Pickup){ tileSize / 2 }
+		};
+		ecsWriteRow(&model->ecs, chunkIndex, row, &values);
+	}
+	record->goldCount = kept;
+}
+
+// Positions moved and entities came and went, so every crate goes back to sleep in its new
+// cell and the sleeping gold is counted again. Awake gold settles by itself.
+void streamResettle(GameModel* model, int tileSize) {
+	unsigned int npcAwake = model->sleep.npcAwake;
+	sleepInit(&model->sleep);
+	model->sleep.npcAwake = npcAwake;
+	influenceReset(&model->influence);  // Stamps are rebuilt from the new positions next tick
+	for (int i = 0; i < MAX_CRATES; i++) {
+		model->crates[i].sleeping = false;
+		model->crates[i].idleTicks = 0;
+		if (model->crates[i].active) sleepCrate(model, i, tileSize);
+	}
+	EcsQuery query = ecsQuery(COMPONENT(ComponentSleeping), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model->ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model->ecs, chunk, ComponentPosition);
+		for (int i = 0; i < chunk->count; i++) {
+			model->sleep.cellGold[cellIndexOf(position[i], tileSize)]++;
+		}
+	}
+	model->dirty = ~0u;
+}
+
+// Opens a world file and blocks until the first window is loaded into `map`. The window starts
+// in the world's top-left corner.
+bool streamOpen(ChunkStream* stream, const char* path) {
+	memset(stream, 0, sizeof(*stream));
+	stream->file = fopen(path, "r+b");
+	if (stream->file == NULL) return false;
+
+	unsigned char header[WORLD_HEADER_BYTES];
+	int at = 0;
+	if (fread(header, 1, sizeof(header), stream->file) != sizeof(header) || getU32(header, &at) != WORLD_MAGIC || getU32(header, &at) != WORLD_VERSION) {
+		fclose(stream->file);
+		return false;
+	}
+	stream->chunksX = (int)getU32(header, &at);
+	stream->chunksY = (int)getU32(header, &at);
+	int chunkWidth = (int)getU32(header, &at);
+	int chunkHeight = (int)getU32(header, &at);
+	if (chunkWidth != CHUNK_WIDTH || chunkHeight != CHUNK_HEIGHT || stream->chunksX < STREAM_WINDOW_X || stream->chunksY < STREAM_WINDOW_Y) {
+		fclose(stream->file);
+		return false;
+	}
+
+	mtx_init(&stream->lock, mtx_plain);
+	cnd_init(&stream->work);
+	cnd_init(&stream->done);
+	if (thrd_create(&stream->thread, streamLoaderMain, stream) != thrd_success) {
+		fclose(stream->file);
+		return false;
+	}
+
+	mtx_lock(&stream->lock);
+	streamRequest(stream);
+	while (!streamWindowReady(stream, stream->originX, stream->originY, stream->window)) {
+		cnd_wait(&stream->done, &stream->lock);
+	}
+	mtx_unlock(&stream->lock);
+	streamCopyTiles(stream);
+	return true;
+}
+
+// Replaces whatever setup spawned with the entities stored in the first window
+void streamAttach(ChunkStream* stream, GameModel* model, int tileSize) {
+	for (int i = 0; i < MAX_CRATES; i++) {
+		model->crates[i].active = false;
+	}
+	for (int y = 0; y < STREAM_WINDOW_Y; y++) {
+		for (int x = 0; x < STREAM_WINDOW_X; x++) {
+			streamPlaceChunk(stream, model, x, y, tileSize);
+		}
+	}
+	streamResettle(model, tileSize);
+}
+
+// Called between ticks. Shifts the window a chunk towards the first player once they come
+// within STREAM_EDGE of its edge and the chunks it moves onto are loaded; until then the player
+// simply keeps walking inside the current window. Returns true when the window moved, which
+// moves every position in the model by a whole chunk.
+bool streamUpdate(ChunkStream* stream, GameModel* model, int tileSize) {
+	const Player* player = &model->players[0];
+	float px = (player->position.x + player->size / 2.0f) / tileSize;
+	float py = (player->position.y + player->size / 2.0f) / tileSize;
+	int dx = px < STREAM_EDGE_X ? -1 : px > MAP_WIDTH - STREAM_EDGE_X ? 1 : 0;
+	int dy = py < STREAM_EDGE_Y ? -1 : py > MAP_HEIGHT - STREAM_EDGE_Y ? 1 : 0;
+	if (stream->originX + dx < 0 || stream->originX + dx + STREAM_WINDOW_X > stream->chunksX) dx = 0;
+	if (stream->originY + dy < 0 || stream->originY + dy + STREAM_WINDOW_Y > stream->chunksY) dy = 0;
+	if (dx == 0 && dy == 0 && !stream->wantsRequest) return false;
+
+	int originX = stream->originX + dx;
+	int originY = stream->originY + dy;
+	ChunkSlot* window[STREAM_WINDOW_Y][STREAM_WINDOW_X];
+	mtx_lock(&stream->lock);
+	if (stream->wantsRequest) streamRequest(stream);
+	bool ready = (dx != 0 || dy != 0) && streamWindowReady(stream, originX, originY, window);
+	mtx_unlock(&stream->lock);
+	if (!ready) return false;
+
+	streamStoreLeaving(stream, model, originX, originY, false, tileSize);
+	streamTranslate(model, (Vector2) { (float)(-dx * CHUNK_WIDTH * tileSize), (float)(-dy * CHUNK_HEIGHT * tileSize) }, tileSize);
+
+	mtx_lock(&stream->lock);
+	for (int y = 0; y < STREAM_WINDOW_Y; y++) {
+		for (int x = 0; x < STREAM_WINDOW_X; x++) {
+			if (!chunkInWindow(stream->originX + x, stream->originY + y, originX, originY)) stream->window[y][x]->state = ChunkSaving;
+		}
+	}
+	cnd_signal(&stream->work);
+	int oldX = stream->originX;
+	int oldY = stream->originY;
+	stream->originX = originX;
+	stream->originY = originY;
+	memcpy(stream->window, window, sizeof(window));
+	streamRequest(stream);
+	mtx_unlock(&stream->lock);
+
+	streamCopyTiles(stream);
+	for (int y = 0; y < STREAM_WINDOW_Y; y++) {
+		for (int x = 0; x < STREAM_WINDOW_X; x++) {
+			if (!chunkInWindow(originX + x, originY + y, oldX, oldY)) streamPlaceChunk(stream, model, x, y, tileSize);
+		}
+	}
+	streamResettle(model, tileSize);
+	return true;
+}
+
+// Stores the window's entities, waits for every write to reach the file and closes it
+void streamClose(ChunkStream* stream, GameModel* model, int tileSize) {
+	streamStoreLeaving(stream, model, stream->originX, stream->originY, true, tileSize);
+	mtx_lock(&stream->lock);
+	for (int y = 0; y < STREAM_WINDOW_Y; y++) {
+		for (int x = 0; x < STREAM_WINDOW_X; x++) {
+			stream->window[y][x]->state = ChunkSaving;
+		}
+	}
+	stream->stopping = true;
+	cnd_signal(&stream->work);
+	mtx_unlock(&stream->lock);
+	thrd_join(stream->thread, NULL);
+	fclose(stream->file);
+	if (stream->lostCrates > 0 || stream->lostGold > 0) {
+		printf("stream: %d crates and %d gold lost to full chunk records\n", stream->lostCrates, stream->lostGold);
+	}
+	cnd_destroy(&stream->done);
+	cnd_destroy(&stream->work);
+	mtx_destroy(&stream->lock);
+}
+
+// Tile at (x, y) of a width by height world, '#' or '.'
+typedef char (*WorldTileFn)(const void* source, int x, int y, int width, int height);
+
+// Tile of a world built from copies of the hand-made map, with doors through the seams.
+// Reads `map`, so it must run before any world is streamed into it.
+char tiledWorldTile(const void* source, int x, int y, int width, int height) {
+	if (x == 0 || y == 0 || x == width - 1 || y == height - 1) return '#';
+	int mapX = x % MAP_WIDTH;
+	int mapY = y % MAP_HEIGHT;
+	if ((mapX == 0 || mapX == MAP_WIDTH - 1) && (mapY == 9 || mapY == 10)) return '.';
+	if ((mapY == 0 || mapY == MAP_HEIGHT - 1) && (mapX == 24 || mapX == 25)) return '.';
+	return map[mapY][mapX];
+}
+
+// Writes a chunksX by chunksY world with a few crates in each chunk, one record at a time so
+// any size can be written
+int writeWorld(const char* path, int chunksX, int chunksY, unsigned int seed, WorldTileFn tileAt, const void* source) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		printf("world: cannot write %s\n", path);
+		return 1;
+	}
+	unsigned char header[WORLD_HEADER_BYTES];
+	int at = 0;
+	putU32(header, &at, WORLD_MAGIC);
+	putU32(header, &at, WORLD_VERSION);
+	putU32(header, &at, chunksX);
+	putU32(header, &at, chunksY);
+	putU32(header, &at, CHUNK_WIDTH);
+	putU32(header, &at, CHUNK_HEIGHT);
+	fwrite(header, 1, sizeof(header), file);
+
+	unsigned int rng = seed;
+	unsigned char data[CHUNK_RECORD_BYTES];
+	int crates = 0;
+	for (int cy = 0; cy < chunksY; cy++) {
+		for (int cx = 0; cx < chunksX; cx++) {
+			ChunkRecord record = { 0 };
+			for (int y = 0; y < CHUNK_HEIGHT; y++) {
+				for (int x = 0; x < CHUNK_WIDTH; x++) {
+					record.tiles[y][x] = tileAt(source, cx * CHUNK_WIDTH + x, cy * CHUNK_HEIGHT + y, chunksX * CHUNK_WIDTH, chunksY * CHUNK_HEIGHT);
 				}
 			}
-			if (model.sword.active && CheckCollisionRecs(
-				(Rectangle) {
-				model.crates[i].position.x, model.crates[i].position.y, model.crates[i].size, model.crates[i].size
-			},
-				(Rectangle) {
-				model.sword.position.x, model.sword.position.y, model.sword.size.x, model.sword.size.y
-			})) {
-				spawnParticles(model.particles, (Vector2) { model.crates[i].position.x + model.crates[i].size / 2, model.crates[i].position.y + model.crates[i].size / 2 }, 5, BROWN);
-				model.crates[i].health--;
-				if (model.crates[i].health <= 0) {
-					model.crates[i].active = false;
-					for (int g = 0; g < MAX_GOLD; g++) {
-						if (!model.gold[g].active) {
-							model = spawnGold(model, model.crates[i].position, tileSize);
-							break;
-						}
-					}
+			int wanted = gameRand(&rng) % 3;
+			for (int attempt = 0; attempt < 8 && record.crateCount < wanted; attempt++) {
+				int x = gameRand(&rng) % CHUNK_WIDTH;
+				int y = gameRand(&rng) % CHUNK_HEIGHT;
+				if (record.tiles[y][x] == '#') continue;
+				record.crates[record.crateCount++] = (ChunkCrate){ .position = { (float)x, (float)y }, .health = 2, .hasGold = true };
+			}
+			crates += record.crateCount;
+			chunkEncode(&record, data);
+			fwrite(data, 1, sizeof(data), file);
+		}
+	}
+	bool ok = fclose(file) == 0;
+	printf("world: %s, %dx%d chunks (%dx%d tiles), %d crates, %ld bytes\n", path, chunksX, chunksY,
+		chunksX * CHUNK_WIDTH, chunksY * CHUNK_HEIGHT, crates, WORLD_HEADER_BYTES + (long)chunksX * chunksY * CHUNK_RECORD_BYTES);
+	return ok ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region Save
+
+#define SAVE_MAGIC 0x53505242u  // "BRPS"
+#define SAVE_VERSION 2  // Bump with any change to SaveHeader, a Saved* record or a struct they hold
+#define SAVE_ALIGN 8  // Every section starts on this boundary
+#define SAVE_INTERVAL_TICKS (5 * LOCKSTEP_TICK_RATE)  // Autosave period
+#define SAVE_DEFAULT_PATH "barp.sav"
+
+// Saves are raw structs in this build's layout, unlike the byte streams of packets and world
+// files: loading is one read, a memcpy per record and a few pointer fix-ups. There is no
+// upgrade path, so a save only loads into a build with the same SAVE_VERSION and layout key.
+// SAVE_VERSION is what a layout change bumps (Player, NPC, Enemy, EnemySteering, Bullet, Crate and the
+// influence records are stored as they are); the layout key is the backstop that also catches
+// a forgotten bump, other pool sizes, pointer width or byte order.
+typedef struct SaveHeader {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int layout;  // saveLayoutKey() of the writing build
+	unsigned int quests;  // questGraphKey(), quest nodes and dialog offsets index into it
+	unsigned int bytes;  // Whole file
+	unsigned int checksum;  // Of everything after the header
+	int playerCount;
+	unsigned int rngState;
+	float enemySpawnTimer;
+	int goldCollected;
+	int killCount;
+	GameStage stage;
+	GameLimits limits;
+	QuestState quest;
+	int dialog[MAX_NPCS];  // Offset into questGraph.text, -1 for none
+	short enemyCount, bulletCount, crateCount, goldCount;
+	short stampCount, echoCount;
+	char tiles[MAP_HEIGHT][MAP_WIDTH];
+} SaveHeader;
+
+// Live entities keep their pool slot, spawning and bullet ownership both go by slot
+typedef struct SavedEnemy {
+	Enemy enemy;
+	EnemySteering steering;
+	short slot;
+} SavedEnemy;
+
+typedef struct SavedBullet {
+	Bullet bullet;
+	short slot;
+} SavedBullet;
+
+typedef struct SavedCrate {
+	Crate crate;
+	short slot;
+} SavedCrate;
+
+typedef struct SavedGold {
+	Vector2 position;
+	Vector2 velocity;
+	int sleeping;
+} SavedGold;
+
+// Influence stamps lag a tick behind the positions and echoes are history, so both are kept
+// and the layers are summed again from them
+typedef struct SavedStamp {
+	InfluenceStamp stamp;
+	short source;  // Index into players, then enemies, then crates
+} SavedStamp;
+
+#define SAVE_STAMP_SOURCES (MAX_PLAYERS + MAX_ENEMIES + MAX_CRATES)
+
+#define SAVE_SECTION_BYTES(bytes) (((bytes) + SAVE_ALIGN - 1) / SAVE_ALIGN * SAVE_ALIGN)
+#define SAVE_MAX_BYTES (SAVE_SECTION_BYTES(sizeof(SaveHeader)) + SAVE_SECTION_BYTES(MAX_PLAYERS * sizeof(Player)) \
+	+ SAVE_SECTION_BYTES(MAX_NPCS * sizeof(NPC)) + SAVE_SECTION_BYTES(MAX_ENEMIES * sizeof(SavedEnemy)) \
+	+ SAVE_SECTION_BYTES(BULLET_POOL * sizeof(SavedBullet)) + SAVE_SECTION_BYTES(MAX_CRATES * sizeof(SavedCrate)) \
+	+ SAVE_SECTION_BYTES(2 * MAX_GOLD * sizeof(SavedGold)) + SAVE_SECTION_BYTES(SAVE_STAMP_SOURCES * sizeof(SavedStamp)) \
+	+ SAVE_SECTION_BYTES(INFLUENCE_ECHOES * sizeof(InfluenceEcho)))
+
+unsigned int saveLayoutKey(void) {
+	const unsigned int layout[] = {
+		0x01020304u,  // Byte order
+		(unsigned int)sizeof(void*), (unsigned int)sizeof(SaveHeader), (unsigned int)sizeof(Player), (unsigned int)sizeof(NPC),
+		(unsigned int)sizeof(SavedEnemy), (unsigned int)sizeof(SavedBullet), (unsigned int)sizeof(SavedCrate), (unsigned int)sizeof(SavedGold),
+		(unsigned int)sizeof(SavedStamp), (unsigned int)sizeof(InfluenceEcho), INFLUENCE_ECHOES,
+		MAX_PLAYERS, MAX_NPCS, MAX_ENEMIES, MAX_BULLETS, MAX_CRATES, MAX_GOLD, MAP_WIDTH, MAP_HEIGHT
+	};
+	return hashBytes(2166136261u, layout, sizeof(layout));
+}
+
+// What a save's node indices and dialog offsets mean, so a save only loads against the graph it was made with
+unsigned int questGraphKey(void) {
+	unsigned int hash = hashBytes(2166136261u, &questGraph.nodeCount, sizeof(questGraph.nodeCount));
+	for (int n = 0; n < questGraph.nodeCount; n++) {
+		const QuestNode* node = &questGraph.nodes[n];
+		hash = hashBytes(hash, node->name, strlen(node->name));
+		HASH_FIELD(hash, node->npc);
+		HASH_FIELD(hash, node->say);
+	}
+	return hashBytes(hash, questGraph.text, questGraph.textUsed);
+}
+
+int saveDialogOffset(const char* dialog) {
+	if (dialog == NULL || dialog < questGraph.text || dialog >= questGraph.text + questGraph.textUsed) return -1;
+	return (int)(dialog - questGraph.text);
+}
+
+// Copies bytes to out at *at and zero-pads up to the next section
+void saveSection(unsigned char* out, size_t* at, const void* data, size_t bytes) {
+	memcpy(out + *at, data, bytes);
+	memset(out + *at + bytes, 0, SAVE_SECTION_BYTES(bytes) - bytes);
+	*at += SAVE_SECTION_BYTES(bytes);
+}
+
+// Header, players, NPCs, then the live enemies, bullets, crates and gold. Particles and
+// damage numbers are only effects and are left out. out holds SAVE_MAX_BYTES.
+size_t saveEncode(const GameModel* model, unsigned char* out) {
+	SaveHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SAVE_MAGIC;
+	header.version = SAVE_VERSION;
+	header.layout = saveLayoutKey();
+	header.quests = questGraphKey();
+	header.playerCount = model->playerCount;
+	header.rngState = model->rngState;
+	header.enemySpawnTimer = model->enemySpawnTimer;
+	header.goldCollected = model->goldCollected;
+	header.killCount = model->killCount;
+	header.stage = model->stage;
+	header.limits = model->limits;
+	header.quest = model->quest;
+	for (int i = 0; i < MAX_NPCS; i++) header.dialog[i] = saveDialogOffset(model->npcs[i].dialog);
+	for (int y = 0; y < MAP_HEIGHT; y++) memcpy(header.tiles[y], map[y], MAP_WIDTH);
+
+	size_t at = SAVE_SECTION_BYTES(sizeof(SaveHeader));
+	Player players[MAX_PLAYERS];
+	memcpy(players, model->players, model->playerCount * sizeof(Player));
+	for (int p = 0; p < model->playerCount; p++) players[p].activeDialog = NULL;  // Found again next tick
+	saveSection(out, &at, players, model->playerCount * sizeof(Player));
+	NPC npcs[MAX_NPCS];
+	memcpy(npcs, model->npcs, sizeof(npcs));
+	for (int i = 0; i < MAX_NPCS; i++) npcs[i].dialog = NULL;  // Kept as offsets in the header
+	saveSection(out, &at, npcs, sizeof(npcs));
+
+	SavedEnemy enemies[MAX_ENEMIES];
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		if (model->enemies[i].active) enemies[header.enemyCount++] = (SavedEnemy){ .enemy = model->enemies[i], .steering = model->steering[i], .slot = (short)i };
+	}
+	saveSection(out, &at, enemies, header.enemyCount * sizeof(SavedEnemy));
+	SavedBullet bullets[BULLET_POOL];
+	for (int i = 0; i < BULLET_POOL; i++) {
+		if (model->bullets[i].active) bullets[header.bulletCount++] = (SavedBullet){ .bullet = model->bullets[i], .slot = (short)i };
+	}
+	saveSection(out, &at, bullets, header.bulletCount * sizeof(SavedBullet));
+	SavedCrate crates[MAX_CRATES];
+	for (int i = 0; i < MAX_CRATES; i++) {
+		if (model->crates[i].active) crates[header.crateCount++] = (SavedCrate){ .crate = model->crates[i], .slot = (short)i };
+	}
+	saveSection(out, &at, crates, header.crateCount * sizeof(SavedCrate));
+
+	SavedGold gold[2 * MAX_GOLD];
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPickup), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext((EcsWorld*)&model->ecs, &query)) != NULL) {
+		const Vector2* position = ecsColumn((EcsWorld*)&model->ecs, chunk, ComponentPosition);
+		const Vector2* velocity = ecsColumn((EcsWorld*)&model->ecs, chunk, ComponentVelocity);
+		for (int i = 0; i < chunk->count && header.goldCount < 2 * MAX_GOLD; i++) {
+			gold[header.goldCount++] = (SavedGold){ .position = position[i], .velocity = velocity != NULL ? velocity[i] : (Vector2){ 0, 0 }, .sleeping = velocity == NULL };
+		}
+	}
+	saveSection(out, &at, gold, header.goldCount * sizeof(SavedGold));
+
+	SavedStamp stamps[SAVE_STAMP_SOURCES];
+	const InfluenceMap* influence = &model->influence;
+	for (int source = 0; source < SAVE_STAMP_SOURCES; source++) {
+		InfluenceStamp stamp = source < MAX_PLAYERS ? influence->players[source]
+			: source < MAX_PLAYERS + MAX_ENEMIES ? influence->enemies[source - MAX_PLAYERS]
+			: influence->crates[source - MAX_PLAYERS - MAX_ENEMIES];
+		if (stamp.cell >= 0) stamps[header.stampCount++] = (SavedStamp){ .stamp = stamp, .source = (short)source };
+	}
+	saveSection(out, &at, stamps, header.stampCount * sizeof(SavedStamp));
+	header.echoCount = influence->echoCount;
+	saveSection(out, &at, influence->echoes, header.echoCount * sizeof(InfluenceEcho));
+
+	size_t payload = SAVE_SECTION_BYTES(sizeof(SaveHeader));
+	header.bytes = (unsigned int)at;
+	header.checksum = hashBytes(2166136261u, out + payload, at - payload);
+	memcpy(out, &header, sizeof(header));
+	memset(out + sizeof(header), 0, payload - sizeof(header));
+	return at;
+}
+
+// Written beside the old save and renamed over it, so a crash mid-write keeps the last good one
+bool saveWrite(const char* path, const unsigned char* data, size_t size) {
+	char temporary[512];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	FILE* file = fopen(temporary, "wb");
+	if (file == NULL) return false;
+	bool ok = fwrite(data, 1, size, file) == size;
+	ok = fclose(file) == 0 && ok;
+#if defined(_WIN32)
+	if (ok) remove(path);  // rename does not replace an existing file there
+#endif
+	return ok && rename(temporary, path) == 0;
+}
+
+bool saveReject(const char* path, const char* reason) {
+	printf("save: %s %s\n", path, reason);
+	return false;
+}
+
+// Rejects a file after the load already swapped its map in, putting the previous map back
+bool saveRejectMap(const char* path, const char* reason, char previous[MAP_HEIGHT][MAP_WIDTH + 1], bool swapped) {
+	if (swapped) {
+		memcpy(map, previous, sizeof(map));
+		rebuildWalkableIndex();
+	}
+	return saveReject(path, reason);
+}
+
+// Rebuilds the sleeper lists from the saved flags, keeping awake crates awake
+void saveResettle(GameModel* model, int tileSize) {
+	unsigned int npcAwake = 0;
+	for (int i = 0; i < MAX_NPCS; i++) npcAwake |= (unsigned int)model->npcs[i].active << i;
+	sleepInit(&model->sleep);
+	model->sleep.npcAwake = npcAwake;
+	for (int i = 0; i < MAX_CRATES; i++) {
+		Crate* crate = &model->crates[i];
+		if (!crate->active) continue;
+		if (crate->sleeping) sleepCrate(model, i, tileSize);
+		else model->sleep.awakeCrates[model->sleep.awakeCrateCount++] = (short)i;
+	}
+	EcsQuery query = ecsQuery(COMPONENT(ComponentSleeping), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(&model->ecs, &query)) != NULL) {
+		Vector2* position = ecsColumn(&model->ecs, chunk, ComponentPosition);
+		for (int i = 0; i < chunk->count; i++) {
+			model->sleep.cellGold[cellIndexOf(position[i], tileSize)]++;
+		}
+	}
+}
+
+// Reads the whole file in one go, checks it was written by this build against this quest
+// graph, then copies the records into a fresh model and rebuilds what is derived from them
+bool saveLoad(const char* path, GameModel* model, int tileSize) {
+	static unsigned char data[SAVE_MAX_BYTES + 1];
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return false;
+	size_t length = fread(data, 1, sizeof(data), file);
+	fclose(file);
+
+	SaveHeader header;
+	if (length < sizeof(header)) return saveReject(path, "is truncated");
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != SAVE_MAGIC) return saveReject(path, "is not a save");
+	if (header.version != SAVE_VERSION) return saveReject(path, "is from another save version");
+	if (header.layout != saveLayoutKey()) return saveReject(path, "was written by a build with another layout");
+	if (header.quests != questGraphKey()) return saveReject(path, "was made with another quest graph");
+	size_t payload = SAVE_SECTION_BYTES(sizeof(SaveHeader));
+	if (header.playerCount < 1 || header.playerCount > MAX_PLAYERS || header.enemyCount < 0 || header.enemyCount > MAX_ENEMIES
+		|| header.bulletCount < 0 || header.bulletCount > BULLET_POOL || header.crateCount < 0 || header.crateCount > MAX_CRATES
+		|| header.goldCount < 0 || header.goldCount > 2 * MAX_GOLD || header.stampCount < 0 || header.stampCount > SAVE_STAMP_SOURCES
+		|| header.echoCount < 0 || header.echoCount > INFLUENCE_ECHOES) {
+		return saveReject(path, "has impossible counts");
+	}
+	size_t expected = payload + SAVE_SECTION_BYTES(header.playerCount * sizeof(Player)) + SAVE_SECTION_BYTES(MAX_NPCS * sizeof(NPC))
+		+ SAVE_SECTION_BYTES(header.enemyCount * sizeof(SavedEnemy)) + SAVE_SECTION_BYTES(header.bulletCount * sizeof(SavedBullet))
+		+ SAVE_SECTION_BYTES(header.crateCount * sizeof(SavedCrate)) + SAVE_SECTION_BYTES(header.goldCount * sizeof(SavedGold))
+		+ SAVE_SECTION_BYTES(header.stampCount * sizeof(SavedStamp)) + SAVE_SECTION_BYTES(header.echoCount * sizeof(InfluenceEcho));
+	if (header.bytes != length || length != expected) return saveReject(path, "is truncated");
+	if (hashBytes(2166136261u, data + payload, length - payload) != header.checksum) return saveReject(path, "is corrupt");
+
+	// The map first, so everything below settles against it
+	static char previousMap[MAP_HEIGHT][MAP_WIDTH + 1];
+	bool sameMap = true;
+	for (int y = 0; y < MAP_HEIGHT; y++) sameMap = sameMap && memcmp(map[y], header.tiles[y], MAP_WIDTH) == 0;
+	if (!sameMap) {
+		memcpy(previousMap, map, sizeof(map));
+		for (int y = 0; y < MAP_HEIGHT; y++) memcpy(map[y], header.tiles[y], MAP_WIDTH);
+		rebuildWalkableIndex();
+	}
+
+	static GameModel loaded;
+	loaded = setup(tileSize, header.playerCount, header.rngState);
+	loaded.rngState = header.rngState;
+	loaded.enemySpawnTimer = header.enemySpawnTimer;
+	loaded.goldCollected = header.goldCollected;
+	loaded.killCount = header.killCount;
+	loaded.stage = header.stage;
+	setGameLimits(&loaded, header.limits);
+	loaded.quest = header.quest;
+	for (int i = 0; i < MAX_CRATES; i++) loaded.crates[i] = (Crate){ 0 };
+
+	const unsigned char* at = data + payload;
+	memcpy(loaded.players, at, header.playerCount * sizeof(Player));
+	at += SAVE_SECTION_BYTES(header.playerCount * sizeof(Player));
+	memcpy(loaded.npcs, at, sizeof(loaded.npcs));
+	at += SAVE_SECTION_BYTES(sizeof(loaded.npcs));
+	for (int i = 0; i < MAX_NPCS; i++) {
+		bool valid = header.dialog[i] >= 0 && header.dialog[i] < questGraph.textUsed;
+		loaded.npcs[i].dialog = valid ? questGraph.text + header.dialog[i] : "";
+	}
+	for (int k = 0; k < header.enemyCount; k++) {
+		SavedEnemy record;
+		memcpy(&record, at + k * sizeof(record), sizeof(record));
+		if (record.slot < 0 || record.slot >= MAX_ENEMIES) return saveRejectMap(path, "has an enemy outside the pool", previousMap, !sameMap);
+		loaded.enemies[record.slot] = record.enemy;
+		loaded.steering[record.slot] = record.steering;
+	}
+	at += SAVE_SECTION_BYTES(header.enemyCount * sizeof(SavedEnemy));
+	for (int k = 0; k < header.bulletCount; k++) {
+		SavedBullet record;
+		memcpy(&record, at + k * sizeof(record), sizeof(record));
+		if (record.slot < 0 || record.slot >= BULLET_POOL) return saveRejectMap(path, "has a bullet outside the pool", previousMap, !sameMap);
+		loaded.bullets[record.slot] = record.bullet;
+	}
+	at += SAVE_SECTION_BYTES(header.bulletCount * sizeof(SavedBullet));
+	for (int k = 0; k < header.crateCount; k++) {
+		SavedCrate record;
+		memcpy(&record, at + k * sizeof(record), sizeof(record));
+		if (record.slot < 0 || record.slot >= MAX_CRATES) return saveRejectMap(path, "has a crate outside the pool", previousMap, !sameMap);
+		loaded.crates[record.slot] = record.crate;
+	}
+	at += SAVE_SECTION_BYTES(header.crateCount * sizeof(SavedCrate));
+	int awakeGold = ecsFindArchetype(&loaded.ecs, ARCHETYPE_GOLD);
+	int sleepingGold = ecsFindArchetype(&loaded.ecs, ARCHETYPE_SLEEPING_GOLD);
+	for (int k = 0; k < header.goldCount; k++) {
+		SavedGold record;
+		memcpy(&record, at + k * sizeof(record), sizeof(record));
+		int row;
+		int chunkIndex = ecsAppend(&loaded.ecs, record.sleeping ? sleepingGold : awakeGold, &row);
+		if (chunkIndex < 0) return saveRejectMap(path, "has more gold than the pools hold", previousMap, !sameMap);
+		EcsValues values = { .position = record.position, .velocity = record.velocity, .drag = 0.9f, .pickup = (Pickup){ tileSize / 2 } };
+		ecsWriteRow(&loaded.ecs, chunkIndex, row, &values);
+	}
+	at += SAVE_SECTION_BYTES(header.goldCount * sizeof(SavedGold));
+
+	InfluenceMap* influence = &loaded.influence;
+	influenceReset(influence);
+	for (int k = 0; k < header.stampCount; k++) {
+		SavedStamp record;
+		memcpy(&record, at + k * sizeof(record), sizeof(record));
+		int source = record.source;
+		if (source < 0 || source >= SAVE_STAMP_SOURCES || record.stamp.cell < 0 || record.stamp.cell >= INFLUENCE_WIDTH * INFLUENCE_HEIGHT) {
+			return saveRejectMap(path, "has a broken influence stamp", previousMap, !sameMap);
+		}
+		int layer = source < MAX_PLAYERS ? InfluenceThreat : source < MAX_PLAYERS + MAX_ENEMIES ? InfluenceCrowd : InfluenceLoot;
+		InfluenceStamp* stamp = layer == InfluenceThreat ? &influence->players[source]
+			: layer == InfluenceCrowd ? &influence->enemies[source - MAX_PLAYERS]
+			: &influence->crates[source - MAX_PLAYERS - MAX_ENEMIES];
+		influenceMove(influence, layer, stamp, record.stamp.cell, record.stamp.strength);
+	}
+	at += SAVE_SECTION_BYTES(header.stampCount * sizeof(SavedStamp));
+	memcpy(influence->echoes, at, header.echoCount * sizeof(InfluenceEcho));
+	influence->echoCount = header.echoCount;
+	for (int e = 0; e < influence->echoCount; e++) {
+		const InfluenceEcho* echo = &influence->echoes[e];
+		if (echo->layer >= InfluenceThreatBlurred || echo->cell < 0 || echo->cell >= INFLUENCE_WIDTH * INFLUENCE_HEIGHT) {
+			return saveRejectMap(path, "has a broken influence echo", previousMap, !sameMap);
+		}
+		influenceSplat(influence, echo->layer, echo->cell, echo->strength, 1);
+	}
+	influenceBlur(influence->layers[InfluenceThreat], influence->layers[InfluenceThreatBlurred]);
+	influence->blurStale = false;
+
+	saveResettle(&loaded, tileSize);
+	for (int p = 0; p < MAX_PLAYERS; p++) loaded.fov[p].tileX = loaded.fov[p].tileY = -1;
+	updateFieldOfView(&loaded, tileSize);
+	loaded.dirty = ~0u;
+	*model = loaded;
+	return true;
+}
+
+// Autosaves without holding up the simulation: saveSubmit only copies the model under the
+// lock, the writer thread encodes and writes the latest copy it was handed
+typedef struct SaveWriter {
+	const char* path;
+	GameModel pending;
+	bool hasPending;
+	bool stopping;
+	int saves, failures;
+	mtx_t lock;
+	cnd_t work;
+	thrd_t thread;
+} SaveWriter;
+
+int saveWriterMain(void* arg) {
+	SaveWriter* writer = arg;
+	static GameModel model;
+	static unsigned char data[SAVE_MAX_BYTES];
+
+	mtx_lock(&writer->lock);
+	for (;;) {
+		if (!writer->hasPending) {
+			if (writer->stopping) break;
+			cnd_wait(&writer->work, &writer->lock);
+			continue;
+		}
+		model = writer->pending;
+		writer->hasPending = false;
+		mtx_unlock(&writer->lock);
+
+		bool ok = saveWrite(writer->path, data, saveEncode(&model, data));
+
+		mtx_lock(&writer->lock);
+		if (ok) writer->saves++;
+		else writer->failures++;
+	}
+	mtx_unlock(&writer->lock);
+	return 0;
+}
+
+bool saveWriterStart(SaveWriter* writer, const char* path) {
+	writer->path = path;
+	writer->hasPending = writer->stopping = false;
+	writer->saves = writer->failures = 0;
+	mtx_init(&writer->lock, mtx_plain);
+	cnd_init(&writer->work);
+	if (thrd_create(&writer->thread, saveWriterMain, writer) != thrd_success) {
+		cnd_destroy(&writer->work);
+		mtx_destroy(&writer->lock);
+		return false;
+	}
+	return true;
+}
+
+// A save still waiting is replaced, only the newest state is worth writing
+void saveSubmit(SaveWriter* writer, const GameModel* model) {
+	mtx_lock(&writer->lock);
+	writer->pending = *model;
+	writer->hasPending = true;
+	cnd_signal(&writer->work);
+	mtx_unlock(&writer->lock);
+}
+
+// Writes whatever is still pending before the thread exits
+void saveWriterStop(SaveWriter* writer) {
+	mtx_lock(&writer->lock);
+	writer->stopping = true;
+	cnd_signal(&writer->work);
+	mtx_unlock(&writer->lock);
+	thrd_join(writer->thread, NULL);
+	cnd_destroy(&writer->work);
+	mtx_destroy(&writer->lock);
+	if (writer->failures > 0) printf("save: %d of %d writes to %s failed\n", writer->failures, writer->saves + writer->failures, writer->path);
+}
+
+// Times what an autosave costs the simulation thread and what the writer and a load cost,
+// on a busy stage-two game, and checks a load encodes back to the same bytes
+int runSaveBenchmark(int runs, const char* path, int tileSize) {
+	static GameModel model, copy, loaded;
+	static unsigned char first[SAVE_MAX_BYTES], again[SAVE_MAX_BYTES];
+	model = setup(tileSize, 4, GAME_DEFAULT_SEED);
+	questStart(&model, StageTwoSetup);
+	setGameLimits(&model, (GameLimits){ .enemies = MAX_ENEMIES / 2, .bulletsPerPlayer = MAX_BULLETS / 2, .crates = MAX_CRATES / 2, .particles = MAX_PARTICLES });
+	unsigned int rng[MAX_PLAYERS];
+	PlayerInput held[MAX_PLAYERS] = { 0 };
+	for (int p = 0; p < model.playerCount; p++) rng[p] = 0x2545F491u + p * 0x61C88647u;
+	for (int t = 0; t < 1200; t++) {
+		PlayerInput inputs[MAX_PLAYERS] = { 0 };
+		for (int p = 0; p < model.playerCount; p++) inputs[p] = botInput(&rng[p], &held[p]);
+		model = update(model, inputs, LOCKSTEP_DT, tileSize);
+	}
+
+	double copySeconds = INFINITY, encodeSeconds = INFINITY, writeSeconds = INFINITY, loadSeconds = INFINITY;
+	size_t size = 0;
+	for (int run = 0; run < runs; run++) {
+		double start = monotonicNow();
+		copy = model;
+		double copied = monotonicNow();
+		size = saveEncode(&copy, first);
+		double encoded = monotonicNow();
+		if (!saveWrite(path, first, size)) {
+			printf("save: cannot write %s\n", path);
+			return 1;
+		}
+		double written = monotonicNow();
+		if (!saveLoad(path, &loaded, tileSize)) return 1;
+		double done = monotonicNow();
+		copySeconds = fmin(copySeconds, copied - start);
+		encodeSeconds = fmin(encodeSeconds, encoded - copied);
+		writeSeconds = fmin(writeSeconds, written - encoded);
+		loadSeconds = fmin(loadSeconds, done - written);
+	}
+	remove(path);
+
+	bool same = saveEncode(&loaded, again) == size && memcmp(first, again, size) == 0;
+	SaveHeader header;
+	memcpy(&header, first, sizeof(header));
+	printf("save: %zu bytes for %d enemies, %d bullets, %d crates, %d gold (model %zu bytes), best of %d\n",
+		size, header.enemyCount, header.bulletCount, header.crateCount, header.goldCount, sizeof(GameModel), runs);
+	printf("  sim thread copy %8.1f us\n", copySeconds * 1e6);
+	printf("  encode          %8.1f us\n", encodeSeconds * 1e6);
+	printf("  write + rename  %8.1f us\n", writeSeconds * 1e6);
+	printf("  load            %8.1f us\n", loadSeconds * 1e6);
+	printf("  round trip      %s\n", same ? "identical" : "DIFFERS");
+	return same ? 0 : 1;
+}
+
+#pragma endregion
+
+#pragma region Mapgen
+
+// Maps of any size from a seed. A cellular automaton grows caves out of noise, BSP rooms joined
+// by corridors are carved through them, and a connectivity pass walls off every pocket the
+// start room cannot reach, so findPath and the spawn regions only ever see one connected area.
+// The grid is packed one bit per tile, set for walls, so the automaton updates 64 tiles per
+// word operation.
+#define MAPGEN_CA_STEPS 4
+#define MAPGEN_MIN_LEAF 24  // BSP leaves are split until no side reaches twice this
+#define MAPGEN_MIN_ROOM 5
+#define MAPGEN_CORRIDOR_WIDTH 2
+#define MAPGEN_START_ROOM_X1 12  // The start room spans (1, 1) to here, around playerSpawnTiles and the NPCs
+#define MAPGEN_START_ROOM_Y1 8
+#define MAPGEN_MIN_WIDTH (MAPGEN_START_ROOM_X1 + 2)
+#define MAPGEN_MIN_HEIGHT (MAPGEN_START_ROOM_Y1 + 2)
+
+typedef enum {
+	MapgenNoise,
+	MapgenCaves,
+	MapgenRooms,
+	MapgenConnect,
+	MapgenPhaseCount
+} MapgenPhase;
+
+const char* const mapgenPhaseNames[MapgenPhaseCount] = { "noise", "caves", "rooms", "connect" };
+
+typedef struct GeneratedMap {
+	int width, height;
+	int rowWords;  // Words per row; bits past `width` are walls
+	uint64_t* walls;
+	int openTiles;
+	int prunedTiles;  // Open tiles the connectivity pass walled off
+	double phaseSeconds[MapgenPhaseCount];
+} GeneratedMap;
+
+typedef struct MapgenNode {
+	int x, y, width, height;
+	int left, right;  // Children, -1 for leaves
+	int pointX, pointY;  // A tile inside the node's rooms that corridors join up
+} MapgenNode;
+
+// Tiles from..to of one row, inclusive, with the union-find parent of their region
+typedef struct MapgenRun {
+	int from, to;
+	int parent;
+} MapgenRun;
+
+// xorshift64*, the per-model gameRand is too narrow to fill 64 tiles at a time
+uint64_t mapgenRand(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+int mapgenRange(uint64_t* state, int low, int high) {
+	return low + (int)((mapgenRand(state) >> 33) % (uint64_t)(high - low + 1));
+}
+
+bool mapgenWall(const GeneratedMap* grid, int x, int y) {
+	return (grid->walls[(size_t)y * grid->rowWords + (x >> 6)] >> (x & 63)) & 1;
+}
+
+// Sets or clears tiles x0..x1 of row y, a word at a time
+void mapgenFillSpan(GeneratedMap* grid, int y, int x0, int x1, bool wall) {
+	uint64_t* row = grid->walls + (size_t)y * grid->rowWords;
+	for (int w = x0 >> 6; w <= x1 >> 6; w++) {
+		uint64_t mask = ~0ull;
+		if (w == x0 >> 6) mask &= ~0ull << (x0 & 63);
+		if (w == x1 >> 6) mask &= ~0ull >> (63 - (x1 & 63));
+		if (wall) row[w] |= mask;
+		else row[w] &= ~mask;
+	}
+}
+
+// Carves the rect, clipped so the outer wall stays
+void mapgenCarve(GeneratedMap* grid, int x0, int y0, int x1, int y1) {
+	if (x0 < 1) x0 = 1;
+	if (y0 < 1) y0 = 1;
+	if (x1 > grid->width - 2) x1 = grid->width - 2;
+	if (y1 > grid->height - 2) y1 = grid->height - 2;
+	for (int y = y0; y <= y1; y++) {
+		if (x0 <= x1) mapgenFillSpan(grid, y, x0, x1, false);
+	}
+}
+
+// Outer wall plus the padding bits past the last column
+void mapgenBorder(GeneratedMap* grid) {
+	mapgenFillSpan(grid, 0, 0, grid->width - 1, true);
+	mapgenFillSpan(grid, grid->height - 1, 0, grid->width - 1, true);
+	uint64_t padding = (grid->width & 63) ? ~0ull << (grid->width & 63) : 0;
+	for (int y = 0; y < grid->height; y++) {
+		uint64_t* row = grid->walls + (size_t)y * grid->rowWords;
+		row[0] |= 1;
+		row[(grid->width - 1) >> 6] |= 1ull << ((grid->width - 1) & 63);
+		row[grid->rowWords - 1] |= padding;
+	}
+}
+
+// Walls in each tile's row neighbourhood (left, self, right) as a two-bit number per bit
+// position, `low` and `high` holding its bits. Rows outside the grid count as solid.
+void mapgenRowSums(const GeneratedMap* grid, int y, uint64_t* low, uint64_t* high) {
+	if (y < 0 || y >= grid->height) {
+		for (int w = 0; w < grid->rowWords; w++) low[w] = high[w] = ~0ull;
+		return;
+	}
+	const uint64_t* row = grid->walls + (size_t)y * grid->rowWords;
+	for (int w = 0; w < grid->rowWords; w++) {
+		uint64_t self = row[w];
+		uint64_t left = (self << 1) | (w > 0 ? row[w - 1] >> 63 : 1);
+		uint64_t right = (self >> 1) | (w + 1 < grid->rowWords ? row[w + 1] << 63 : 1ull << 63);
+		low[w] = left ^ self ^ right;
+		high[w] = (left & self) | (right & (left ^ self));
+	}
+}
+
+// One automaton step: a tile becomes a wall when at least 5 of the 9 tiles around and
+// including it are walls. Adds up the three row sums as bit planes, 64 tiles at a time, and
+// overwrites rows in place since each row's sums are taken before the row above it is written.
+void mapgenStep(GeneratedMap* grid, uint64_t* scratch) {
+	int n = grid->rowWords;
+	uint64_t* sums[3][2] = {
+		{ scratch, scratch + n }, { scratch + 2 * n, scratch + 3 * n }, { scratch + 4 * n, scratch + 5 * n }
+	};
+	mapgenRowSums(grid, -1, sums[0][0], sums[0][1]);
+	mapgenRowSums(grid, 0, sums[1][0], sums[1][1]);
+	for (int y = 0; y < grid->height; y++) {
+		uint64_t** above = sums[y % 3];
+		uint64_t** middle = sums[(y + 1) % 3];
+		uint64_t** below = sums[(y + 2) % 3];
+		mapgenRowSums(grid, y + 1, below[0], below[1]);
+
+		uint64_t* row = grid->walls + (size_t)y * n;
+		for (int w = 0; w < n; w++) {
+			uint64_t a0 = above[0][w], a1 = above[1][w];
+			uint64_t b0 = middle[0][w], b1 = middle[1][w];
+			uint64_t c0 = below[0][w], c1 = below[1][w];
+			uint64_t s0 = a0 ^ b0 ^ c0;
+			uint64_t carry0 = (a0 & b0) | (c0 & (a0 ^ b0));
+			uint64_t twos = a1 ^ b1 ^ c1;
+			uint64_t fours = (a1 & b1) | (c1 & (a1 ^ b1));
+			uint64_t s1 = twos ^ carry0;
+			uint64_t carry1 = twos & carry0;
+			uint64_t s2 = fours ^ carry1;
+			uint64_t s3 = fours & carry1;
+			row[w] = s3 | (s2 & (s1 | s0));  // Sum >= 5
+		}
+	}
+	mapgenBorder(grid);
+}
+
+// Splits the map into leaves, puts a room in each, then joins the two halves of every split
+// with an L-shaped corridor between points in their rooms. Children are always created after
+// their parent, so walking the nodes backwards joins every subtree before its parent.
+bool mapgenRooms(GeneratedMap* grid, uint64_t* rng) {
+	int capacity = 2 * (grid->width / MAPGEN_MIN_LEAF + 1) * (grid->height / MAPGEN_MIN_LEAF + 1) + 1;
+	MapgenNode* nodes = malloc(sizeof(MapgenNode) * capacity);
+	if (nodes == NULL) return false;
+	nodes[0] = (MapgenNode){ .x = 1, .y = 1, .width = grid->width - 2, .height = grid->height - 2, .left = -1, .right = -1 };
+	int count = 1;
+
+	for (int i = 0; i < count; i++) {
+		MapgenNode* node = &nodes[i];
+		bool splitX = node->width >= 2 * MAPGEN_MIN_LEAF && (node->width >= node->height || node->height < 2 * MAPGEN_MIN_LEAF);
+		bool splitY = !splitX && node->height >= 2 * MAPGEN_MIN_LEAF;
+		if ((splitX || splitY) && count + 2 <= capacity) {
+			node->left = count++;
+			node->right = count++;
+			if (splitX) {
+				int at = mapgenRange(rng, MAPGEN_MIN_LEAF, node->width - MAPGEN_MIN_LEAF);
+				nodes[node->left] = (MapgenNode){ .x = node->x, .y = node->y, .width = at, .height = node->height, .left = -1, .right = -1 };
+				nodes[node->right] = (MapgenNode){ .x = node->x + at, .y = node->y, .width = node->width - at, .height = node->height, .left = -1, .right = -1 };
+			}
+			else {
+				int at = mapgenRange(rng, MAPGEN_MIN_LEAF, node->height - MAPGEN_MIN_LEAF);
+				nodes[node->left] = (MapgenNode){ .x = node->x, .y = node->y, .width = node->width, .height = at, .left = -1, .right = -1 };
+				nodes[node->right] = (MapgenNode){ .x = node->x, .y = node->y + at, .width = node->width, .height = node->height - at, .left = -1, .right = -1 };
+			}
+			continue;
+		}
+
+		// Leaf: a room of up to half its size, with at least one tile of margin
+		int maxWidth = node->width / 2 > MAPGEN_MIN_ROOM ? node->width / 2 : MAPGEN_MIN_ROOM;
+		int maxHeight = node->height / 2 > MAPGEN_MIN_ROOM ? node->height / 2 : MAPGEN_MIN_ROOM;
+		int roomWidth = mapgenRange(rng, MAPGEN_MIN_ROOM, maxWidth);
+		int roomHeight = mapgenRange(rng, MAPGEN_MIN_ROOM, maxHeight);
+		int roomX = node->x + mapgenRange(rng, 1, node->width - roomWidth > 1 ? node->width - roomWidth - 1 : 1);
+		int roomY = node->y + mapgenRange(rng, 1, node->height - roomHeight > 1 ? node->height - roomHeight - 1 : 1);
+		mapgenCarve(grid, roomX, roomY, roomX + roomWidth - 1, roomY + roomHeight - 1);
+		node->pointX = roomX + roomWidth / 2;
+		node->pointY = roomY + roomHeight / 2;
+	}
+
+	for (int i = count - 1; i >= 0; i--) {
+		MapgenNode* node = &nodes[i];
+		if (node->left < 0) continue;
+		const MapgenNode* a = &nodes[node->left];
+		const MapgenNode* b = &nodes[node->right];
+		int x0 = a->pointX < b->pointX ? a->pointX : b->pointX;
+		int x1 = a->pointX < b->pointX ? b->pointX : a->pointX;
+		int y0 = a->pointY < b->pointY ? a->pointY : b->pointY;
+		int y1 = a->pointY < b->pointY ? b->pointY : a->pointY;
+		mapgenCarve(grid, x0, a->pointY, x1 + MAPGEN_CORRIDOR_WIDTH - 1, a->pointY + MAPGEN_CORRIDOR_WIDTH - 1);
+		mapgenCarve(grid, b->pointX, y0, b->pointX + MAPGEN_CORRIDOR_WIDTH - 1, y1 + MAPGEN_CORRIDOR_WIDTH - 1);
+		node->pointX = a->pointX;
+		node->pointY = a->pointY;
+	}
+
+	// The start room joins the tree through the root's point
+	mapgenCarve(grid, 1, 1, MAPGEN_START_ROOM_X1, MAPGEN_START_ROOM_Y1);
+	int startX = MAPGEN_START_ROOM_X1 / 2;
+	int startY = MAPGEN_START_ROOM_Y1 / 2;
+	int rootX = nodes[0].pointX;
+	int rootY = nodes[0].pointY;
+	mapgenCarve(grid, startX < rootX ? startX : rootX, startY, (startX < rootX ? rootX : startX) + MAPGEN_CORRIDOR_WIDTH - 1, startY + MAPGEN_CORRIDOR_WIDTH - 1);
+	mapgenCarve(grid, rootX, startY < rootY ? startY : rootY, rootX + MAPGEN_CORRIDOR_WIDTH - 1, (startY < rootY ? rootY : startY) + MAPGEN_CORRIDOR_WIDTH - 1);
+	free(nodes);
+	return true;
+}
+
+// First tile at or after x whose wall bit equals `wall`, width when there is none
+int mapgenNextTile(const GeneratedMap* grid, const uint64_t* row, int x, bool wall) {
+	while (x < grid->width) {
+		uint64_t word = wall ? row[x >> 6] : ~row[x >> 6];
+		word &= ~0ull << (x & 63);
+		if (word != 0) {
+			int found = (x & ~63) + lowestBit64(word);
+			return found < grid->width ? found : grid->width;
+		}
+		x = (x & ~63) + 64;
+	}
+	return grid->width;
+}
+
+int mapgenFind(MapgenRun* runs, int i) {
+	while (runs[i].parent != i) {
+		runs[i].parent = runs[runs[i].parent].parent;  // Path halving
+		i = runs[i].parent;
+	}
+	return i;
+}
+
+// Labels the open tiles by runs, joining runs that share a column with one in the row above
+// (the four-way moves findPath makes), then walls off every run not joined to the start tile
+bool mapgenConnect(GeneratedMap* grid, int startX, int startY) {
+	int capacity = grid->width * 4;
+	MapgenRun* runs = malloc(sizeof(MapgenRun) * capacity);
+	int* rowStart = malloc(sizeof(int) * (grid->height + 1));
+	if (runs == NULL || rowStart == NULL) {
+		free(runs);
+		free(rowStart);
+		return false;
+	}
+
+	int count = 0;
+	for (int y = 0; y < grid->height; y++) {
+		const uint64_t* row = grid->walls + (size_t)y * grid->rowWords;
+		rowStart[y] = count;
+		int above = y > 0 ? rowStart[y - 1] : 0;
+		int aboveEnd = count;
+		for (int x = mapgenNextTile(grid, row, 0, false); x < grid->width; x = mapgenNextTile(grid, row, x, false)) {
+			int end = mapgenNextTile(grid, row, x, true);
+			if (count == capacity) {
+				capacity *= 2;
+				MapgenRun* grown = realloc(runs, sizeof(MapgenRun) * capacity);
+				if (grown == NULL) {
+					free(runs);
+					free(rowStart);
+					return false;
 				}
+				runs = grown;
 			}
+			runs[count] = (MapgenRun){ x, end - 1, count };
+			while (above < aboveEnd && runs[above].to < x) above++;
+			for (int k = above; k < aboveEnd && runs[k].from <= end - 1; k++) {
+				int a = mapgenFind(runs, k);
+				int b = mapgenFind(runs, count);
+				if (a < b) runs[b].parent = a;
+				else if (b < a) runs[a].parent = b;
+			}
+			count++;
+			x = end;
 		}
 	}
-	return model;
+	rowStart[grid->height] = count;
+
+	int keep = -1;
+	for (int i = rowStart[startY]; i < rowStart[startY + 1]; i++) {
+		if (runs[i].from <= startX && runs[i].to >= startX) keep = mapgenFind(runs, i);
+	}
+	grid->openTiles = 0;
+	grid->prunedTiles = 0;
+	for (int y = 0; y < grid->height; y++) {
+		for (int i = rowStart[y]; i < rowStart[y + 1]; i++) {
+			int length = runs[i].to - runs[i].from + 1;
+			if (mapgenFind(runs, i) == keep) {
+				grid->openTiles += length;
+				continue;
+			}
+			mapgenFillSpan(grid, y, runs[i].from, runs[i].to, true);
+			grid->prunedTiles += length;
+		}
+	}
+	free(runs);
+	free(rowStart);
+	return keep >= 0;
+}
+
+void freeGeneratedMap(GeneratedMap* grid) {
+	free(grid->walls);
+	grid->walls = NULL;
+}
+
+bool generateMap(GeneratedMap* grid, int width, int height, unsigned int seed) {
+	memset(grid, 0, sizeof(*grid));
+	if (width < MAPGEN_MIN_WIDTH || height < MAPGEN_MIN_HEIGHT) return false;
+	grid->width = width;
+	grid->height = height;
+	grid->rowWords = (width + 63) / 64;
+	grid->walls = malloc(sizeof(uint64_t) * (size_t)grid->rowWords * height);
+	uint64_t* scratch = malloc(sizeof(uint64_t) * 6 * grid->rowWords);
+	if (grid->walls == NULL || scratch == NULL) {
+		free(scratch);
+		freeGeneratedMap(grid);
+		return false;
+	}
+	uint64_t rng = ((uint64_t)seed << 32) ^ 0x9E3779B97F4A7C15ull;
+
+	// About 47% walls: a & (b | c | d | e) is set with probability 1/2 * 15/16
+	double start = monotonicNow();
+	size_t words = (size_t)grid->rowWords * height;
+	for (size_t w = 0; w < words; w++) {
+		uint64_t a = mapgenRand(&rng), b = mapgenRand(&rng), c = mapgenRand(&rng), d = mapgenRand(&rng), e = mapgenRand(&rng);
+		grid->walls[w] = a & (b | c | d | e);
+	}
+	mapgenBorder(grid);
+	double now = monotonicNow();
+	grid->phaseSeconds[MapgenNoise] = now - start;
+
+	start = now;
+	for (int step = 0; step < MAPGEN_CA_STEPS; step++) {
+		mapgenStep(grid, scratch);
+	}
+	free(scratch);
+	now = monotonicNow();
+	grid->phaseSeconds[MapgenCaves] = now - start;
+
+	start = now;
+	bool ok = mapgenRooms(grid, &rng);
+	now = monotonicNow();
+	grid->phaseSeconds[MapgenRooms] = now - start;
+
+	start = now;
+	ok = ok && mapgenConnect(grid, MAPGEN_START_ROOM_X1 / 2, MAPGEN_START_ROOM_Y1 / 2);
+	grid->phaseSeconds[MapgenConnect] = monotonicNow() - start;
+	if (!ok) freeGeneratedMap(grid);
+	return ok;
+}
+
+// Tiles past the generated size, when the world rounds up to whole chunks, are rock
+char generatedWorldTile(const void* source, int x, int y, int width, int height) {
+	const GeneratedMap* grid = source;
+	if (x >= grid->width || y >= grid->height) return '#';
+	return mapgenWall(grid, x, y) ? '#' : '.';
+}
+
+int runMapgenBenchmark(int size, int runs) {
+	printf("mapgen: %dx%d tiles, %d runs, %d automaton steps\n", size, size, runs, MAPGEN_CA_STEPS);
+	printf("%6s %10s %10s %10s %10s %10s %12s %10s %10s\n", "seed", mapgenPhaseNames[0], mapgenPhaseNames[1], mapgenPhaseNames[2], mapgenPhaseNames[3], "total ms", "Mcells/s", "MB/s", "open");
+	double best = INFINITY;
+	for (int run = 0; run < runs; run++) {
+		GeneratedMap grid;
+		if (!generateMap(&grid, size, size, GAME_DEFAULT_SEED + run)) {
+			printf("mapgen: generation failed\n");
+			return 1;
+		}
+		double total = 0;
+		for (int phase = 0; phase < MapgenPhaseCount; phase++) total += grid.phaseSeconds[phase];
+		if (total < best) best = total;
+		double cells = (double)size * size;
+		// MB/s counts the map at one byte per tile, the way `map` and world files store it
+		printf("%6d %10.1f %10.1f %10.1f %10.1f %10.1f %12.1f %10.1f %9.1f%%\n", run,
+			grid.phaseSeconds[MapgenNoise] * 1000, grid.phaseSeconds[MapgenCaves] * 1000, grid.phaseSeconds[MapgenRooms] * 1000, grid.phaseSeconds[MapgenConnect] * 1000,
+			total * 1000, cells / total / 1e6, cells / total / (1024 * 1024), 100.0 * grid.openTiles / cells);
+		freeGeneratedMap(&grid);
+	}
+	printf("best: %.1f ms\n", best * 1000);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region Batch
+
+#define BATCH_MAX_THREADS 64
+#define BATCH_DT (1.0f / 60.0f)
+#define BATCH_OBSERVATION_SIZE (MAX_PLAYERS + 3)  // Health of each player slot, gold, kills, stage
+
+// Input of one player for the coming tick of one instance
+typedef PlayerInput (*InputPolicy)(const GameModel* model, int instance, int player, void* user);
+
+typedef struct GameBatch GameBatch;
+
+typedef struct BatchWorker {
+	GameBatch* batch;
+	int first, last;  // Instances [first, last) stepped by this worker
+	EventQueue events;  // A worker raises events for its own games only
+	thrd_t thread;
+} BatchWorker;
+
+// Independent games stepped together, one tick boundary for all of them. Instance i's inputs,
+// observation, reward and done flag are row i of flat arrays allocated once, so a trainer can
+// read and write them in place between steps.
+struct GameBatch {
+	int instanceCount;
+	int playerCount;
+	int tileSize;
+	int episodeLength;  // Ticks before an instance counts as done, 0 for no limit
+	bool autoReset;  // Restart finished instances at their next step
+	GameModel* models;
+	int* episodeTicks;
+	PlayerInput* inputs;  // instanceCount * MAX_PLAYERS, read when policy is NULL
+	InputPolicy policy;
+	void* policyData;
+	float* observations;  // instanceCount * BATCH_OBSERVATION_SIZE
+	float* rewards;  // Change in score over the last step
+	unsigned char* done;
+
+	int threadCount;
+	BatchWorker workers[BATCH_MAX_THREADS];  // workers[0] runs on the caller's thread
+	mtx_t lock;
+	cnd_t start;
+	cnd_t finished;
+	int generation;  // Bumped to release the workers into a step
+	int ticks;  // Ticks per instance in the current step
+	int pending;  // Workers yet to finish the current step
+	bool quitting;
+};
+
+int cpuCount(void) {
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
 }
 
-GameModel updateGold(GameModel model, float deltaTime) {
-	for (int i = 0; i < MAX_GOLD; i++) {
-		if (model.gold[i].active) {
-			// Update position based on velocity
-			model.gold[i].position.x += model.gold[i].velocity.x * deltaTime;
-			model.gold[i].position.y += model.gold[i].velocity.y * deltaTime;
+// What a reward is measured against: loot and kills gained, health kept
+float batchScore(const GameModel* model) {
+	float score = (float)(model->goldCollected + model->killCount);
+	for (int p = 0; p < model->playerCount; p++) score += model->players[p].health;
+	return score;
+}
+
+void batchObserve(GameBatch* batch, int instance) {
+	const GameModel* model = &batch->models[instance];
+	float* row = batch->observations + (size_t)instance * BATCH_OBSERVATION_SIZE;
+	for (int p = 0; p < MAX_PLAYERS; p++) row[p] = p < model->playerCount ? (float)model->players[p].health : 0.0f;
+	row[MAX_PLAYERS] = (float)model->goldCollected;
+	row[MAX_PLAYERS + 1] = (float)model->killCount;
+	row[MAX_PLAYERS + 2] = (float)model->stage;
+}
 
-			// Gradually slow down the gold pieces
-			model.gold[i].velocity.x *= 0.9f;
-			model.gold[i].velocity.y *= 0.9f;
+bool batchFinished(const GameBatch* batch, int instance) {
+	const GameModel* model = &batch->models[instance];
+	if (batch->episodeLength > 0 && batch->episodeTicks[instance] >= batch->episodeLength) return true;
+	for (int p = 0; p < model->playerCount; p++) {
+		if (model->players[p].health <= 0) return true;
+	}
+	return false;
+}
 
-			// Stop the gold after it slows down enough
-			if (fabs(model.gold[i].velocity.x) < 0.1f && fabs(model.gold[i].velocity.y) < 0.1f) {
-				model.gold[i].velocity.x = 0.0f;
-				model.gold[i].velocity.y = 0.0f;
+void batchRun(GameBatch* batch, BatchWorker* worker, int ticks) {
+	EventQueue* previous = activeEvents;
+	activeEvents = &worker->events;
+	for (int i = worker->first; i < worker->last; i++) {
+		GameModel* model = &batch->models[i];
+		if (batch->done[i]) {
+			if (!batch->autoReset) {
+				batch->rewards[i] = 0.0f;
+				continue;
 			}
+			// The finished game's rng seeds the next one, so restarts stay reproducible
+			*model = setup(batch->tileSize, batch->playerCount, model->rngState);
+			batch->episodeTicks[i] = 0;
+			batch->done[i] = 0;
 		}
-		if (model.gold[i].active && CheckCollisionRecs(
-			(Rectangle) {
-			model.player.position.x, model.player.position.y, model.player.size, model.player.size
-		},
-			(Rectangle) {
-			model.gold[i].position.x, model.gold[i].position.y, model.gold[i].size, model.gold[i].size
-		})) {
 
-			model.gold[i].active = false;
-			spawnParticles(model.particles, model.gold[i].position, 20, GOLD);
-			model.goldCollected++;
+		float before = batchScore(model);
+		for (int t = 0; t < ticks && !batch->done[i]; t++) {
+			PlayerInput inputs[MAX_PLAYERS] = { 0 };
+			for (int p = 0; p < batch->playerCount; p++) {
+				inputs[p] = batch->policy != NULL
+					? batch->policy(model, i, p, batch->policyData)
+					: batch->inputs[(size_t)i * MAX_PLAYERS + p];
+			}
+			*model = update(*model, inputs, BATCH_DT, batch->tileSize);
+			batch->episodeTicks[i]++;
+			batch->done[i] = batchFinished(batch, i);
 		}
+		batch->rewards[i] = batchScore(model) - before;
+		batchObserve(batch, i);
 	}
-	return model;
+	activeEvents = previous;
 }
 
-GameModel updatePlayerMovement(GameModel model, float deltaTime, int tileSize)
-{
-	Vector2 newPosition = model.player.position;
-	model.player.isMoving = false;
-	if (IsKeyDown(KEY_RIGHT)) {
-		newPosition.x += model.player.speed * deltaTime;
-		model.player.direction = (Vector2){ 1, 0 };
-		model.player.isMoving = true;
+int batchWorkerMain(void* arg) {
+	BatchWorker* worker = arg;
+	GameBatch* batch = worker->batch;
+	int seen = 0;
+	mtx_lock(&batch->lock);
+	while (true) {
+		while (batch->generation == seen && !batch->quitting) cnd_wait(&batch->start, &batch->lock);
+		if (batch->quitting) break;
+		seen = batch->generation;
+		int ticks = batch->ticks;
+		mtx_unlock(&batch->lock);
+
+		batchRun(batch, worker, ticks);
+
+		mtx_lock(&batch->lock);
+		if (--batch->pending == 0) cnd_signal(&batch->finished);
+	}
+	mtx_unlock(&batch->lock);
+	return 0;
+}
+
+void batchDestroy(GameBatch* batch) {
+	if (batch == NULL) return;
+	mtx_lock(&batch->lock);
+	batch->quitting = true;
+	cnd_broadcast(&batch->start);
+	mtx_unlock(&batch->lock);
+	for (int w = 1; w < batch->threadCount; w++) thrd_join(batch->workers[w].thread, NULL);
+	mtx_destroy(&batch->lock);
+	cnd_destroy(&batch->start);
+	cnd_destroy(&batch->finished);
+	free(batch->models);
+	free(batch->episodeTicks);
+	free(batch->inputs);
+	free(batch->observations);
+	free(batch->rewards);
+	free(batch->done);
+	free(batch);
+}
+
+// Builds every instance with setup() and starts threadCount - 1 workers, 0 picks one per core.
+// Instance i is seeded from seed and i, so a batch replays exactly given the same inputs.
+GameBatch* batchCreate(int instanceCount, int playerCount, int threadCount, unsigned int seed, int tileSize) {
+	if (threadCount <= 0) threadCount = cpuCount();
+	if (threadCount > BATCH_MAX_THREADS) threadCount = BATCH_MAX_THREADS;
+	if (threadCount > instanceCount) threadCount = instanceCount;
+
+	GameBatch* batch = calloc(1, sizeof(GameBatch));
+	if (batch == NULL) return NULL;
+	batch->instanceCount = instanceCount;
+	batch->playerCount = playerCount;
+	batch->tileSize = tileSize;
+	batch->models = malloc(sizeof(GameModel) * instanceCount);
+	batch->episodeTicks = calloc(instanceCount, sizeof(int));
+	batch->inputs = calloc((size_t)instanceCount * MAX_PLAYERS, sizeof(PlayerInput));
+	batch->observations = calloc((size_t)instanceCount * BATCH_OBSERVATION_SIZE, sizeof(float));
+	batch->rewards = calloc(instanceCount, sizeof(float));
+	batch->done = calloc(instanceCount, 1);
+	mtx_init(&batch->lock, mtx_plain);
+	cnd_init(&batch->start);
+	cnd_init(&batch->finished);
+	if (batch->models == NULL || batch->episodeTicks == NULL || batch->inputs == NULL ||
+		batch->observations == NULL || batch->rewards == NULL || batch->done == NULL) {
+		batchDestroy(batch);
+		return NULL;
 	}
-	if (IsKeyDown(KEY_LEFT)) {
-		newPosition.x -= model.player.speed * deltaTime;
-		model.player.direction = (Vector2){ -1, 0 };
-		model.player.isMoving = true;
+
+	for (int i = 0; i < instanceCount; i++) {
+		unsigned int instanceSeed = seed ^ (unsigned int)(i + 1) * 0x9E3779B1u;
+		batch->models[i] = setup(tileSize, playerCount, instanceSeed);
+		batchObserve(batch, i);
 	}
-	if (IsKeyDown(KEY_UP)) {
-		newPosition.y -= model.player.speed * deltaTime;
-		model.player.direction = (Vector2){ 0, -1 };
-		model.player.isMoving = true;
+
+	// Contiguous ranges keep each worker on its own models, no two threads share a cache line of state
+	for (int w = 0; w < threadCount; w++) {
+		BatchWorker* worker = &batch->workers[w];
+		worker->batch = batch;
+		worker->first = (int)((long long)instanceCount * w / threadCount);
+		worker->last = (int)((long long)instanceCount * (w + 1) / threadCount);
 	}
-	if (IsKeyDown(KEY_DOWN)) {
-		newPosition.y += model.player.speed * deltaTime;
-		model.player.direction = (Vector2){ 0, 1 };
-		model.player.isMoving = true;
+	batch->threadCount = 1;
+	for (int w = 1; w < threadCount; w++) {
+		if (thrd_create(&batch->workers[w].thread, batchWorkerMain, &batch->workers[w]) != thrd_success) {
+			batchDestroy(batch);
+			return NULL;
+		}
+		batch->threadCount++;
 	}
+	return batch;
+}
 
-	// Define the player and map rectangles
-	Rectangle playerRect = {
-		model.player.position.x - 10,
-		model.player.position.y - 10,
-		model.player.size - 10,  // Assuming player size is defined
-		model.player.size - 10  // Assuming player size is defined
-	};
+// Advance every instance by ticks, then refresh observations, rewards and done flags.
+// Returns once all instances have reached the same tick.
+void batchStep(GameBatch* batch, int ticks) {
+	mtx_lock(&batch->lock);
+	batch->ticks = ticks;
+	batch->pending = batch->threadCount - 1;
+	batch->generation++;
+	cnd_broadcast(&batch->start);
+	mtx_unlock(&batch->lock);
+
+	batchRun(batch, &batch->workers[0], ticks);
+
+	mtx_lock(&batch->lock);
+	while (batch->pending > 0) cnd_wait(&batch->finished, &batch->lock);
+	mtx_unlock(&batch->lock);
+}
 
-	// Track the original position to revert if collision occurs
-	Vector2 originalPosition = model.player.position;
+typedef struct BotPolicy {
+	unsigned int rng;
+	PlayerInput held;
+} BotPolicy;
 
-	// Move player to the new position
-	model.player.position = newPosition;
-	playerRect.x = model.player.position.x;
-	playerRect.y = model.player.position.y;
+PlayerInput botPolicy(const GameModel* model, int instance, int player, void* user) {
+	BotPolicy* bot = &((BotPolicy*)user)[instance * MAX_PLAYERS + player];
+	return botInput(&bot->rng, &bot->held);
+}
 
-	// Check collisions and adjust position if needed
-	bool collisionDetected = false;
+// Aggregate ticks per second of bot-driven games at 1, 2, 4... threads up to maxThreads
+int runBatchBenchmark(int instanceCount, int ticks, int maxThreads, int tileSize) {
+	if (maxThreads <= 0) maxThreads = cpuCount();
+	BotPolicy* bots = malloc(sizeof(BotPolicy) * instanceCount * MAX_PLAYERS);
+	if (bots == NULL) return 1;
+
+	printf("batch: %d instances x %d ticks, %zu bytes per instance, %d cores\n",
+		instanceCount, ticks, sizeof(GameModel), cpuCount());
+	// The checksum over every instance must not depend on the thread count
+	printf("%8s %14s %12s %10s %10s\n", "threads", "ticks/s", "per thread", "scaling", "checksum");
+	double single = 0.0;
+	for (int threads = 1; ; threads = threads * 2 > maxThreads && threads < maxThreads ? maxThreads : threads * 2) {
+		for (int i = 0; i < instanceCount * MAX_PLAYERS; i++) bots[i] = (BotPolicy){ 0x2545F491u * (i + 1), 0 };
+		GameBatch* batch = batchCreate(instanceCount, 1, threads, 1, tileSize);
+		if (batch == NULL) {
+			free(bots);
+			return 1;
+		}
+		batch->policy = botPolicy;
+		batch->policyData = bots;
+		batch->autoReset = true;
+		batch->episodeLength = 60 * 60;
+
+		double start = monotonicNow();
+		for (int t = 0; t < ticks; t++) batchStep(batch, 1);
+		double rate = (double)instanceCount * ticks / (monotonicNow() - start);
+		if (threads == 1) single = rate;
+		unsigned int checksum = 2166136261u;
+		for (int i = 0; i < instanceCount; i++) {
+			unsigned int instance = modelChecksum(&batch->models[i]);
+			HASH_FIELD(checksum, instance);
+		}
+		printf("%8d %14.0f %12.0f %9.2fx %10x\n", batch->threadCount, rate, rate / batch->threadCount, rate / single, checksum);
+		batchDestroy(batch);
+		if (threads >= maxThreads) break;
+	}
+	free(bots);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region Draw
+
+#define RENDER_MAX_COMMANDS (MAX_CRATES + MAX_PLAYERS * 2 + MAX_ENEMIES * 3 + MAX_NPCS + MAX_DAMAGE_PARTICLES + 3)
+#define RENDER_MAX_INSTANCES (MAX_GOLD + BULLET_POOL + MAX_PARTICLES)  // Gold, bullets and particles go out in batches
+#define DIALOG_TEXT_MAX 160
+
+typedef enum {
+	ShapeRect,
+	ShapeSprite,
+	ShapeCircle,  // Only inside batches, see QuadInstance
+	ShapeNumber,  // Damage number, value is the amount
+	ShapeInstances  // A batch, rect.x is the first instance and rect.width the count
+} ShapeType;
+
+// One quad of a batched layer. Circles are centred on position with size the radius,
+// squares have their top left corner at position and size as the side.
+typedef struct QuadInstance {
+	Vector2 position;
+	float size;
+	Color color;
+	unsigned char shape;  // ShapeRect or ShapeCircle
+} QuadInstance;
+
+typedef struct DrawCommand {
+	Rectangle rect;
+	Color color;
+	unsigned char type;
+	unsigned char sprite;
+	unsigned char frame;
+	short value;
+} DrawCommand;
+
+// Everything one frame draws, captured from the model in draw order. It holds copies only,
+// so it stays valid while the simulation moves on and can be drawn on another thread.
+typedef struct RenderState {
+	int tick;
+	Vector2 cameraTarget;
+	char tiles[MAP_HEIGHT][MAP_WIDTH];  // The map may be streamed while a frame is drawn
+	unsigned int visible[MAP_HEIGHT][FOV_ROW_WORDS];  // The local player's view, the rest is fogged
+	int commandCount;
+	DrawCommand commands[RENDER_MAX_COMMANDS];
+	int instanceCount;
+	QuadInstance instances[RENDER_MAX_INSTANCES];
+	char dialog[DIALOG_TEXT_MAX];  // Empty when the local player is not at an NPC
+	int health;
+	int gold;
+} RenderState;
+
+void renderPush(RenderState* state, DrawCommand command) {
+	if (state->commandCount < RENDER_MAX_COMMANDS) state->commands[state->commandCount++] = command;
+}
+
+void renderRect(RenderState* state, float x, float y, float width, float height, Color color) {
+	renderPush(state, (DrawCommand) { .rect = { x, y, width, height }, .color = color, .type = ShapeRect });
+}
+
+void renderSprite(RenderState* state, Vector2 position, SpriteId sprite, int frame, Color color) {
+	renderPush(state, (DrawCommand) { .rect = { position.x, position.y, 8 * SPRITE_SCALE, 8 * SPRITE_SCALE }, .color = color, .type = ShapeSprite, .sprite = sprite, .frame = frame });
+}
+
+// Opens a batch; instances pushed until the next renderEndBatch draw as one command
+int renderBeginBatch(RenderState* state) {
+	return state->instanceCount;
+}
+
+void renderEndBatch(RenderState* state, int first) {
+	if (state->instanceCount > first) {
+		renderPush(state, (DrawCommand) { .rect = { (float)first, 0, (float)(state->instanceCount - first), 0 }, .type = ShapeInstances });
+	}
+}
+
+void renderParticles(RenderState* state, EcsWorld* world) {
+	int first = renderBeginBatch(state);
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition) | COMPONENT(ComponentTint) | COMPONENT(ComponentFade), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(world, &query)) != NULL) {
+		Vector2* position = ecsColumn(world, chunk, ComponentPosition);
+		Color* tint = ecsColumn(world, chunk, ComponentTint);
+		int count = chunk->count < RENDER_MAX_INSTANCES - state->instanceCount ? chunk->count : RENDER_MAX_INSTANCES - state->instanceCount;
+		QuadInstance* out = &state->instances[state->instanceCount];
+		for (int i = 0; i < count; i++) {
+			out[i] = (QuadInstance){ position[i], 5, tint[i], ShapeCircle };
+		}
+		state->instanceCount += count;
+	}
+	renderEndBatch(state, first);
+}
+
+void renderDamageText(RenderState* state, EcsWorld* world) {
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition) | COMPONENT(ComponentTint) | COMPONENT(ComponentDamageText), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(world, &query)) != NULL) {
+		Vector2* position = ecsColumn(world, chunk, ComponentPosition);
+		Color* tint = ecsColumn(world, chunk, ComponentTint);
+		int* damageAmount = ecsColumn(world, chunk, ComponentDamageText);
+		for (int i = 0; i < chunk->count; i++) {
+			renderPush(state, (DrawCommand) { .rect = { position[i].x, position[i].y, 0, 20 }, .color = tint[i], .type = ShapeNumber, .value = (short)damageAmount[i] });
+		}
+	}
+}
+
+void renderCrates(RenderState* state, Crate crates[], KindInfo kind) {
+	for (int i = 0; i < MAX_CRATES; i++) {
+		if (crates[i].active) {
+			renderRect(state, crates[i].position.x, crates[i].position.y, kind.size, kind.size, kind.color);
+		}
+	}
+}
+
+void renderGold(RenderState* state, EcsWorld* world) {
+	int first = renderBeginBatch(state);
+	EcsQuery query = ecsQuery(COMPONENT(ComponentPosition) | COMPONENT(ComponentPickup), 0);
+	EcsChunk* chunk;
+	while ((chunk = ecsNext(world, &query)) != NULL) {
+		Vector2* position = ecsColumn(world, chunk, ComponentPosition);
+		Pickup* pickup = ecsColumn(world, chunk, ComponentPickup);
+		int count = chunk->count < RENDER_MAX_INSTANCES - state->instanceCount ? chunk->count : RENDER_MAX_INSTANCES - state->instanceCount;
+		QuadInstance* out = &state->instances[state->instanceCount];
+		for (int i = 0; i < count; i++) {
+			out[i] = (QuadInstance){ position[i], pickup[i].size / 2, YELLOW, ShapeCircle };
+		}
+		state->instanceCount += count;
+	}
+	renderEndBatch(state, first);
+}
+
+void renderBullets(RenderState* state, const Bullet bullets[], KindInfo kind) {
+	int first = renderBeginBatch(state);
+	for (int i = 0; i < BULLET_POOL && state->instanceCount < RENDER_MAX_INSTANCES; i++) {
+		if (bullets[i].active) {
+			state->instances[state->instanceCount++] = (QuadInstance){ bullets[i].position, kind.size, kind.color, ShapeRect };
+		}
+	}
+	renderEndBatch(state, first);
+}
+
+// Snapshot what localPlayer sees at tick, the animation frame follows the tick
+void captureRenderState(GameModel* model, int localPlayer, int tick, int tileSize, RenderState* state) {
+	int frame = (int)(tick * LOCKSTEP_DT / frameDuration) % 2;  // Toggle between 0 and 1 for animation
+	const Player* local = &model->players[localPlayer];
+	state->tick = tick;
+	state->cameraTarget = (Vector2){ local->position.x + local->size / 2, local->position.y + local->size / 2 };
+	for (int y = 0; y < MAP_HEIGHT; y++) {
+		memcpy(state->tiles[y], map[y], MAP_WIDTH);
+	}
+	memcpy(state->visible, model->fov[localPlayer].rows, sizeof(state->visible));
+	state->commandCount = 0;
+	state->instanceCount = 0;
+
+	renderCrates(state, model->crates, model->kinds[KindCrate]);
+	// Draw players based on their current state
+	for (int p = 0; p < model->playerCount; p++) {
+		renderSprite(state, model->players[p].position, model->players[p].isMoving ? SpritePlayerWalking : SpritePlayerIdle, frame, model->players[p].color);
+	}
+
+	renderGold(state, &model->ecs);
+
+	for (int i = 0; i < MAX_ENEMIES; i++) {
+		Rectangle bounds = { model->enemies[i].position.x, model->enemies[i].position.y, model->kinds[KindEnemy].size, model->kinds[KindEnemy].size };
+		if (model->enemies[i].active && fovSeesRect(&model->fov[localPlayer], bounds, tileSize)) {
+
+			float healthBarWidth = model->kinds[KindEnemy].size;
+			float healthBarHeight = 5.0f; // Height of the health bar
+			float healthPercentage = (float)model->enemies[i].health / 3; // Assuming max health is 10
+
+			renderRect(state, model->enemies[i].position.x, model->enemies[i].position.y - healthBarHeight - 2, healthBarWidth, healthBarHeight, DARKGRAY);
+			renderRect(state, model->enemies[i].position.x, model->enemies[i].position.y - healthBarHeight - 2, healthBarWidth * healthPercentage, healthBarHeight, RED);
+			renderSprite(state, model->enemies[i].position, SpriteEnemy, frame, RED);
+		}
+	}
+	for (int p = 0; p < model->playerCount; p++) {
+		const Sword* sword = &model->players[p].sword;
+		if (sword->active) {
+			renderRect(state, sword->position.x - sword->size.x / 2, sword->position.y - sword->size.y / 2, sword->size.x, sword->size.y, sword->color);
+		}
+	}
+	renderBullets(state, model->bullets, model->kinds[KindBullet]);
+	renderParticles(state, &model->ecs);
+	for (unsigned int awake = model->sleep.npcAwake; awake != 0; awake &= awake - 1) {
+		int i = lowestBit(awake);
+		renderSprite(state, model->npcs[i].position, SpriteNpc, frame, GREEN);
+	}
+
+	renderDamageText(state, &model->ecs);
+
+	state->dialog[0] = '\0';
+	if (local->activeDialog != NULL) {
+		strncpy(state->dialog, local->activeDialog, DIALOG_TEXT_MAX - 1);
+		state->dialog[DIALOG_TEXT_MAX - 1] = '\0';
+	}
+	state->health = local->health;
+	state->gold = model->goldCollected;
+}
+
+// Where a frame goes. raylibBackend draws to the window; the software rasterizer draws into
+// memory so frames can be timed and compared on machines without a GPU.
+typedef struct RenderBackend {
+	void* context;
+	void (*begin)(void* context, Color background);
+	void (*beginWorld)(void* context, Camera2D camera);
+	void (*endWorld)(void* context);
+	void (*rect)(void* context, int x, int y, int width, int height, Color color);
+	void (*circle)(void* context, Vector2 center, float radius, Color color);
+	void (*sprite)(void* context, Vector2 position, uint64_t mask, int scale, Color color);  // Set cells of an 8x8 mask
+	void (*text)(void* context, const char* text, int x, int y, int fontSize, Color color);
+	void (*instances)(void* context, const QuadInstance* instances, int count);  // Circles and squares in one go
+	void (*end)(void* context);
+} RenderBackend;
+
+// One square per set bit, in row order like the art
+void drawASCII(Vector2 position, uint64_t mask, int scale, Color color) {
+	for (uint64_t bits = mask; bits != 0; bits &= bits - 1) {
+		int cell = lowestBit64(bits);
+		DrawRectangle(position.x + (cell & 7) * scale, position.y + (cell >> 3) * scale, scale, scale, color);
+	}
+}
+
+void raylibBegin(void* context, Color background) {
+	BeginDrawing();
+	ClearBackground(background);
+}
+
+void raylibBeginWorld(void* context, Camera2D camera) {
+	BeginMode2D(camera);
+}
+
+void raylibEndWorld(void* context) {
+	EndMode2D();
+}
+
+void raylibRect(void* context, int x, int y, int width, int height, Color color) {
+	DrawRectangle(x, y, width, height, color);
+}
+
+void raylibCircle(void* context, Vector2 center, float radius, Color color) {
+	DrawCircleV(center, radius, color);
+}
+
+void raylibSprite(void* context, Vector2 position, uint64_t mask, int scale, Color color) {
+	drawASCII(position, mask, scale, color);
+}
+
+void raylibText(void* context, const char* text, int x, int y, int fontSize, Color color) {
+	DrawText(text, x, y, fontSize, color);
+}
+
+#define SHAPE_TEXTURE_SIZE 64
+
+// White disc with a soft one-pixel rim. Circles map the whole texture onto their quad and
+// squares sample its opaque middle, so a batch never switches texture.
+Texture2D shapeTexture;
+
+Texture2D loadShapeTexture(void) {
+	Image image = GenImageColor(SHAPE_TEXTURE_SIZE, SHAPE_TEXTURE_SIZE, BLANK);
+	Color* pixels = image.data;
+	float radius = SHAPE_TEXTURE_SIZE / 2.0f;
+	for (int y = 0; y < SHAPE_TEXTURE_SIZE; y++) {
+		for (int x = 0; x < SHAPE_TEXTURE_SIZE; x++) {
+			float dx = x + 0.5f - radius, dy = y + 0.5f - radius;
+			float coverage = radius - sqrtf(dx * dx + dy * dy) + 0.5f;
+			coverage = coverage < 0.0f ? 0.0f : coverage > 1.0f ? 1.0f : coverage;
+			pixels[y * SHAPE_TEXTURE_SIZE + x] = (Color){ 255, 255, 255, (unsigned char)(coverage * 255.0f) };
+		}
+	}
+	Texture2D texture = LoadTextureFromImage(image);
+	UnloadImage(image);
+	SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+	return texture;
+}
+
+// Straight into rlgl's vertex batch: four vertices per instance and no tessellation, so
+// a whole layer costs one draw call per RL_DEFAULT_BATCH_BUFFER_ELEMENTS quads.
+void raylibInstances(void* context, const QuadInstance* instances, int count) {
+	if (shapeTexture.id == 0) shapeTexture = loadShapeTexture();
+	rlSetTexture(shapeTexture.id);
+	rlBegin(RL_QUADS);
+	for (int i = 0; i < count; i++) {
+		const QuadInstance* instance = &instances[i];
+		float left = instance->position.x, top = instance->position.y, size = instance->size;
+		float u0 = 0.5f, v0 = 0.5f, u1 = 0.5f, v1 = 0.5f;
+		if (instance->shape == ShapeCircle) {
+			left -= size;
+			top -= size;
+			size *= 2.0f;
+			u0 = v0 = 0.0f;
+			u1 = v1 = 1.0f;
+		}
+		rlCheckRenderBatchLimit(4);
+		rlColor4ub(instance->color.r, instance->color.g, instance->color.b, instance->color.a);
+		rlTexCoord2f(u0, v0);
+		rlVertex2f(left, top);
+		rlTexCoord2f(u0, v1);
+		rlVertex2f(left, top + size);
+		rlTexCoord2f(u1, v1);
+		rlVertex2f(left + size, top + size);
+		rlTexCoord2f(u1, v0);
+		rlVertex2f(left + size, top);
+	}
+	rlEnd();
+	rlSetTexture(0);
+}
+
+void raylibEnd(void* context) {
+	EndDrawing();
+}
+
+const RenderBackend raylibBackend = {
+	NULL, raylibBegin, raylibBeginWorld, raylibEndWorld, raylibRect, raylibCircle, raylibSprite, raylibText, raylibInstances, raylibEnd
+};
+
+void drawCommands(const RenderState* state, const RenderBackend* backend) {
+	for (int i = 0; i < state->commandCount; i++) {
+		const DrawCommand* command = &state->commands[i];
+		switch (command->type) {
+		case ShapeRect:
+			backend->rect(backend->context, command->rect.x, command->rect.y, command->rect.width, command->rect.height, command->color);
+			break;
+		case ShapeSprite:
+			backend->sprite(backend->context, (Vector2) { command->rect.x, command->rect.y }, spriteMasks[command->sprite][command->frame], SPRITE_SCALE, command->color);
+			break;
+		case ShapeCircle:
+			break;
+		case ShapeInstances:
+			backend->instances(backend->context, &state->instances[(int)command->rect.x], (int)command->rect.width);
+			break;
+		case ShapeNumber: {
+			char damageText[16];
+			sprintf(damageText, "-%d", command->value);
+			backend->text(backend->context, damageText, command->rect.x, command->rect.y, command->rect.height, command->color);
+			break;
+		}
+		}
+	}
+}
+
+// World around the local player plus their dialog and HUD
+void drawFrame(const RenderState* state, const RenderBackend* backend, int screenWidth, int screenHeight, int tileSize) {
+	Camera2D camera = { 0 };
+	camera.target = state->cameraTarget;
+	camera.offset = (Vector2){ screenWidth / 2.0f, screenHeight / 2.0f };
+	camera.rotation = 0.0f;
+	camera.zoom = 1.0f;
+
+	backend->begin(backend->context, RAYWHITE);
+	backend->beginWorld(backend->context, camera);
+	// map
 	for (int y = 0; y < MAP_HEIGHT; y++) {
 		for (int x = 0; x < MAP_WIDTH; x++) {
-			if (map[y][x] == '#') {
-				Rectangle tileRect = {
-					x * tileSize,
-					y * tileSize,
-					tileSize,
-					tileSize
-				};
-				if (CheckCollisionRecs(playerRect, tileRect)) {
-					collisionDetected = true;
+			if (state->tiles[y][x] == '#') {
+				backend->rect(backend->context, x * tileSize, y * tileSize, tileSize, tileSize, GRAY);
+			}
+		}
+	}
+	drawCommands(state, backend);
+	// Fog over everything the local player cannot see, remembered tiles and loot still show through
+	for (int y = 0; y < MAP_HEIGHT; y++) {
+		for (int x = 0; x < MAP_WIDTH; x++) {
+			if (!((state->visible[y][x >> 5] >> (x & 31)) & 1)) {
+				backend->rect(backend->context, x * tileSize, y * tileSize, tileSize, tileSize, Fade(BLACK, 0.5f));
+			}
+		}
+	}
+	backend->endWorld(backend->context);
+	if (state->dialog[0] != '\0') {
+		backend->rect(backend->context, 50, screenHeight - 100, screenWidth - 100, 50, Fade(LIGHTGRAY, 0.8f));
+		backend->text(backend->context, state->dialog, 60, screenHeight - 90, 20, BLACK);
+	}
+	backend->text(backend->context, TextFormat("Health: %d", state->health), 10, 10, 20, BLACK);
+	backend->text(backend->context, TextFormat("Gold: %d", state->gold), 10, 30, 20, BLACK);
+	backend->end(backend->context);
+}
+#pragma endregion
 
-					// Move player back to original position
-					model.player.position = originalPosition;
-					playerRect.x = model.player.position.x;
-					playerRect.y = model.player.position.y;
 
-					// Handle collision by checking and resolving separately for X and Y axes
-					// Check horizontal collision
-					if (CheckCollisionRecs(playerRect, tileRect)) {
-						if (newPosition.x > originalPosition.x) {
-							// Player is moving right
-							model.player.position.x = tileRect.x - playerRect.width;
-						}
-						else {
-							// Player is moving left
-							model.player.position.x = tileRect.x + tileRect.width;
-						}
-					}
+#pragma region Raster
+
+#define RASTER_TILE 64  // Pixels per side of a bin, one bin is rasterized by one thread at a time
+#define RASTER_MAX_THREADS 16
+#define RASTER_MAX_PRIMITIVES 8192
+#define RASTER_GLYPH_WIDTH 5
+#define RASTER_GLYPH_HEIGHT 7
+
+// Classic 5x7 font for ASCII 32..126, one byte per column, bit 0 at the top
+static const unsigned char rasterFont[95][RASTER_GLYPH_WIDTH] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5F, 0x00, 0x00 }, { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7F, 0x14, 0x7F, 0x14 },
+	{ 0x24, 0x2A, 0x7F, 0x2A, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 }, { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+	{ 0x00, 0x1C, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1C, 0x00 }, { 0x08, 0x2A, 0x1C, 0x2A, 0x08 }, { 0x08, 0x08, 0x3E, 0x08, 0x08 },
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 }, { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+	{ 0x3E, 0x51, 0x49, 0x45, 0x3E }, { 0x00, 0x42, 0x7F, 0x40, 0x00 }, { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4B, 0x31 },
+	{ 0x18, 0x14, 0x12, 0x7F, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 }, { 0x3C, 0x4A, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1E }, { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+	{ 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 }, { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+	{ 0x32, 0x49, 0x79, 0x41, 0x3E }, { 0x7E, 0x11, 0x11, 0x11, 0x7E }, { 0x7F, 0x49, 0x49, 0x49, 0x36 }, { 0x3E, 0x41, 0x41, 0x41, 0x22 },
+	{ 0x7F, 0x41, 0x41, 0x22, 0x1C }, { 0x7F, 0x49, 0x49, 0x49, 0x41 }, { 0x7F, 0x09, 0x09, 0x01, 0x01 }, { 0x3E, 0x41, 0x41, 0x51, 0x32 },
+	{ 0x7F, 0x08, 0x08, 0x08, 0x7F }, { 0x00, 0x41, 0x7F, 0x41, 0x00 }, { 0x20, 0x40, 0x41, 0x3F, 0x01 }, { 0x7F, 0x08, 0x14, 0x22, 0x41 },
+	{ 0x7F, 0x40, 0x40, 0x40, 0x40 }, { 0x7F, 0x02, 0x04, 0x02, 0x7F }, { 0x7F, 0x04, 0x08, 0x10, 0x7F }, { 0x3E, 0x41, 0x41, 0x41, 0x3E },
+	{ 0x7F, 0x09, 0x09, 0x09, 0x06 }, { 0x3E, 0x41, 0x51, 0x21, 0x5E }, { 0x7F, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+	{ 0x01, 0x01, 0x7F, 0x01, 0x01 }, { 0x3F, 0x40, 0x40, 0x40, 0x3F }, { 0x1F, 0x20, 0x40, 0x20, 0x1F }, { 0x7F, 0x20, 0x18, 0x20, 0x7F },
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 }, { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7F, 0x41, 0x41, 0x00 },
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7F, 0x00 }, { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+	{ 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 }, { 0x7F, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+	{ 0x38, 0x44, 0x44, 0x48, 0x7F }, { 0x38, 0x54, 0x54, 0x54, 0x18 }, { 0x08, 0x7E, 0x09, 0x01, 0x02 }, { 0x08, 0x14, 0x54, 0x54, 0x3C },
+	{ 0x7F, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7D, 0x40, 0x00 }, { 0x20, 0x40, 0x44, 0x3D, 0x00 }, { 0x00, 0x7F, 0x10, 0x28, 0x44 },
+	{ 0x00, 0x41, 0x7F, 0x40, 0x00 }, { 0x7C, 0x04, 0x18, 0x04, 0x78 }, { 0x7C, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+	{ 0x7C, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7C }, { 0x7C, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+	{ 0x04, 0x3F, 0x44, 0x40, 0x20 }, { 0x3C, 0x40, 0x40, 0x20, 0x7C }, { 0x1C, 0x20, 0x40, 0x20, 0x1C }, { 0x3C, 0x40, 0x30, 0x40, 0x3C },
+	{ 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0C, 0x50, 0x50, 0x50, 0x3C }, { 0x44, 0x64, 0x54, 0x4C, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+	{ 0x00, 0x00, 0x7F, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 }, { 0x08, 0x04, 0x08, 0x10, 0x08 },
+};
 
-					// Update player rectangle position
-					playerRect.x = model.player.position.x;
-					playerRect.y = model.player.position.y;
+typedef enum RasterShape {
+	RasterRect,
+	RasterCircle,
+	RasterSprite,  // 8x8 mask, one scale x scale block per set bit
+	RasterGlyph,
+} RasterShape;
+
+// One draw call in screen pixels. Bounds are clipped to the framebuffer; x1 and y1 are exclusive.
+typedef struct RasterPrimitive {
+	unsigned char shape;
+	unsigned char glyph;  // Index into rasterFont
+	unsigned char alpha;
+	unsigned char scale;
+	int x0, y0, x1, y1;
+	int x, y;  // Unclipped origin of sprites and glyphs
+	float centerX, centerY, radius;
+	uint64_t mask;
+	uint32_t color;  // RGBA, alpha forced to 255, blended by the alpha field
+} RasterPrimitive;
+
+typedef struct SoftRenderer SoftRenderer;
+
+// Draws into a CPU framebuffer. Calls are only recorded; end() bins them into RASTER_TILE
+// tiles and rasterizes the tiles in parallel. Primitives touching a tile are applied in call
+// order, so the picture is the same whatever the thread count.
+struct SoftRenderer {
+	int width, height;
+	uint32_t* pixels;  // RGBA bytes in memory order, width * height
+	uint32_t background;
+	int offsetX, offsetY;  // World to screen while inside beginWorld
+	bool inWorld;
+	RasterPrimitive* primitives;
+	int primitiveCount;
+	int dropped;  // Calls beyond RASTER_MAX_PRIMITIVES this frame
+
+	int tilesX, tilesY;
+	int* binStarts;  // tilesX * tilesY + 1 offsets into binItems
+	int* binItems;  // Primitive indices per bin, in call order
+	int binCapacity;
+
+	int threadCount;
+	thrd_t threads[RASTER_MAX_THREADS];  // threads[0] is unused, the caller rasterizes too
+	mtx_t lock;
+	cnd_t start;
+	cnd_t finished;
+	int generation;
+	int pending;
+	bool quitting;
+	atomic_int nextBin;
+};
 
-					// Check vertical collision
-					if (CheckCollisionRecs(playerRect, tileRect)) {
-						if (newPosition.y > originalPosition.y) {
-							// Player is moving down
-							model.player.position.y = tileRect.y - playerRect.height;
-						}
-						else {
-							// Player is moving up
-							model.player.position.y = tileRect.y + tileRect.height;
-						}
-					}
+uint32_t rasterColor(Color color) {
+	return (uint32_t)color.r | (uint32_t)color.g << 8 | (uint32_t)color.b << 16 | 0xFF000000u;
+}
+
+// Fill or blend count pixels. Blending is exact (d * (255 - a) + s * a) / 255, rounded, and
+// the vector and scalar paths agree bit for bit.
+void spanFill(uint32_t* dst, int count, uint32_t color, unsigned char alpha) {
+	int i = 0;
+	if (alpha == 255) {
+#if defined(HAVE_SSE2)
+		__m128i fill = _mm_set1_epi32((int)color);
+		for (; i + 4 <= count; i += 4) _mm_storeu_si128((__m128i*)(dst + i), fill);
+#endif
+		for (; i < count; i++) dst[i] = color;
+		return;
+	}
+	if (alpha == 0) return;
+#if defined(HAVE_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	__m128i source = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero), _mm_set1_epi16(alpha));
+	__m128i keep = _mm_set1_epi16(255 - alpha);
+	__m128i half = _mm_set1_epi16(128);
+	for (; i + 4 <= count; i += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i low = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), keep), source), half);
+		__m128i high = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), keep), source), half);
+		low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+		high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(low, high));
+	}
+#endif
+	for (; i < count; i++) {
+		uint32_t out = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			unsigned int t = ((color >> shift) & 0xFF) * alpha + ((dst[i] >> shift) & 0xFF) * (255u - alpha) + 128u;
+			out |= (((t + (t >> 8)) >> 8) & 0xFF) << shift;
+		}
+		dst[i] = out;
+	}
+}
 
-					// Break out of loops once collision is resolved
-					break;
-				}
+// Span [from, to) of row y, clipped to the tile columns [left, right)
+void rasterSpan(SoftRenderer* renderer, int y, int from, int to, int left, int right, const RasterPrimitive* primitive) {
+	if (from < left) from = left;
+	if (to > right) to = right;
+	if (from < to) spanFill(renderer->pixels + (size_t)y * renderer->width + from, to - from, primitive->color, primitive->alpha);
+}
+
+void rasterPrimitive(SoftRenderer* renderer, const RasterPrimitive* primitive, int left, int top, int right, int bottom) {
+	if (primitive->y0 > top) top = primitive->y0;
+	if (primitive->y1 < bottom) bottom = primitive->y1;
+	int scale = primitive->scale;
+	for (int y = top; y < bottom; y++) {
+		switch (primitive->shape) {
+		case RasterRect:
+			rasterSpan(renderer, y, primitive->x0, primitive->x1, left, right, primitive);
+			break;
+		case RasterCircle: {
+			// Pixels whose centres fall inside the radius
+			float dy = y + 0.5f - primitive->centerY;
+			float reach = primitive->radius * primitive->radius - dy * dy;
+			if (reach < 0.0f) break;
+			float half = sqrtf(reach);
+			int from = (int)ceilf(primitive->centerX - half - 0.5f);
+			int to = (int)floorf(primitive->centerX + half - 0.5f) + 1;
+			rasterSpan(renderer, y, from, to, left, right, primitive);
+			break;
+		}
+		case RasterSprite: {
+			unsigned int row = (unsigned int)(primitive->mask >> ((y - primitive->y) / scale * 8)) & 0xFF;
+			for (int x = 0; x < 8; x++) {
+				if ((row >> x) & 1) rasterSpan(renderer, y, primitive->x + x * scale, primitive->x + (x + 1) * scale, left, right, primitive);
 			}
+			break;
+		}
+		case RasterGlyph: {
+			int bit = (y - primitive->y) / scale;
+			for (int x = 0; x < RASTER_GLYPH_WIDTH; x++) {
+				if ((rasterFont[primitive->glyph][x] >> bit) & 1) rasterSpan(renderer, y, primitive->x + x * scale, primitive->x + (x + 1) * scale, left, right, primitive);
+			}
+			break;
+		}
 		}
-		if (collisionDetected) break;
 	}
+}
 
-	return model;
+void rasterBin(SoftRenderer* renderer, int bin) {
+	int left = bin % renderer->tilesX * RASTER_TILE;
+	int top = bin / renderer->tilesX * RASTER_TILE;
+	int right = left + RASTER_TILE < renderer->width ? left + RASTER_TILE : renderer->width;
+	int bottom = top + RASTER_TILE < renderer->height ? top + RASTER_TILE : renderer->height;
+	for (int y = top; y < bottom; y++) spanFill(renderer->pixels + (size_t)y * renderer->width + left, right - left, renderer->background, 255);
+	for (int i = renderer->binStarts[bin]; i < renderer->binStarts[bin + 1]; i++) {
+		rasterPrimitive(renderer, &renderer->primitives[renderer->binItems[i]], left, top, right, bottom);
+	}
+}
 
+// Claims tiles until none are left
+void rasterRun(SoftRenderer* renderer) {
+	int bins = renderer->tilesX * renderer->tilesY;
+	for (int bin = atomic_fetch_add(&renderer->nextBin, 1); bin < bins; bin = atomic_fetch_add(&renderer->nextBin, 1)) {
+		rasterBin(renderer, bin);
+	}
 }
-// Calculate the movement step towards the next path node
-void moveEnemyTowards(Vector2* enemyPos, Vector2 targetPos, float speed, float deltaTime) {
-	// Calculate direction vector from enemy to the target position
-	Vector2 direction = { targetPos.x - enemyPos->x, targetPos.y - enemyPos->y };
 
-	// Calculate the distance to the target
-	float distanceToTarget = sqrtf(direction.x * direction.x + direction.y * direction.y);
+int rasterWorkerMain(void* arg) {
+	SoftRenderer* renderer = arg;
+	int seen = 0;
+	mtx_lock(&renderer->lock);
+	while (true) {
+		while (renderer->generation == seen && !renderer->quitting) cnd_wait(&renderer->start, &renderer->lock);
+		if (renderer->quitting) break;
+		seen = renderer->generation;
+		mtx_unlock(&renderer->lock);
 
-	if (distanceToTarget > 0) {
-		// Normalize the direction vector
-		direction.x /= distanceToTarget;
-		direction.y /= distanceToTarget;
+		rasterRun(renderer);
 
-		// Calculate the step size based on speed and deltaTime
-		float step = speed * deltaTime;
+		mtx_lock(&renderer->lock);
+		if (--renderer->pending == 0) cnd_signal(&renderer->finished);
+	}
+	mtx_unlock(&renderer->lock);
+	return 0;
+}
 
-		// Move the enemy towards the target position
-		if (step < distanceToTarget) {
-			enemyPos->x += direction.x * step;
-			enemyPos->y += direction.y * step;
+// Count, prefix sum and fill, like the spatial grid, so each bin lists its primitives in call order
+bool rasterBinPrimitives(SoftRenderer* renderer) {
+	int bins = renderer->tilesX * renderer->tilesY;
+	memset(renderer->binStarts, 0, sizeof(int) * (bins + 1));
+	for (int i = 0; i < renderer->primitiveCount; i++) {
+		const RasterPrimitive* primitive = &renderer->primitives[i];
+		for (int ty = primitive->y0 / RASTER_TILE; ty <= (primitive->y1 - 1) / RASTER_TILE; ty++) {
+			for (int tx = primitive->x0 / RASTER_TILE; tx <= (primitive->x1 - 1) / RASTER_TILE; tx++) renderer->binStarts[ty * renderer->tilesX + tx + 1]++;
 		}
-		else {
-			// If the step is larger than the distance, just snap to the target
-			enemyPos->x = targetPos.x;
-			enemyPos->y = targetPos.y;
+	}
+	for (int bin = 0; bin < bins; bin++) renderer->binStarts[bin + 1] += renderer->binStarts[bin];
+
+	int total = renderer->binStarts[bins];
+	if (total > renderer->binCapacity) {
+		int* items = realloc(renderer->binItems, sizeof(int) * total);
+		if (items == NULL) return false;
+		renderer->binItems = items;
+		renderer->binCapacity = total;
+	}
+	for (int i = 0; i < renderer->primitiveCount; i++) {
+		const RasterPrimitive* primitive = &renderer->primitives[i];
+		for (int ty = primitive->y0 / RASTER_TILE; ty <= (primitive->y1 - 1) / RASTER_TILE; ty++) {
+			for (int tx = primitive->x0 / RASTER_TILE; tx <= (primitive->x1 - 1) / RASTER_TILE; tx++) renderer->binItems[renderer->binStarts[ty * renderer->tilesX + tx]++] = i;
 		}
 	}
+	// The fill pass advanced every start to the next bin's, shift them back
+	for (int bin = bins; bin > 0; bin--) renderer->binStarts[bin] = renderer->binStarts[bin - 1];
+	renderer->binStarts[0] = 0;
+	return true;
 }
 
+// Clips the bounds and records the primitive, dropping it when empty or the frame is full
+void rasterPush(SoftRenderer* renderer, RasterPrimitive primitive, Color color) {
+	if (primitive.x0 < 0) primitive.x0 = 0;
+	if (primitive.y0 < 0) primitive.y0 = 0;
+	if (primitive.x1 > renderer->width) primitive.x1 = renderer->width;
+	if (primitive.y1 > renderer->height) primitive.y1 = renderer->height;
+	if (primitive.x0 >= primitive.x1 || primitive.y0 >= primitive.y1 || color.a == 0) return;
+	if (renderer->primitiveCount >= RASTER_MAX_PRIMITIVES) {
+		renderer->dropped++;
+		return;
+	}
+	primitive.color = rasterColor(color);
+	primitive.alpha = color.a;
+	renderer->primitives[renderer->primitiveCount++] = primitive;
+}
 
-GameModel updateEnemies(GameModel model, float deltaTime, int tileSize)
-{
-	for (int i = 0; i < MAX_ENEMIES; i++) {
-		if (model.enemies[i].active) {
-			// Update attack and damage text timers
-			if (model.enemies[i].attackCooldown > 0) {
-				model.enemies[i].attackCooldown -= deltaTime;
-			}
-			if (model.enemies[i].damageTextTimer > 0) {
-				model.enemies[i].damageTextTimer -= deltaTime;
-			}
+void softBegin(void* context, Color background) {
+	SoftRenderer* renderer = context;
+	renderer->background = rasterColor(background);
+	renderer->primitiveCount = 0;
+	renderer->dropped = 0;
+	renderer->inWorld = false;
+}
 
-			// Pathfinding
-			Node* path = findPath(model.enemies[i].position, model.player.position, tileSize);
-			if (path != NULL) {
-				Vector2 nextPosition = getNextPathPosition(path, &model.enemies[i], tileSize);
+void softBeginWorld(void* context, Camera2D camera) {
+	SoftRenderer* renderer = context;
+	renderer->offsetX = (int)floorf(camera.offset.x - camera.target.x + 0.5f);
+	renderer->offsetY = (int)floorf(camera.offset.y - camera.target.y + 0.5f);
+	renderer->inWorld = true;
+}
 
-				// Move enemy towards the next path node using their speed and deltaTime
-				Vector2 desiredPosition = model.enemies[i].position;
-				moveEnemyTowards(&desiredPosition, nextPosition, model.enemies[i].speed, deltaTime);
-
-				// Check map collisions and adjust position if necessary
-				int enemyMapX = desiredPosition.x / tileSize;
-				int enemyMapY = desiredPosition.y / tileSize;
-
-				if (enemyMapY >= 0 && enemyMapY < MAP_HEIGHT && enemyMapX >= 0 && enemyMapX < MAP_WIDTH) {
-					if (map[enemyMapY][enemyMapX] != '#') {
-						Rectangle enemyRect = { desiredPosition.x, desiredPosition.y, model.enemies[i].size, model.enemies[i].size };
-						Rectangle playerRect = { model.player.position.x, model.player.position.y, model.player.size, model.player.size };
-
-						bool collisionWithPlayer = CheckCollisionRecs(enemyRect, playerRect);
-						if (collisionWithPlayer && model.enemies[i].attackCooldown <= 0) {
-							model.player.health--;
-							spawnDamageParticle(&model,
-								(Vector2) {
-								model.player.position.x + model.player.size / 2, model.player.position.y
-							}, 1, BLUE);
-							model.enemies[i].attackCooldown = 1.0f;
-							spawnParticles(model.particles, (Vector2) { model.player.position.x + model.player.size / 2, model.player.position.y + model.player.size / 2 }, 10, BLUE);
-						}
+void softEndWorld(void* context) {
+	((SoftRenderer*)context)->inWorld = false;
+}
 
-						bool collisionWithOtherEnemy = false;
-						for (int j = 0; j < MAX_ENEMIES; j++) {
-							if (j != i && model.enemies[j].active) {
-								Rectangle otherEnemyRect = { model.enemies[j].position.x, model.enemies[j].position.y, model.enemies[j].size, model.enemies[j].size };
-								if (CheckCollisionRecs(enemyRect, otherEnemyRect)) {
-									collisionWithOtherEnemy = true;
-									break;
-								}
-							}
-						}
+void softRect(void* context, int x, int y, int width, int height, Color color) {
+	SoftRenderer* renderer = context;
+	if (renderer->inWorld) {
+		x += renderer->offsetX;
+		y += renderer->offsetY;
+	}
+	rasterPush(renderer, (RasterPrimitive) { .shape = RasterRect, .x0 = x, .y0 = y, .x1 = x + width, .y1 = y + height }, color);
+}
 
-						if (!collisionWithPlayer && !collisionWithOtherEnemy) {
-							model.enemies[i].position = desiredPosition; // Update position if no collision
-						}
-						else {
-							// Adjust position if there's a collision
-							Vector2 tempPosition = model.enemies[i].position;
-
-							// Try adjusting the position along X
-							tempPosition.x = desiredPosition.x;
-							enemyRect.x = tempPosition.x;
-
-							bool collisionX = CheckCollisionRecs(enemyRect, playerRect);
-							collisionWithOtherEnemy = false;
-							for (int j = 0; j < MAX_ENEMIES; j++) {
-								if (j != i && model.enemies[j].active) {
-									Rectangle otherEnemyRect = { model.enemies[j].position.x, model.enemies[j].position.y, model.enemies[j].size, model.enemies[j].size };
-									if (CheckCollisionRecs(enemyRect, otherEnemyRect)) {
-										collisionWithOtherEnemy = true;
-										break;
-									}
-								}
-							}
-
-							if (!collisionX && !collisionWithOtherEnemy) {
-								model.enemies[i].position.x = tempPosition.x;
-							}
-
-							// Try adjusting the position along Y
-							tempPosition = model.enemies[i].position;
-							tempPosition.y = desiredPosition.y;
-							enemyRect.y = tempPosition.y;
-
-							bool collisionY = CheckCollisionRecs(enemyRect, playerRect);
-							collisionWithOtherEnemy = false;
-							for (int j = 0; j < MAX_ENEMIES; j++) {
-								if (j != i && model.enemies[j].active) {
-									Rectangle otherEnemyRect = { model.enemies[j].position.x, model.enemies[j].position.y, model.enemies[j].size, model.enemies[j].size };
-									if (CheckCollisionRecs(enemyRect, otherEnemyRect)) {
-										collisionWithOtherEnemy = true;
-										break;
-									}
-								}
-							}
-
-							if (!collisionY && !collisionWithOtherEnemy) {
-								model.enemies[i].position.y = tempPosition.y;
-							}
-						}
-					}
-				}
-			}
-		}
+void softCircle(void* context, Vector2 center, float radius, Color color) {
+	SoftRenderer* renderer = context;
+	if (renderer->inWorld) {
+		center.x += renderer->offsetX;
+		center.y += renderer->offsetY;
 	}
+	rasterPush(renderer, (RasterPrimitive) { .shape = RasterCircle, .centerX = center.x, .centerY = center.y, .radius = radius,
+		.x0 = (int)floorf(center.x - radius), .y0 = (int)floorf(center.y - radius),
+		.x1 = (int)ceilf(center.x + radius) + 1, .y1 = (int)ceilf(center.y + radius) + 1 }, color);
+}
 
+void softSprite(void* context, Vector2 position, uint64_t mask, int scale, Color color) {
+	SoftRenderer* renderer = context;
+	int x = (int)position.x + (renderer->inWorld ? renderer->offsetX : 0);
+	int y = (int)position.y + (renderer->inWorld ? renderer->offsetY : 0);
+	rasterPush(renderer, (RasterPrimitive) { .shape = RasterSprite, .scale = (unsigned char)scale, .mask = mask, .x = x, .y = y,
+		.x0 = x, .y0 = y, .x1 = x + 8 * scale, .y1 = y + 8 * scale }, color);
+}
 
-	return model;
+// One primitive per glyph, sized like DrawText's default font
+void softText(void* context, const char* text, int x, int y, int fontSize, Color color) {
+	SoftRenderer* renderer = context;
+	if (renderer->inWorld) {
+		x += renderer->offsetX;
+		y += renderer->offsetY;
+	}
+	int scale = fontSize / 10 > 1 ? fontSize / 10 : 1;
+	for (const char* c = text; *c != '\0'; c++, x += (RASTER_GLYPH_WIDTH + 1) * scale) {
+		if (*c <= ' ' || *c > '~') continue;
+		rasterPush(renderer, (RasterPrimitive) { .shape = RasterGlyph, .glyph = (unsigned char)(*c - ' '), .scale = (unsigned char)scale, .x = x, .y = y,
+			.x0 = x, .y0 = y, .x1 = x + RASTER_GLYPH_WIDTH * scale, .y1 = y + RASTER_GLYPH_HEIGHT * scale }, color);
+	}
 }
-	
 
-GameModel updateBullets(GameModel model, float deltaTime, int tileSize)
-{
-	if (IsKeyPressed(KEY_SPACE)) {
-		for (int i = 0; i < MAX_BULLETS; i++) {
-			if (!model.bullets[i].active) {
-				model.bullets[i].position = (Vector2){ model.player.position.x + model.player.size / 2, model.player.position.y + model.player.size / 2 };
-				model.bullets[i].direction = model.player.direction;
-				model.bullets[i].active = true;
-				break;
-			}
-		}
+void softInstances(void* context, const QuadInstance* instances, int count) {
+	for (int i = 0; i < count; i++) {
+		if (instances[i].shape == ShapeCircle) softCircle(context, instances[i].position, instances[i].size, instances[i].color);
+		else softRect(context, (int)instances[i].position.x, (int)instances[i].position.y, (int)instances[i].size, (int)instances[i].size, instances[i].color);
 	}
+}
 
-	for (int i = 0; i < MAX_BULLETS; i++) {
-		if (model.bullets[i].active) {
-			model.bullets[i].position.x += model.bullets[i].direction.x * model.bullets[i].speed * deltaTime;
-			model.bullets[i].position.y += model.bullets[i].direction.y * model.bullets[i].speed * deltaTime;
+// Bins the frame and rasterizes it, returning once every tile is done
+void softEnd(void* context) {
+	SoftRenderer* renderer = context;
+	if (!rasterBinPrimitives(renderer)) return;
+	atomic_store(&renderer->nextBin, 0);
+	mtx_lock(&renderer->lock);
+	renderer->pending = renderer->threadCount - 1;
+	renderer->generation++;
+	cnd_broadcast(&renderer->start);
+	mtx_unlock(&renderer->lock);
+
+	rasterRun(renderer);
+
+	mtx_lock(&renderer->lock);
+	while (renderer->pending > 0) cnd_wait(&renderer->finished, &renderer->lock);
+	mtx_unlock(&renderer->lock);
+}
 
-			if (model.bullets[i].position.x < 0 || model.bullets[i].position.x > MAP_WIDTH * tileSize ||
-				model.bullets[i].position.y < 0 || model.bullets[i].position.y > MAP_HEIGHT * tileSize) {
-				model.bullets[i].active = false;
-			}
+RenderBackend softBackend(SoftRenderer* renderer) {
+	return (RenderBackend) { renderer, softBegin, softBeginWorld, softEndWorld, softRect, softCircle, softSprite, softText, softInstances, softEnd };
+}
 
-			for (int j = 0; j < MAX_ENEMIES; j++) {
-				if (model.enemies[j].active && CheckCollisionRecs((Rectangle) { model.bullets[i].position.x, model.bullets[i].position.y, model.bullets[i].size, model.bullets[i].size },
-					(Rectangle) {
-					model.enemies[j].position.x, model.enemies[j].position.y, model.enemies[j].size, model.enemies[j].size
-				})) {
-					model.enemies[j].health--;
-					model.bullets[i].active = false;
-					spawnDamageParticle(&model,
-						(Vector2) {
-						model.enemies[j].position.x + model.enemies[j].size / 2, model.enemies[j].position.y
-					}, 1, RED);
-					spawnParticles(model.particles, (Vector2) { model.enemies[j].position.x + model.enemies[j].size / 2, model.enemies[j].position.y + model.enemies[j].size / 2 }, 5, RED);
-					if (model.enemies[j].health <= 0) {
-						model.enemies[j].active = false;
-						model.killCount++;
-					}
-					break;
-				}
-			}
+void softRendererDestroy(SoftRenderer* renderer) {
+	if (renderer == NULL) return;
+	mtx_lock(&renderer->lock);
+	renderer->quitting = true;
+	cnd_broadcast(&renderer->start);
+	mtx_unlock(&renderer->lock);
+	for (int t = 1; t < renderer->threadCount; t++) thrd_join(renderer->threads[t], NULL);
+	mtx_destroy(&renderer->lock);
+	cnd_destroy(&renderer->start);
+	cnd_destroy(&renderer->finished);
+	free(renderer->pixels);
+	free(renderer->primitives);
+	free(renderer->binStarts);
+	free(renderer->binItems);
+	free(renderer);
+}
+
+// threadCount - 1 workers join the caller in end(), 0 picks one per core
+SoftRenderer* softRendererCreate(int width, int height, int threadCount) {
+	if (threadCount <= 0) threadCount = cpuCount();
+	if (threadCount > RASTER_MAX_THREADS) threadCount = RASTER_MAX_THREADS;
+
+	SoftRenderer* renderer = calloc(1, sizeof(SoftRenderer));
+	if (renderer == NULL) return NULL;
+	renderer->width = width;
+	renderer->height = height;
+	renderer->tilesX = (width + RASTER_TILE - 1) / RASTER_TILE;
+	renderer->tilesY = (height + RASTER_TILE - 1) / RASTER_TILE;
+	renderer->pixels = calloc((size_t)width * height, sizeof(uint32_t));
+	renderer->primitives = malloc(sizeof(RasterPrimitive) * RASTER_MAX_PRIMITIVES);
+	renderer->binStarts = malloc(sizeof(int) * (renderer->tilesX * renderer->tilesY + 1));
+	mtx_init(&renderer->lock, mtx_plain);
+	cnd_init(&renderer->start);
+	cnd_init(&renderer->finished);
+	atomic_init(&renderer->nextBin, 0);
+	renderer->threadCount = 1;
+	if (renderer->pixels == NULL || renderer->primitives == NULL || renderer->binStarts == NULL) {
+		softRendererDestroy(renderer);
+		return NULL;
+	}
+	for (int t = 1; t < threadCount; t++) {
+		if (thrd_create(&renderer->threads[t], rasterWorkerMain, renderer) != thrd_success) {
+			softRendererDestroy(renderer);
+			return NULL;
 		}
+		renderer->threadCount++;
 	}
-	return model;
+	return renderer;
 }
 
-GameModel updateDamagePartical(GameModel model, float deltaTime)
-{
-	for (int i = 0; i < MAX_DAMAGE_PARTICLES; i++) {
-		if (model.damageParticles[i].active) {
-			model.damageParticles[i].position.y += model.damageParticles[i].velocity.y * deltaTime;
-			model.damageParticles[i].lifetime -= deltaTime;
-			if (model.damageParticles[i].lifetime <= 0.0f) {
-				model.damageParticles[i].active = false;
+unsigned int framebufferChecksum(const SoftRenderer* renderer) {
+	return hashBytes(2166136261u, renderer->pixels, sizeof(uint32_t) * (size_t)renderer->width * renderer->height);
+}
+
+// A busy stage-two frame: bots play a fresh game for some ticks with enemies out
+void buildRenderScene(RenderState* state, int ticks, int tileSize) {
+	static GameModel model;
+	model = setup(tileSize, 1, GAME_DEFAULT_SEED);
+	questStart(&model, StageTwoSetup);
+	unsigned int rng = 0x2545F491u;
+	PlayerInput held = 0;
+	for (int t = 0; t < ticks; t++) {
+		PlayerInput inputs[MAX_PLAYERS] = { botInput(&rng, &held) };
+		model = update(model, inputs, LOCKSTEP_DT, tileSize);
+	}
+	captureRenderState(&model, 0, ticks, tileSize, state);
+}
+
+bool writePPM(const char* path, const uint32_t* pixels, int width, int height) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) return false;
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	for (size_t i = 0; i < (size_t)width * height; i++) {
+		unsigned char rgb[3] = { pixels[i] & 0xFF, (pixels[i] >> 8) & 0xFF, (pixels[i] >> 16) & 0xFF };
+		fwrite(rgb, 1, 3, file);
+	}
+	return fclose(file) == 0;
+}
+
+// Binary PPM with maxval 255 only, which is all writePPM produces. Caller frees the pixels.
+uint32_t* readPPM(const char* path, int* width, int* height) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return NULL;
+	int maxValue = 0;
+	uint32_t* pixels = NULL;
+	if (fscanf(file, "P6 %d %d %d", width, height, &maxValue) == 3 && maxValue == 255 && *width > 0 && *height > 0 && fgetc(file) != EOF) {
+		pixels = malloc(sizeof(uint32_t) * (size_t)*width * *height);
+		for (size_t i = 0; pixels != NULL && i < (size_t)*width * *height; i++) {
+			unsigned char rgb[3];
+			if (fread(rgb, 1, 3, file) != 3) {
+				free(pixels);
+				pixels = NULL;
+				break;
 			}
+			pixels[i] = rgb[0] | (uint32_t)rgb[1] << 8 | (uint32_t)rgb[2] << 16 | 0xFF000000u;
 		}
 	}
-	return model;
+	fclose(file);
+	return pixels;
 }
 
-GameModel updateSword(GameModel model, float deltaTime, int tileSize)
-{
-	if (model.sword.cooldown > 0.0f) {
-		model.sword.cooldown -= deltaTime;
+// Milliseconds per software frame of the same scene at 1, 2, 4... threads up to maxThreads
+int runRenderBenchmark(int frames, int maxThreads, int screenWidth, int screenHeight, int tileSize) {
+	static RenderState state;
+	if (maxThreads <= 0) maxThreads = cpuCount();
+	if (maxThreads > RASTER_MAX_THREADS) maxThreads = RASTER_MAX_THREADS;
+	buildRenderScene(&state, 600, tileSize);
+
+	printf("render: %dx%d, %d commands, %d frames, %d cores\n", screenWidth, screenHeight, state.commandCount, frames, cpuCount());
+	// The framebuffer checksum must not depend on the thread count
+	printf("%8s %12s %10s %10s %10s\n", "threads", "ms/frame", "fps", "scaling", "checksum");
+	double single = 0.0;
+	for (int threads = 1; ; threads = threads * 2 > maxThreads && threads < maxThreads ? maxThreads : threads * 2) {
+		SoftRenderer* renderer = softRendererCreate(screenWidth, screenHeight, threads);
+		if (renderer == NULL) return 1;
+		RenderBackend backend = softBackend(renderer);
+		double start = monotonicNow();
+		for (int f = 0; f < frames; f++) drawFrame(&state, &backend, screenWidth, screenHeight, tileSize);
+		double ms = (monotonicNow() - start) * 1000.0 / frames;
+		if (threads == 1) single = ms;
+		printf("%8d %12.3f %10.0f %9.2fx %10x\n", renderer->threadCount, ms, 1000.0 / ms, single / ms, framebufferChecksum(renderer));
+		if (renderer->dropped > 0) printf("render: %d primitives over RASTER_MAX_PRIMITIVES dropped\n", renderer->dropped);
+		softRendererDestroy(renderer);
+		if (threads >= maxThreads) break;
 	}
+	return 0;
+}
 
-	if (model.sword.active) {
-		model.sword.duration -= deltaTime;
-		if (model.sword.duration <= 0.0f) {
-			model.sword.active = false;
+// Renders the benchmark scene and compares it pixel for pixel with a reference image. update
+// rewrites the reference; a mismatch writes <path>.actual.ppm next to it and fails.
+int runRenderGolden(const char* path, bool update, int screenWidth, int screenHeight, int tileSize) {
+	static RenderState state;
+	buildRenderScene(&state, 600, tileSize);
+	SoftRenderer* renderer = softRendererCreate(screenWidth, screenHeight, 0);
+	if (renderer == NULL) return 1;
+	RenderBackend backend = softBackend(renderer);
+	drawFrame(&state, &backend, screenWidth, screenHeight, tileSize);
+
+	int result = 0;
+	if (update) {
+		result = writePPM(path, renderer->pixels, screenWidth, screenHeight) ? 0 : 1;
+		printf("golden: wrote %s\n", path);
+	}
+	else {
+		int width = 0, height = 0;
+		uint32_t* expected = readPPM(path, &width, &height);
+		int mismatched = 0;
+		if (expected == NULL || width != screenWidth || height != screenHeight) {
+			printf("golden: cannot read a %dx%d image from %s\n", screenWidth, screenHeight, path);
+			mismatched = -1;
 		}
+		else {
+			for (size_t i = 0; i < (size_t)width * height; i++) mismatched += (expected[i] ^ renderer->pixels[i]) & 0xFFFFFF ? 1 : 0;
+			printf("golden: %d of %d pixels differ\n", mismatched, width * height);
+		}
+		if (mismatched != 0) {
+			char actual[512];
+			snprintf(actual, sizeof(actual), "%s.actual.ppm", path);
+			writePPM(actual, renderer->pixels, screenWidth, screenHeight);
+			printf("golden: wrote %s\n", actual);
+			result = 1;
+		}
+		free(expected);
 	}
+	softRendererDestroy(renderer);
+	return result;
+}
 
-	// Sword attack logic
-	if (IsKeyDown(KEY_C) && model.sword.cooldown <= 0.0f) {
-		model.sword.active = true;
-		model.sword.cooldown = SWORD_COOLDOWN;
-		model.sword.duration = SWORD_DURATION;
+#pragma endregion
 
-		// Adjust sword orientation based on player direction
-		float swordOffset = model.player.size / 3; // Make the sword closer by reducing the offset
+SnapshotRing snapshots;
 
-		if (model.player.direction.y != 0) { // Moving up or down (vertical sword)
-			model.sword.size = (Vector2){ SWORD_WIDTH, SWORD_HEIGHT };
-			model.sword.position = (Vector2){
-				model.player.position.x + model.player.size / 2 - model.sword.size.x / 2,
-				model.player.position.y + model.player.size / 2 + model.player.direction.y * (model.player.size - swordOffset)
-			};
-		}
-		else if (model.player.direction.x != 0) { // Moving left or right (horizontal sword)
-			model.sword.size = (Vector2){ SWORD_HEIGHT, SWORD_WIDTH };
-			model.sword.position = (Vector2){
-				model.player.position.x + model.player.size / 2 + model.player.direction.x * (model.player.size - swordOffset),
-				model.player.position.y + model.player.size / 2 - model.sword.size.y / 2
-			};
-		}
+#pragma region Threads
 
-		// Sword hitbox (centered on the position)
-		Rectangle swordRect = {
-			model.sword.position.x - model.sword.size.x / 2,
-			model.sword.position.y - model.sword.size.y / 2,
-			model.sword.size.x, model.sword.size.y
-		};
+// Single producer, single consumer. The producer fills its private slot and swaps it into
+// latest; the consumer swaps latest with its own slot only when the FRESH bit says it changed.
+// Neither side ever waits for the other or sees a half-written slot.
+#define TRIPLE_FRESH 4u
 
-		// Check for collisions with enemies
-		for (int i = 0; i < MAX_ENEMIES; i++) {
-			if (model.enemies[i].active && CheckCollisionRecs(swordRect,
-				(Rectangle) {
-				model.enemies[i].position.x, model.enemies[i].position.y, model.enemies[i].size, model.enemies[i].size
-			})) {
-				spawnDamageParticle(&model,
-					(Vector2) {
-					model.enemies[i].position.x + model.enemies[i].size / 2, model.enemies[i].position.y
-				}, 1, RED);
-
-				model.enemies[i].health--;
-				spawnParticles(model.particles,
-					(Vector2) {
-					model.enemies[i].position.x + model.enemies[i].size / 2, model.enemies[i].position.y + model.enemies[i].size / 2
-				}, 10, RED);
-
-				if (model.enemies[i].health <= 0) {
-					model.enemies[i].active = false;
-					model.killCount++;
-				}
+typedef struct TripleBuffer {
+	RenderState slots[3];
+	atomic_uint latest;  // Slot index, TRIPLE_FRESH when published since the last acquire
+	unsigned int writing;  // Producer's slot
+	unsigned int reading;  // Consumer's slot
+} TripleBuffer;
+
+void tripleBufferInit(TripleBuffer* buffer) {
+	buffer->writing = 0;
+	atomic_init(&buffer->latest, 1);
+	buffer->reading = 2;
+}
+
+RenderState* tripleBufferWriteSlot(TripleBuffer* buffer) {
+	return &buffer->slots[buffer->writing];
+}
+
+void tripleBufferPublish(TripleBuffer* buffer) {
+	unsigned int previous = atomic_exchange_explicit(&buffer->latest, buffer->writing | TRIPLE_FRESH, memory_order_acq_rel);
+	buffer->writing = previous & ~TRIPLE_FRESH;
+}
+
+// Newest complete state, the same one again when nothing new was published
+const RenderState* tripleBufferAcquire(TripleBuffer* buffer) {
+	if (atomic_load_explicit(&buffer->latest, memory_order_relaxed) & TRIPLE_FRESH) {
+		unsigned int previous = atomic_exchange_explicit(&buffer->latest, buffer->reading, memory_order_acq_rel);
+		buffer->reading = previous & ~TRIPLE_FRESH;
+	}
+	return &buffer->slots[buffer->reading];
+}
+
+// The simulation runs on its own thread at a fixed tick rate. The window thread only samples
+// input into these atomics and draws whatever state was published last.
+typedef struct SimThread {
+	GameModel model;
+	int tileSize;
+	ChunkStream* stream;  // NULL unless playing a world file
+	SaveWriter* saver;  // NULL when not autosaving
+	TripleBuffer frames;
+	atomic_uint heldInput;  // Buttons down at the last frame
+	atomic_uint pressedInput;  // Edge-triggered buttons since the last tick took them
+	atomic_bool rewinding;
+	atomic_bool running;
+	thrd_t thread;
+} SimThread;
+
+int simThreadMain(void* arg) {
+	SimThread* sim = arg;
+	int tick = 0;
+	snapshotInit(&snapshots);
+	snapshotCapture(&snapshots, &sim->model, tick);
+	captureRenderState(&sim->model, 0, tick, sim->tileSize, tripleBufferWriteSlot(&sim->frames));
+	tripleBufferPublish(&sim->frames);
+
+	double nextTick = monotonicNow();
+	while (atomic_load(&sim->running)) {
+		double now = monotonicNow();
+		if (now < nextTick) {
+			netSleep(nextTick - now);
+			continue;
+		}
+		nextTick += LOCKSTEP_DT;
+		if (now - nextTick > LOCKSTEP_MAX_BACKLOG) nextTick = now;  // After a long hitch, drop the backlog instead of fast-forwarding
+
+		if (atomic_load(&sim->rewinding)) {
+			// Hold R to play the last few seconds backwards
+			if (tick > snapshotOldestTick(&snapshots)) snapshotRewind(&snapshots, --tick, &sim->model);
+		}
+		else {
+			PlayerInput inputs[MAX_PLAYERS] = { (PlayerInput)(atomic_load(&sim->heldInput) | atomic_exchange(&sim->pressedInput, 0)) };
+			sim->model = update(sim->model, inputs, LOCKSTEP_DT, sim->tileSize);
+			if (sim->stream != NULL && streamUpdate(sim->stream, &sim->model, sim->tileSize)) {
+				// Older snapshots hold positions from before the window moved, so rewind stops here
+				snapshotInit(&snapshots);
 			}
+			snapshotCapture(&snapshots, &sim->model, ++tick);
+			if (sim->saver != NULL && tick % SAVE_INTERVAL_TICKS == 0) saveSubmit(sim->saver, &sim->model);
 		}
+		captureRenderState(&sim->model, 0, tick, sim->tileSize, tripleBufferWriteSlot(&sim->frames));
+		tripleBufferPublish(&sim->frames);
 	}
+	return 0;
+}
 
-	return model;
+#pragma endregion
+
+#pragma region Diagnostics
+
+#define CACHE_LINE_BYTES 64
+
+// Bytes per entity in the hot pools, next to the layouts they replaced
+void printMemoryReport(void) {
+	typedef struct { Vector2 position; float speed; int size; int health; bool active; Color color; float attackCooldown; float damageTextTimer; } LegacyEnemy;
+	typedef struct { Vector2 position; Vector2 direction; float speed; int size; bool active; Color color; } LegacyBullet;
+	typedef struct { Vector2 position; int size; int health; bool active; Color color; bool hasGold; } LegacyCrate;
+
+	struct { const char* name; size_t before, after; int count; } rows[] = {
+		{ "Enemy", sizeof(LegacyEnemy), sizeof(Enemy), MAX_ENEMIES },
+		{ "Bullet", sizeof(LegacyBullet), sizeof(Bullet), BULLET_POOL },
+		{ "Crate", sizeof(LegacyCrate), sizeof(Crate), MAX_CRATES },
+	};
+
+	printf("%-8s %7s %7s %15s %15s %12s\n", "entity", "before", "after", "per line before", "per line after", "pool saved");
+	for (int i = 0; i < (int)(sizeof(rows) / sizeof(rows[0])); i++) {
+		printf("%-8s %7zu %7zu %15.2f %15.2f %12zu\n", rows[i].name, rows[i].before, rows[i].after,
+			(float)CACHE_LINE_BYTES / rows[i].before, (float)CACHE_LINE_BYTES / rows[i].after,
+			(rows[i].before - rows[i].after) * rows[i].count);
+	}
+	printf("enemy steering: %zu bytes per enemy, in its own array\n", sizeof(EnemySteering));
+	printf("shared kind table: %zu bytes per GameModel\n", sizeof(KindInfo) * KindCount);
 }
 
+// Full box batches against random queries on a coarse grid, so edges often touch exactly.
+// Checks every mask bit against CheckCollisionRecs, then times both.
+int runOverlapBenchmark(int queries) {
+	unsigned int rng = 0x9E3779B1u;
+	BoxBatch boxes;
+	Rectangle rects[BOX_BATCH_MAX];
+	boxBatchReset(&boxes, BOX_BATCH_MAX);
+	for (int i = 0; i < BOX_BATCH_MAX; i++) {
+		rects[i] = (Rectangle){ (float)(gameRand(&rng) % 40 * 5), (float)(gameRand(&rng) % 40 * 5), (float)(5 + gameRand(&rng) % 8 * 5), (float)(5 + gameRand(&rng) % 8 * 5) };
+		boxBatchSet(&boxes, i, rects[i]);
+	}
+	Rectangle* tests = malloc(sizeof(Rectangle) * queries);
+	if (tests == NULL) return 1;
+	for (int q = 0; q < queries; q++) {
+		tests[q] = (Rectangle){ (float)(gameRand(&rng) % 40 * 5), (float)(gameRand(&rng) % 40 * 5), (float)(gameRand(&rng) % 8 * 5), (float)(gameRand(&rng) % 8 * 5) };
+	}
 
-GameModel updateNpcs(GameModel model, float deltaTime, int tileSize)
-{
+	int mismatches = 0;
+	for (int q = 0; q < queries; q++) {
+		uint64_t hits[BOX_MASK_WORDS];
+		boxBatchOverlaps(&boxes, tests[q], hits);
+		for (int i = 0; i < BOX_BATCH_MAX; i++) {
+			if ((bool)((hits[i >> 6] >> (i & 63)) & 1) != CheckCollisionRecs(tests[q], rects[i])) mismatches++;
+		}
+	}
 
+	unsigned long long scalarHits = 0, batchHits = 0;
+	double start = monotonicNow();
+	for (int q = 0; q < queries; q++) {
+		for (int i = 0; i < BOX_BATCH_MAX; i++) scalarHits += CheckCollisionRecs(tests[q], rects[i]);
+	}
+	double scalar = monotonicNow() - start;
+	start = monotonicNow();
+	for (int q = 0; q < queries; q++) {
+		uint64_t hits[BOX_MASK_WORDS];
+		boxBatchOverlaps(&boxes, tests[q], hits);
+		for (int w = 0; w < BOX_MASK_WORDS; w++) {
+			for (uint64_t bits = hits[w]; bits != 0; bits &= bits - 1) batchHits++;
+		}
+	}
+	double batched = monotonicNow() - start;
+	free(tests);
+
+#if defined(GAME_FIXED_POINT) && defined(__AVX2__)
+	const char* kernel = "avx2 fixed";
+#elif defined(GAME_FIXED_POINT) && defined(HAVE_SSE2)
+	const char* kernel = "sse2 fixed";
+#elif !defined(GAME_FIXED_POINT) && defined(__AVX__)
+	const char* kernel = "avx";
+#elif !defined(GAME_FIXED_POINT) && defined(HAVE_SSE2)
+	const char* kernel = "sse2";
+#else
+	const char* kernel = "scalar";
+#endif
+	printf("overlap: %d queries x %d boxes, %s kernel\n", queries, BOX_BATCH_MAX, kernel);
+	printf("%-18s %10.2f ns/query %12llu hits\n", "CheckCollisionRecs", scalar * 1e9 / queries, scalarHits);
+	printf("%-18s %10.2f ns/query %12llu hits %8.2fx\n", "boxBatchOverlaps", batched * 1e9 / queries, batchHits, scalar / batched);
+	printf("mismatched bits: %d\n", mismatches);
+	return mismatches == 0 && scalarHits == batchHits ? 0 : 1;
 }
 
+// Polls another process's counters and prints the per-tick averages since the last poll
+int runCounterWatch(int pid, float interval, int samples) {
+	char name[64];
+	counterNameFor(pid, name, sizeof(name));
+	const CounterSegment* segment = sharedMap(name, sizeof(CounterSegment), false);
+	if (segment == NULL || segment->magic != COUNTER_MAGIC || segment->version != COUNTER_VERSION || segment->counterCount != CounterCount) {
+		printf("counters: no counters published by process %d\n", pid);
+		return 1;
+	}
 
-GameModel update(GameModel model, float deltaTime, int tileSize)
-{
-	model = updatePlayerMovement(model, deltaTime, tileSize);
-	model = updateEnemies(model, deltaTime, tileSize);
-	model = updateBullets(model, deltaTime, tileSize);
-	model = updateSword(model, deltaTime, tileSize);
-	model = updateCrates(model, tileSize);
-	model = updateGold(model, deltaTime);
-	updateParticles(model.particles, deltaTime);
-	model = updateDamagePartical(model, deltaTime);
-	model = updateStage(model, deltaTime, tileSize);
-	model.activeDialog = NULL;
-	for (int i = 0; i < MAX_NPCS; i++) {
-		if (model.npcs[i].active &&
-			CheckCollisionRecs((Rectangle) { model.player.position.x, model.player.position.y, model.player.size, model.player.size },
-				(Rectangle) {
-			model.npcs[i].position.x, model.npcs[i].position.y, model.npcs[i].size, model.npcs[i].size
-		})) {
-			model.activeDialog = model.npcs[i].dialog;
-			if (IsKeyPressed(KEY_E)) {
-				model.npcs[i].interact = true;
+	static CounterSlot previous[COUNTER_MAX_SLOTS];
+	for (int sample = 0; samples <= 0 || sample < samples; sample++) {
+		netSleep(interval);
+		uint64_t ticks = 0;
+		uint64_t total[CounterCount] = { 0 };
+		uint64_t peak[CounterCount] = { 0 };
+		int slotCount = atomic_load(&segment->slotCount);
+		if (slotCount > COUNTER_MAX_SLOTS) slotCount = COUNTER_MAX_SLOTS;
+		int threads = 0;
+		for (int s = 0; s < slotCount; s++) {
+			threads += atomic_load(&segment->slots[s].owned) != 0;
+			CounterSlot now;
+			counterSlotRead(&segment->slots[s], &now);
+			ticks += now.ticks - previous[s].ticks;
+			for (int c = 0; c < CounterCount; c++) {
+				total[c] += now.total[c] - previous[s].total[c];
+				if (now.peak[c] > peak[c]) peak[c] = now.peak[c];
 			}
-			break;
+			previous[s] = now;
+		}
+
+		printf("counters: process %d, %d threads, %llu ticks in %.1f s\n", pid, threads, (unsigned long long)ticks, interval);
+		int unslotted = atomic_load(&segment->unslotted);
+		if (unslotted > 0) printf("  %d more threads found no free slot and are not shown\n", unslotted);
+		printf("  %-16s %12s %12s\n", "", "per tick", "peak");
+		for (int c = 0; c < CounterCount; c++) {
+			printf("  %-16s %12.1f %12llu\n", counterNames[c], ticks > 0 ? (double)total[c] / ticks : 0.0, (unsigned long long)peak[c]);
 		}
+		fflush(stdout);
 	}
-	return model;
+	return 0;
 }
 
 #pragma endregion
 
-#pragma region Draw
+#pragma region Soak
+
+// Log-linear buckets in the HDR histogram style: exact below 2 * HISTOGRAM_SUB_COUNT ns, then
+// HISTOGRAM_SUB_COUNT even steps per doubling, so any value is known to within 1/32
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 36  // Last doubling starts near 2^41 ns, longer samples land in it
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2) * HISTOGRAM_SUB_COUNT)
+#define SOAK_SPAWNS_PER_TICK 4  // Enemies added per tick while under the ramped limit
+#define SOAK_PARTICLE_BURST 32  // Particles added per tick while under the ramped limit
+
+typedef struct Histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t max;  // Exact, the buckets only know it to within a step
+} Histogram;
+
+int histogramBucket(uint64_t nanoseconds) {
+	if (nanoseconds < 2 * HISTOGRAM_SUB_COUNT) return (int)nanoseconds;
+	int shift = highestBit64(nanoseconds) - HISTOGRAM_SUB_BITS;
+	if (shift > HISTOGRAM_MAX_SHIFT) return HISTOGRAM_BUCKETS - 1;
+	return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)(nanoseconds >> shift) - HISTOGRAM_SUB_COUNT;
+}
 
+// Largest value that lands in the bucket
+uint64_t histogramBucketTop(int bucket) {
+	if (bucket < 2 * HISTOGRAM_SUB_COUNT) return (uint64_t)bucket;
+	int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+	uint64_t low = (uint64_t)(bucket % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
 
-void drawASCII(Vector2 position, const char* grid[8], int scale, Color color) {
-	for (int y = 0; y < 8; y++) {
-		for (int x = 0; x < 8; x++) {
-			if (grid[y][x] == 'X') {
-				DrawRectangle(position.x + x * scale, position.y + y * scale, scale, scale, color);
-			}
+void histogramRecord(Histogram* histogram, double seconds) {
+	uint64_t nanoseconds = seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+	histogram->counts[histogramBucket(nanoseconds)]++;
+	histogram->total++;
+	if (nanoseconds > histogram->max) histogram->max = nanoseconds;
+}
+
+// Milliseconds at or below which `percent` of the samples fall, 100 gives the exact max
+double histogramPercentile(const Histogram* histogram, double percent) {
+	if (histogram->total == 0) return 0.0;
+	if (percent >= 100.0) return histogram->max / 1e6;
+	uint64_t rank = (uint64_t)ceil(histogram->total * percent / 100.0);
+	if (rank == 0) rank = 1;
+	uint64_t seen = 0;
+	for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		seen += histogram->counts[b];
+		if (seen >= rank) {
+			uint64_t top = histogramBucketTop(b);
+			return (top < histogram->max ? top : histogram->max) / 1e6;
 		}
 	}
+	return histogram->max / 1e6;
 }
 
-void drawParticles(Particle particles[]) {
-	for (int i = 0; i < MAX_PARTICLES; i++) {
-		if (particles[i].active) {
-			// Draw as small circles or any shape you prefer
-			DrawCircleV(particles[i].position, 5, particles[i].color);
-		}
+typedef enum {
+	SoakFrame,  // Whole frame, from the end of one to the end of the next
+	SoakUpdate,  // update() alone
+	SoakSeriesCount
+} SoakSeries;
+
+const char* soakSeriesNames[SoakSeriesCount] = { "frame", "update" };
+const char* soakStatNames[] = { "p50", "p99", "p999", "max" };
+const double soakStatPercents[] = { 50.0, 99.0, 99.9, 100.0 };
+#define SOAK_STAT_COUNT ((int)(sizeof(soakStatPercents) / sizeof(soakStatPercents[0])))
+
+typedef struct SoakConfig {
+	float minutes;  // Simulated time, one tick per frame. Headless runs it as fast as it can.
+	float rampSeconds;  // From the stock limits up to the targets, which then hold to the end
+	int players;
+	GameLimits targets;
+	bool windowed;  // Draws through raylib instead of the software renderer
+	const char* thresholds;  // Threshold file, NULL to only report
+} SoakConfig;
+
+SoakConfig soakDefaults(void) {
+	return (SoakConfig) {
+		.minutes = 5.0f,
+		.rampSeconds = 60.0f,
+		.players = 4,
+		.targets = { .enemies = MAX_ENEMIES, .bulletsPerPlayer = MAX_BULLETS, .crates = MAX_CRATES, .particles = MAX_PARTICLES }
+	};
+}
+
+// One key=value target from the command line, false for an unknown key
+bool soakSetOption(SoakConfig* config, const char* option) {
+	char key[32];
+	int value;
+	if (sscanf(option, "%31[^=]=%d", key, &value) != 2) return false;
+	if (strcmp(key, "enemies") == 0) config->targets.enemies = limitTo(value, MAX_ENEMIES);
+	else if (strcmp(key, "bullets") == 0) config->targets.bulletsPerPlayer = limitTo(value, MAX_BULLETS);
+	else if (strcmp(key, "crates") == 0) config->targets.crates = limitTo(value, MAX_CRATES);
+	else if (strcmp(key, "particles") == 0) config->targets.particles = limitTo(value, MAX_PARTICLES);
+	else if (strcmp(key, "players") == 0) config->players = value < 1 ? 1 : value > MAX_PLAYERS ? MAX_PLAYERS : value;
+	else if (strcmp(key, "ramp") == 0) config->rampSeconds = (float)(value > 0 ? value : 0);
+	else return false;
+	return true;
+}
+
+GameLimits soakRamp(GameLimits from, GameLimits to, float progress) {
+	return (GameLimits) {
+		.enemies = (short)(from.enemies + (to.enemies - from.enemies) * progress),
+		.bulletsPerPlayer = (short)(from.bulletsPerPlayer + (to.bulletsPerPlayer - from.bulletsPerPlayer) * progress),
+		.crates = (short)(from.crates + (to.crates - from.crates) * progress),
+		.particles = (short)(from.particles + (to.particles - from.particles) * progress)
+	};
+}
+
+// Tops the pools up to the ramped limits ahead of a tick. Enemies and crates come from the
+// game's own spawners; particles only come from hits otherwise, so they are sprayed in bursts.
+void soakFeed(GameModel* model, GameLimits limits, unsigned int* rng, int tileSize) {
+	setGameLimits(model, limits);
+	int enemies = 0;
+	for (int i = 0; i < MAX_ENEMIES; i++) enemies += model->enemies[i].active;
+	for (int spawned = 0; spawned < SOAK_SPAWNS_PER_TICK && enemies < limits.enemies; spawned++, enemies++) {
+		if (!spawnEnemy(model, tileSize)) break;
+	}
+	spawnCrates(model, tileSize);
+	int burst = limits.particles - ecsCount(&model->ecs, ARCHETYPE_PARTICLE);
+	if (burst > SOAK_PARTICLE_BURST) burst = SOAK_PARTICLE_BURST;
+	if (burst > 0) {
+		const Player* player = &model->players[gameRand(rng) % model->playerCount];
+		spawnParticles(rng, (Vector2) { player->position.x + player->size / 2, player->position.y + player->size / 2 }, burst, GRAY);
 	}
 }
 
-void drawCrates(Crate crates[]) {
-	for (int i = 0; i < MAX_CRATES; i++) {
-		if (crates[i].active) {
-			DrawRectangle(crates[i].position.x, crates[i].position.y, crates[i].size, crates[i].size, crates[i].color);
-		}
+// Highest live count of each pool over the run, to tell a target the game never reached
+void soakObserve(GameLimits* peak, const GameModel* model) {
+	GameLimits live = { .particles = (short)ecsCount(&model->ecs, ARCHETYPE_PARTICLE) };
+	for (int i = 0; i < MAX_ENEMIES; i++) live.enemies += model->enemies[i].active;
+	for (int i = 0; i < MAX_CRATES; i++) live.crates += model->crates[i].active;
+	for (int p = 0; p < model->playerCount; p++) {
+		short bullets = 0;
+		for (int i = p * MAX_BULLETS; i < (p + 1) * MAX_BULLETS; i++) bullets += model->bullets[i].active;
+		if (bullets > live.bulletsPerPlayer) live.bulletsPerPlayer = bullets;
 	}
+	if (live.enemies > peak->enemies) peak->enemies = live.enemies;
+	if (live.bulletsPerPlayer > peak->bulletsPerPlayer) peak->bulletsPerPlayer = live.bulletsPerPlayer;
+	if (live.crates > peak->crates) peak->crates = live.crates;
+	if (live.particles > peak->particles) peak->particles = live.particles;
 }
 
-void drawGold(Gold gold[]) {
-	for (int i = 0; i < MAX_GOLD; i++) {
-		if (gold[i].active) {
-			DrawCircleV(gold[i].position, gold[i].size / 2, YELLOW);
+// Threshold file lines are `<series>_<stat> <max ms>`, e.g. `update_p99 2.5`; # starts a comment.
+// Returns the failed lines, unknown metrics included, or -1 when the file cannot be read.
+int soakCheckThresholds(const char* path, const Histogram histograms[SoakSeriesCount]) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) return -1;
+	int failures = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char metric[64];
+		double limit;
+		char* comment = strchr(line, '#');
+		if (comment != NULL) *comment = '\0';
+		if (sscanf(line, "%63s %lf", metric, &limit) != 2) continue;
+
+		double value = -1.0;
+		for (int series = 0; series < SoakSeriesCount; series++) {
+			for (int stat = 0; stat < SOAK_STAT_COUNT; stat++) {
+				char name[64];
+				snprintf(name, sizeof(name), "%s_%s", soakSeriesNames[series], soakStatNames[stat]);
+				if (strcmp(name, metric) == 0) value = histogramPercentile(&histograms[series], soakStatPercents[stat]);
+			}
+		}
+		if (value < 0.0) {
+			printf("  %-12s unknown metric%18s FAIL\n", metric, "");
+			failures++;
+			continue;
 		}
+		bool pass = value <= limit;
+		printf("  %-12s %9.3f ms <= %9.3f ms  %s\n", metric, value, limit, pass ? "pass" : "FAIL");
+		failures += !pass;
 	}
+	fclose(file);
+	return failures;
 }
 
-GameModel draw(GameModel model, float deltaTime) {
-	//DrawRectangle(model.player.position.x, model.player.position.y, model.player.size, model.player.size, model.player.color);
-	animationTimer += deltaTime;
-	if (animationTimer >= frameDuration) {
-		animationFrame = (animationFrame + 1) % 2;  // Toggle between 0 and 1 for animation
-		animationTimer = 0.0f;
-	}
-	drawCrates(model.crates);
-	// Draw player based on the current state
-	//DrawRectangle(model.player.position.x, model.player.position.y, model.player.size, model.player.size, GRAY);
-	if (model.player.isMoving) {
-		drawASCII(model.player.position, playerWalking[animationFrame], 8, BLUE);
+// Bots play stage two while every pool ramps to its target, timing each update and frame.
+// Exits non-zero when a threshold is missed, so a build can be gated on the report.
+int runSoak(const SoakConfig* config, int screenWidth, int screenHeight, int tileSize) {
+	static GameModel model;
+	static RenderState frame;
+	static Histogram histograms[SoakSeriesCount];
+	memset(histograms, 0, sizeof(histograms));
+
+	SoftRenderer* renderer = NULL;
+	RenderBackend backend = raylibBackend;
+	if (config->windowed) {
+		InitWindow(screenWidth, screenHeight, "Barp soak");
 	}
 	else {
-		drawASCII(model.player.position, playerIdle[animationFrame], 8, BLUE);
+		renderer = softRendererCreate(screenWidth, screenHeight, 0);
+		if (renderer == NULL) return 1;
+		backend = softBackend(renderer);
 	}
 
+	model = setup(tileSize, config->players, GAME_DEFAULT_SEED);
+	questStart(&model, StageTwoSetup);  // Enemies only come out in stage two
+	unsigned int rng = 0x9E3779B9u;
+	unsigned int botRng[MAX_PLAYERS];
+	PlayerInput held[MAX_PLAYERS] = { 0 };
+	for (int p = 0; p < config->players; p++) botRng[p] = 0x2545F491u + p * 0x61C88647u;
+	int ticks = (int)lroundf(config->minutes * 60.0f / LOCKSTEP_DT);
+	float rampTicks = fmaxf(config->rampSeconds / LOCKSTEP_DT, 1.0f);
+	GameLimits peak = { 0 };
+
+	printf("soak: %.1f min, %d players, %s %dx%d, ramp %.0f s to %d enemies, %d bullets per player, %d crates, %d particles\n",
+		config->minutes, config->players, config->windowed ? "windowed" : "headless", screenWidth, screenHeight, config->rampSeconds,
+		config->targets.enemies, config->targets.bulletsPerPlayer, config->targets.crates, config->targets.particles);
+	int tick = 0;
+	double frameEnd = monotonicNow();
+	for (; tick < ticks; tick++) {
+		if (config->windowed && WindowShouldClose()) break;
+		soakFeed(&model, soakRamp(defaultLimits, config->targets, fminf(tick / rampTicks, 1.0f)), &rng, tileSize);
+		PlayerInput inputs[MAX_PLAYERS];
+		for (int p = 0; p < config->players; p++) {
+			inputs[p] = botInput(&botRng[p], &held[p]) | InputFire;  // Bullets fill up to the ramped limit
+		}
 
-	drawGold(model.gold);
-	
-	for (int i = 0; i < MAX_ENEMIES; i++) {
-		if (model.enemies[i].active) {
+		double start = monotonicNow();
+		model = update(model, inputs, LOCKSTEP_DT, tileSize);
+		histogramRecord(&histograms[SoakUpdate], monotonicNow() - start);
+		captureRenderState(&model, 0, tick, tileSize, &frame);
+		drawFrame(&frame, &backend, screenWidth, screenHeight, tileSize);
+		soakObserve(&peak, &model);
 
-			float healthBarWidth = model.enemies[i].size;
-			float healthBarHeight = 5.0f; // Height of the health bar
-			float healthPercentage = (float)model.enemies[i].health / 3; // Assuming max health is 10
-
-			DrawRectangle(model.enemies[i].position.x, model.enemies[i].position.y - healthBarHeight - 2, healthBarWidth, healthBarHeight, DARKGRAY);
-			DrawRectangle(model.enemies[i].position.x, model.enemies[i].position.y - healthBarHeight - 2, healthBarWidth * healthPercentage, healthBarHeight, RED);
-			if (model.enemies[i].damageTextTimer > 0) {
-				char damageText[16];
-				sprintf(damageText, "-%d", 1);
-				Vector2 damagePosition = {
-					model.enemies[i].position.x + model.enemies[i].size / 2,
-					model.enemies[i].position.y - healthBarHeight - 10
-				};
-				DrawText(damageText, damagePosition.x, damagePosition.y, 30, BLACK);
-			}
-			//DrawRectangle(model.enemies[i].position.x, model.enemies[i].position.y, model.enemies[i].size, model.enemies[i].size, model.enemies[i].color);
-			drawASCII(model.enemies[i].position, enemy[animationFrame], 8, RED);
-		}
+		double now = monotonicNow();
+		histogramRecord(&histograms[SoakFrame], now - frameEnd);
+		frameEnd = now;
 	}
-	if (model.sword.active) {
-		DrawRectangle(model.sword.position.x - model.sword.size.x / 2
-			, model.sword.position.y - model.sword.size.y / 2
-			, model.sword.size.x
-			, model.sword.size.y
-			, model.sword.color
-		);
+	if (config->windowed) CloseWindow();
+	else softRendererDestroy(renderer);
+
+	printf("soak: %d ticks, peak %d enemies, %d bullets per player, %d crates, %d particles\n",
+		tick, peak.enemies, peak.bulletsPerPlayer, peak.crates, peak.particles);
+	printf("%-8s %10s %10s %10s %10s %10s\n", "ms", "samples", soakStatNames[0], soakStatNames[1], soakStatNames[2], soakStatNames[3]);
+	for (int series = 0; series < SoakSeriesCount; series++) {
+		printf("%-8s %10llu", soakSeriesNames[series], (unsigned long long)histograms[series].total);
+		for (int stat = 0; stat < SOAK_STAT_COUNT; stat++) printf(" %10.3f", histogramPercentile(&histograms[series], soakStatPercents[stat]));
+		printf("\n");
 	}
-	for (int i = 0; i < MAX_BULLETS; i++) {
-		if (model.bullets[i].active) {
-			DrawRectangle(model.bullets[i].position.x, model.bullets[i].position.y, model.bullets[i].size, model.bullets[i].size, model.bullets[i].color);
-		}
+	if (config->thresholds == NULL) return 0;
+
+	printf("thresholds: %s\n", config->thresholds);
+	int failures = soakCheckThresholds(config->thresholds, histograms);
+	if (failures < 0) {
+		printf("soak: cannot read %s\n", config->thresholds);
+		return 1;
 	}
-	drawParticles(model.particles);
-	for (int i = 0; i < MAX_NPCS; i++) {
-		if (model.npcs[i].active) {
-			drawASCII(model.npcs[i].position, npc[animationFrame], 8, GREEN);
-			//DrawRectangle(model.npcs[i].position.x, model.npcs[i].position.y, model.npcs[i].size, model.npcs[i].size, model.npcs[i].color);
-		}
+	printf("soak: %s\n", failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
+
+// A crowded four-player game from a fixed seed, reduced to one checksum. Builds that agree on it
+// simulate alike; pass the checksum of a reference build as `expected` to compare against it.
+int runDeterminismCheck(int ticks, const char* expected, int tileSize) {
+	static GameModel model;
+	const GameLimits targets = { .enemies = MAX_ENEMIES / 2, .bulletsPerPlayer = MAX_BULLETS / 2, .crates = MAX_CRATES / 2, .particles = MAX_PARTICLES };
+	model = setup(tileSize, 4, GAME_DEFAULT_SEED);
+	questStart(&model, StageTwoSetup);
+	unsigned int rng = 0x9E3779B9u;
+	unsigned int botRng[MAX_PLAYERS];
+	PlayerInput held[MAX_PLAYERS] = { 0 };
+	for (int p = 0; p < model.playerCount; p++) botRng[p] = 0x2545F491u + p * 0x61C88647u;
+
+	for (int tick = 0; tick < ticks; tick++) {
+		soakFeed(&model, targets, &rng, tileSize);
+		PlayerInput inputs[MAX_PLAYERS];
+		for (int p = 0; p < model.playerCount; p++) inputs[p] = botInput(&botRng[p], &held[p]);
+		model = update(model, inputs, LOCKSTEP_DT, tileSize);
 	}
 
-	for (int i = 0; i < MAX_DAMAGE_PARTICLES; i++) {
-		if (model.damageParticles[i].active) {
-			char damageText[16];
-			sprintf(damageText, "-%d", model.damageParticles[i].damageAmount);
-			DrawText(damageText, model.damageParticles[i].position.x, model.damageParticles[i].position.y, 20, model.damageParticles[i].color);
+#if defined(GAME_FIXED_POINT)
+	const char* mode = "fixed-point";
+#else
+	const char* mode = "float";
+#endif
+	unsigned int checksum = modelChecksum(&model);
+	printf("determinism: %s build, %d ticks, %d kills, checksum %08x\n", mode, ticks, model.killCount, checksum);
+	if (expected == NULL) return 0;
+	bool match = checksum == (unsigned int)strtoul(expected, NULL, 16);
+	printf("determinism: %s, expected %s\n", match ? "PASS" : "FAIL", expected);
+	return match ? 0 : 1;
+}
+
+#define ROLLBACK_CHECK_SPAN (SNAPSHOT_GROUPS * SNAPSHOT_KEYFRAME_INTERVAL)
+#define ROLLBACK_CHECK_INTERVAL 8  // Ticks between rewinds that resimulate
+#define ROLLBACK_CHECK_DEPTH 24  // Ticks each of those goes back
+
+// Captures every tick of a seeded game into a snapshot ring and loads earlier ticks back out,
+// checking each against the checksum the model had when that tick was live. Every
+// ROLLBACK_CHECK_INTERVAL ticks it also rewinds and replays the same inputs, which has to
+// land on exactly the bytes the first pass did.
+int runRollbackCheck(int ticks, int tileSize) {
+	static GameModel model, loaded, live;
+	static SnapshotRing ring;
+	static unsigned char delta[2 * sizeof(GameModel)];
+	unsigned int checksums[ROLLBACK_CHECK_SPAN];
+	PlayerInput history[ROLLBACK_CHECK_SPAN][MAX_PLAYERS];
+	model = setup(tileSize, 4, GAME_DEFAULT_SEED);
+	questStart(&model, StageTwoSetup);
+	unsigned int botRng[MAX_PLAYERS];
+	PlayerInput held[MAX_PLAYERS] = { 0 };
+	for (int p = 0; p < model.playerCount; p++) botRng[p] = 0x2545F491u + p * 0x61C88647u;
+	snapshotInit(&ring);
+
+	int loads = 0, mismatches = 0, firstMismatch = -1;
+	int replays = 0, diverged = 0, firstDiverged = -1;
+	for (int tick = 0; tick < ticks; tick++) {
+		PlayerInput* inputs = history[tick % ROLLBACK_CHECK_SPAN];
+		for (int p = 0; p < model.playerCount; p++) inputs[p] = botInput(&botRng[p], &held[p]);
+		model = update(model, inputs, LOCKSTEP_DT, tileSize);
+		snapshotCapture(&ring, &model, tick);
+		checksums[tick % ROLLBACK_CHECK_SPAN] = modelChecksum(&model);
+
+		// Walk back a different distance each tick so every slot of a group gets loaded
+		int target = tick - (tick * 7) % ROLLBACK_CHECK_SPAN;
+		if (target >= snapshotOldestTick(&ring) && snapshotLoad(&ring, target, &loaded)) {
+			loads++;
+			if (modelChecksum(&loaded) != checksums[target % ROLLBACK_CHECK_SPAN] && mismatches++ == 0) firstMismatch = target;
+		}
+
+		target = tick - ROLLBACK_CHECK_DEPTH;
+		if (tick % ROLLBACK_CHECK_INTERVAL != 0 || target < snapshotOldestTick(&ring)) continue;
+		live = model;
+		snapshotRewind(&ring, target, &model);
+		for (int replay = target + 1; replay <= tick; replay++) {
+			model = update(model, history[replay % ROLLBACK_CHECK_SPAN], LOCKSTEP_DT, tileSize);
+			snapshotCapture(&ring, &model, replay);
 		}
+		replays++;
+		if (snapshotEncode(&model, &live, ~0u, delta) != 0 && diverged++ == 0) firstDiverged = tick;
 	}
 
-	return model;
+	printf("rollback: %d ticks, %d loads, %d mismatched", ticks, loads, mismatches);
+	if (mismatches > 0) printf(", first at tick %d", firstMismatch);
+	printf("; %d replays, %d diverged", replays, diverged);
+	if (diverged > 0) printf(", first at tick %d", firstDiverged);
+	printf("\n");
+	return mismatches > 0 || diverged > 0 ? 1 : 0;
 }
+
 #pragma endregion
 
+// Windowed peer of a lockstep match, simulating at the fixed tick rate whatever the frame rate
+int runLockstepClient(const char* host, unsigned short port, int player, int playerCount, int screenWidth, int screenHeight, int tileSize) {
+	static LockstepClient client;
+	static RenderState frame;
+	if (!lockstepConnect(&client, host, port, player, playerCount, tileSize)) {
+		printf("lockstep: cannot reach %s:%d\n", host, port);
+		return 1;
+	}
+
+	InitWindow(screenWidth, screenHeight, "Barp");
+	SetTargetFPS(60);
+	PlayerInput pending = 0;
+	int reportedDesync = NO_TICK;
+	double nextTick = monotonicNow();
+	while (!WindowShouldClose())
+	{
+		// Edge-triggered buttons are held until a tick takes them, so none are lost or doubled
+		pending |= readLocalInput();
+		double now = monotonicNow();
+		if (now - nextTick > LOCKSTEP_MAX_BACKLOG) nextTick = now;  // After a long hitch, drop the backlog instead of fast-forwarding
+		while (now >= nextTick) {
+			PlayerInput held = readLocalInput() & ~(InputFire | InputInteract);
+			if (lockstepStep(&client, pending, now)) pending = held;
+			nextTick += LOCKSTEP_DT;
+		}
+		if (client.desyncTick != NO_TICK && reportedDesync == NO_TICK) {
+			printf("lockstep: desync at tick %d\n", client.desyncTick);
+			reportedDesync = client.desyncTick;
+		}
+		captureRenderState(&client.model, player, client.tick, tileSize, &frame);
+		drawFrame(&frame, &raylibBackend, screenWidth, screenHeight, tileSize);
+	}
+
+	CloseWindow();
+	netClose(client.link.socket);
+	return 0;
+}
 
-int main(void)
+int main(int argc, char** argv)
 {
 	const int screenWidth = 800;
 	const int screenHeight = 450;
 	const int tileSize = 50;
 
-	InitWindow(screenWidth, screenHeight, "Barp");
+	if (!spriteMasksMatchArt()) return 1;
+	if (argc > 2 && strcmp(argv[1], "--watch-counters") == 0) {
+		// --watch-counters <pid> [interval seconds] [samples], samples 0 runs until interrupted
+		float interval = argc > 3 ? (float)atof(argv[3]) : 1.0f;
+		int samples = argc > 4 ? atoi(argv[4]) : 0;
+		return runCounterWatch(atoi(argv[2]), interval > 0 ? interval : 1.0f, samples);
+	}
+	countersOpen();  // Read from another process with --watch-counters <pid>
+	if (argc > 2 && strcmp(argv[1], "--quests") == 0) {
+		// --quests <file> [mode...] plays any mode below with another stage graph
+		if (!questLoadFile(argv[2])) return 1;
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc > 1 && strcmp(argv[1], "--memory-report") == 0) {
+		printMemoryReport();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--lockstep-test") == 0) {
+		// --lockstep-test [players] [seconds] [loss 0..1] [desync tick]
+		int players = argc > 2 ? atoi(argv[2]) : 4;
+		float seconds = argc > 3 ? (float)atof(argv[3]) : 10.0f;
+		float loss = argc > 4 ? (float)atof(argv[4]) : 0.0f;
+		int desyncAt = argc > 5 ? atoi(argv[5]) : NO_TICK;
+		if (players < 1 || players > MAX_PLAYERS) players = 4;
+		return runLockstepTest(players, seconds, loss, desyncAt, tileSize);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-batch") == 0) {
+		// --bench-batch [instances] [ticks] [max threads]
+		int instances = argc > 2 ? atoi(argv[2]) : 4096;
+		int ticks = argc > 3 ? atoi(argv[3]) : 600;
+		int threads = argc > 4 ? atoi(argv[4]) : 0;
+		return runBatchBenchmark(instances > 0 ? instances : 4096, ticks > 0 ? ticks : 600, threads, tileSize);
+	}
+	if (argc > 2 && strcmp(argv[1], "--make-world") == 0) {
+		// --make-world <path> [chunks x] [chunks y]
+		int chunksX = argc > 3 ? atoi(argv[3]) : 64;
+		int chunksY = argc > 4 ? atoi(argv[4]) : 64;
+		if (chunksX < STREAM_WINDOW_X) chunksX = STREAM_WINDOW_X;
+		if (chunksY < STREAM_WINDOW_Y) chunksY = STREAM_WINDOW_Y;
+		return writeWorld(argv[2], chunksX, chunksY, GAME_DEFAULT_SEED, tiledWorldTile, NULL);
+	}
+	if (argc > 2 && strcmp(argv[1], "--gen-world") == 0) {
+		// --gen-world <path> [width] [height] [seed], sizes in tiles
+		int width = argc > 3 ? atoi(argv[3]) : 512;
+		int height = argc > 4 ? atoi(argv[4]) : 512;
+		unsigned int seed = argc > 5 ? (unsigned int)strtoul(argv[5], NULL, 0) : GAME_DEFAULT_SEED;
+		if (width < MAP_WIDTH) width = MAP_WIDTH;
+		if (height < MAP_HEIGHT) height = MAP_HEIGHT;
+		GeneratedMap grid;
+		if (!generateMap(&grid, width, height, seed)) {
+			printf("mapgen: generation failed\n");
+			return 1;
+		}
+		int result = writeWorld(argv[2], (width + CHUNK_WIDTH - 1) / CHUNK_WIDTH, (height + CHUNK_HEIGHT - 1) / CHUNK_HEIGHT, seed, generatedWorldTile, &grid);
+		freeGeneratedMap(&grid);
+		return result;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-mapgen") == 0) {
+		// --bench-mapgen [size] [runs]
+		int size = argc > 2 ? atoi(argv[2]) : 4096;
+		int runs = argc > 3 ? atoi(argv[3]) : 5;
+		return runMapgenBenchmark(size >= MAPGEN_MIN_HEIGHT ? size : 4096, runs > 0 ? runs : 5);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-overlap") == 0) {
+		// --bench-overlap [queries]
+		int queries = argc > 2 ? atoi(argv[2]) : 1000000;
+		return runOverlapBenchmark(queries > 0 ? queries : 1000000);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-render") == 0) {
+		// --bench-render [frames] [max threads]
+		int frames = argc > 2 ? atoi(argv[2]) : 200;
+		int threads = argc > 3 ? atoi(argv[3]) : 0;
+		return runRenderBenchmark(frames > 0 ? frames : 200, threads, screenWidth, screenHeight, tileSize);
+	}
+	if (argc > 2 && strcmp(argv[1], "--render-golden") == 0) {
+		// --render-golden <file.ppm> [update]
+		bool update = argc > 3 && strcmp(argv[3], "update") == 0;
+		return runRenderGolden(argv[2], update, screenWidth, screenHeight, tileSize);
+	}
+	if (argc > 1 && strcmp(argv[1], "--soak") == 0) {
+		// --soak [minutes] [key=value...] [window] [thresholds file]
+		// keys: enemies, bullets (per player), crates, particles, players, ramp (seconds)
+		SoakConfig config = soakDefaults();
+		for (int i = 2; i < argc; i++) {
+			if (i == 2 && atof(argv[i]) > 0) config.minutes = (float)atof(argv[i]);
+			else if (strcmp(argv[i], "window") == 0) config.windowed = true;
+			else if (strchr(argv[i], '=') != NULL) {
+				if (!soakSetOption(&config, argv[i])) {
+					printf("soak: unknown option %s\n", argv[i]);
+					return 1;
+				}
+			}
+			else config.thresholds = argv[i];
+		}
+		return runSoak(&config, screenWidth, screenHeight, tileSize);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-save") == 0) {
+		// --bench-save [runs] [scratch file]
+		int runs = argc > 2 ? atoi(argv[2]) : 20;
+		return runSaveBenchmark(runs > 0 ? runs : 20, argc > 3 ? argv[3] : "bench.sav", tileSize);
+	}
+	if (argc > 1 && strcmp(argv[1], "--rollback-check") == 0) {
+		// --rollback-check [ticks]
+		int ticks = argc > 2 ? atoi(argv[2]) : 3600;
+		return runRollbackCheck(ticks > 0 ? ticks : 3600, tileSize);
+	}
+	if (argc > 1 && strcmp(argv[1], "--determinism-check") == 0) {
+		// --determinism-check [ticks] [expected checksum]
+		int ticks = argc > 2 ? atoi(argv[2]) : 3600;
+		return runDeterminismCheck(ticks > 0 ? ticks : 3600, argc > 3 ? argv[3] : NULL, tileSize);
+	}
+	if (argc > 3 && strcmp(argv[1], "--relay") == 0) {
+		// --relay <port> <players>
+		return runRelay((unsigned short)atoi(argv[2]), atoi(argv[3]));
+	}
+	if (argc > 5 && strcmp(argv[1], "--connect") == 0) {
+		// --connect <host> <port> <player> <players>
+		return runLockstepClient(argv[2], (unsigned short)atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), screenWidth, screenHeight, tileSize);
+	}
 
-	GameModel model = setup(tileSize);
+	// --world <path> plays a streamed world file, saving it back on exit
+	static ChunkStream stream;
+	bool streaming = argc > 2 && strcmp(argv[1], "--world") == 0;
+	if (streaming && !streamOpen(&stream, argv[2])) {
+		printf("world: cannot open %s\n", argv[2]);
+		return 1;
+	}
 
-	Camera2D camera = { 0 };
-	camera.target = (Vector2){ model.player.position.x + model.player.size / 2, model.player.position.y + model.player.size / 2 };
-	camera.offset = (Vector2){ screenWidth / 2.0f, screenHeight / 2.0f };
-	camera.rotation = 0.0f;
-	camera.zoom = 1.0f;
+	// Otherwise the game resumes from and autosaves to barp.sav, or --save <path>. A world
+	// file already keeps the map and what rests on it, so streamed games are not saved.
+	static SaveWriter saver;
+	const char* savePath = argc > 2 && strcmp(argv[1], "--save") == 0 ? argv[2] : SAVE_DEFAULT_PATH;
+	bool saving = !streaming && saveWriterStart(&saver, savePath);
+
+	InitWindow(screenWidth, screenHeight, "Barp");
+
+	static SimThread sim;
+	if (!saving || !saveLoad(savePath, &sim.model, tileSize)) sim.model = setup(tileSize, 1, GAME_DEFAULT_SEED);
+	sim.tileSize = tileSize;
+	sim.stream = streaming ? &stream : NULL;
+	sim.saver = saving ? &saver : NULL;
+	if (streaming) streamAttach(&stream, &sim.model, tileSize);
+	tripleBufferInit(&sim.frames);
+	atomic_init(&sim.heldInput, 0);
+	atomic_init(&sim.pressedInput, 0);
+	atomic_init(&sim.rewinding, false);
+	atomic_init(&sim.running, true);
+	if (thrd_create(&sim.thread, simThreadMain, &sim) != thrd_success) {
+		if (streaming) streamClose(&stream, &sim.model, tileSize);
+		if (saving) saveWriterStop(&saver);
+		CloseWindow();
+		return 1;
+	}
 
 	SetTargetFPS(60);
 	while (!WindowShouldClose())
 	{
-		float deltaTime = GetFrameTime();
-		camera.target = (Vector2){ model.player.position.x + model.player.size / 2, model.player.position.y + model.player.size / 2 };
-		model = update(model, deltaTime, tileSize);
-		BeginDrawing();
-		ClearBackground(RAYWHITE);
-		BeginMode2D(camera);
-		// map
-		for (int y = 0; y < MAP_HEIGHT; y++) {
-			for (int x = 0; x < MAP_WIDTH; x++) {
-				if (map[y][x] == '#') {
-					DrawRectangle(x * tileSize, y * tileSize, tileSize, tileSize, GRAY);
-				}
-			}
-		}
-		draw(model, deltaTime);
-		EndMode2D();
-		if (model.activeDialog != NULL) {
-			DrawRectangle(50, screenHeight - 100, screenWidth - 100, 50, Fade(LIGHTGRAY, 0.8f));
-			DrawText(model.activeDialog, 60, screenHeight - 90, 20, BLACK);
-		}
-		DrawText(TextFormat("Health: %d", model.player.health), 10, 10, 20, BLACK);
-		DrawText(TextFormat("Gold: %d", model.goldCollected), 10, 30, 20, BLACK);
-		EndDrawing();
+		PlayerInput input = readLocalInput();
+		atomic_store(&sim.heldInput, input & ~(InputFire | InputInteract));
+		atomic_fetch_or(&sim.pressedInput, input & (InputFire | InputInteract));
+		atomic_store(&sim.rewinding, IsKeyDown(KEY_R));
+		drawFrame(tripleBufferAcquire(&sim.frames), &raylibBackend, screenWidth, screenHeight, tileSize);
 	}
 
+	atomic_store(&sim.running, false);
+	thrd_join(sim.thread, NULL);
+	if (streaming) streamClose(&stream, &sim.model, tileSize);
+	if (saving) {
+		saveSubmit(&saver, &sim.model);
+		saveWriterStop(&saver);
+	}
 	CloseWindow();
 
 	return 0;